@@ -1,5 +1,9 @@
 #include "atomic.h"
 
+#include <stdbool.h>
+
+#if defined(_WIN32)
+
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
@@ -18,6 +22,11 @@ int atomic_compare_and_exchange(int* dest, int compare, int exchange)
 	return InterlockedCompareExchange(dest, exchange, compare);
 }
 
+int atomic_exchange(int* address, int value)
+{
+	return InterlockedExchange(address, value);
+}
+
 int atomic_load(int* address)
 {
 	return *(volatile int*)address;
@@ -27,3 +36,123 @@ void atomic_store(int* address, int value)
 {
 	*(volatile int*)address = value;
 }
+
+int64_t atomic_compare_and_exchange64(int64_t* dest, int64_t compare, int64_t exchange)
+{
+	return InterlockedCompareExchange64(dest, exchange, compare);
+}
+
+int64_t atomic_load64(int64_t* address)
+{
+	return InterlockedCompareExchange64(address, 0, 0);
+}
+
+int64_t atomic_add64(int64_t* address, int64_t value)
+{
+	return InterlockedExchangeAdd64(address, value);
+}
+
+void atomic_pause()
+{
+	YieldProcessor();
+}
+
+void atomic_fence()
+{
+	MemoryBarrier();
+}
+
+void atomic_fence_process()
+{
+	FlushProcessWriteBuffers();
+}
+
+#else
+
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Interlocked operations are full barriers on Windows; the sequentially
+// consistent builtins give the same guarantee. Plain loads and stores match
+// the acquire/release that volatile accesses give on x86.
+
+int atomic_increment(int* address)
+{
+	return __atomic_fetch_add(address, 1, __ATOMIC_SEQ_CST);
+}
+
+int atomic_decrement(int* address)
+{
+	return __atomic_fetch_sub(address, 1, __ATOMIC_SEQ_CST);
+}
+
+int atomic_compare_and_exchange(int* dest, int compare, int exchange)
+{
+	__atomic_compare_exchange_n(dest, &compare, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return compare;
+}
+
+int atomic_exchange(int* address, int value)
+{
+	return __atomic_exchange_n(address, value, __ATOMIC_SEQ_CST);
+}
+
+int atomic_load(int* address)
+{
+	return __atomic_load_n(address, __ATOMIC_ACQUIRE);
+}
+
+void atomic_store(int* address, int value)
+{
+	__atomic_store_n(address, value, __ATOMIC_RELEASE);
+}
+
+int64_t atomic_compare_and_exchange64(int64_t* dest, int64_t compare, int64_t exchange)
+{
+	__atomic_compare_exchange_n(dest, &compare, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return compare;
+}
+
+int64_t atomic_load64(int64_t* address)
+{
+	return __atomic_load_n(address, __ATOMIC_SEQ_CST);
+}
+
+int64_t atomic_add64(int64_t* address, int64_t value)
+{
+	return __atomic_fetch_add(address, value, __ATOMIC_SEQ_CST);
+}
+
+void atomic_pause()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+void atomic_fence()
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void atomic_fence_process()
+{
+	// The expedited barrier needs the process registered once; the global
+	// one works without it but waits for every CPU to pass a quiescent state.
+	static int s_registered;
+	if (!__atomic_load_n(&s_registered, __ATOMIC_ACQUIRE))
+	{
+		int registered = syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0 ? 1 : -1;
+		__atomic_store_n(&s_registered, registered, __ATOMIC_RELEASE);
+	}
+	if (__atomic_load_n(&s_registered, __ATOMIC_ACQUIRE) < 0 ||
+		syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0) != 0)
+	{
+		syscall(SYS_membarrier, MEMBARRIER_CMD_GLOBAL, 0);
+	}
+}
+
+#endif
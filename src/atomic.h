@@ -1,6 +1,8 @@
 #pragma once
 
-// Atomic operations on 32-bit integers.
+#include <stdint.h>
+
+// Atomic operations on 32-bit and 64-bit integers.
 
 // Increment a number atomically.
 // Returns the old value of the number.
@@ -20,6 +22,12 @@ int atomic_decrement(int* address);
 //   int old_value = *address; if (*address == compare) *address = exchange; return old_value;
 int atomic_compare_and_exchange(int* dest, int compare, int exchange);
 
+// Replace a number atomically.
+// Returns the old value of the number.
+// Performs the following operation atomically:
+//   int old_value = *address; *address = value; return old_value;
+int atomic_exchange(int* address, int value);
+
 // Reads an integer from an address.
 // All writes that occurred before the last atomic_store to this address are flushed.
 int atomic_load(int* address);
@@ -27,3 +35,27 @@ int atomic_load(int* address);
 // Writes an integer.
 // Paired with an atomic_load, can guarantee ordering and visibility.
 void atomic_store(int* address, int value);
+
+// Compare two 64-bit numbers atomically and assign if equal.
+// Returns the old value of the number.
+int64_t atomic_compare_and_exchange64(int64_t* dest, int64_t compare, int64_t exchange);
+
+// Reads a 64-bit integer from an address atomically.
+int64_t atomic_load64(int64_t* address);
+
+// Add to a 64-bit number atomically.
+// Returns the old value of the number.
+int64_t atomic_add64(int64_t* address, int64_t value);
+
+// Tell the processor the calling thread is spinning on a value.
+// Call in the body of busy-wait loops.
+void atomic_pause();
+
+// Full memory barrier.
+// No load or store moves across it in either direction.
+void atomic_fence();
+
+// Full memory barrier on every running thread of the process.
+// Much slower than atomic_fence(), but lets a rarely taken path pair with
+// a hot path on another thread that needs no fence of its own.
+void atomic_fence_process();
@@ -0,0 +1,332 @@
+#include "benchmark.h"
+
+#include "atomic.h"
+#include "debug.h"
+#include "event.h"
+#include "heap.h"
+#include "mutex.h"
+#include "queue.h"
+#include "rwlock.h"
+#include "seqlock.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <stdint.h>
+#include <string.h>
+
+enum
+{
+	k_benchmark_thread_count = 8,
+	k_heap_benchmark_iterations = 20000,
+	k_heap_benchmark_batch = 16,
+
+	k_queue_benchmark_items = 200000,
+	k_queue_benchmark_capacity = 256,
+
+	k_lock_benchmark_reads = 200000,
+	// Pauses between writes, so reads far outnumber writes.
+	k_lock_benchmark_write_spacing = 1000,
+};
+
+typedef struct heap_benchmark_data_t
+{
+	heap_t* heap;
+	event_t* start;
+} heap_benchmark_data_t;
+
+static int heap_benchmark_thread_func(void* user)
+{
+	heap_benchmark_data_t* data = user;
+	event_wait(data->start);
+
+	// Sizes roughly matching render commands, packets and trace strings.
+	static const size_t k_sizes[] = { 8, 24, 64, 96, 200, 1028 };
+
+	uint64_t t0 = timer_get_ticks();
+
+	void* blocks[k_heap_benchmark_batch];
+	for (int i = 0; i < k_heap_benchmark_iterations; ++i)
+	{
+		for (int j = 0; j < k_heap_benchmark_batch; ++j)
+		{
+			blocks[j] = heap_alloc(data->heap, k_sizes[(i + j) % _countof(k_sizes)], 8);
+		}
+		for (int j = 0; j < k_heap_benchmark_batch; ++j)
+		{
+			heap_free(data->heap, blocks[j]);
+		}
+	}
+
+	return (int)timer_ticks_to_us(timer_get_ticks() - t0);
+}
+
+static void run_heap_benchmark(bool thread_cache, const char* name)
+{
+	heap_benchmark_data_t data =
+	{
+		.heap = heap_create(2 * 1024 * 1024),
+		.start = event_create(),
+	};
+	heap_set_thread_cache_enabled(data.heap, thread_cache);
+
+	thread_t* threads[k_benchmark_thread_count];
+	for (int i = 0; i < _countof(threads); ++i)
+	{
+		threads[i] = thread_create(heap_benchmark_thread_func, &data);
+	}
+
+	event_signal(data.start);
+
+	int duration = 0;
+	for (int i = 0; i < _countof(threads); ++i)
+	{
+		duration += thread_destroy(threads[i]);
+	}
+	event_destroy(data.start);
+	heap_destroy(data.heap);
+
+	int operations = k_benchmark_thread_count * k_heap_benchmark_iterations * k_heap_benchmark_batch * 2;
+	debug_print(k_print_warning, "%s: threads=%d ops=%d duration=%dus (%.1fns/op per thread)\n",
+		name, k_benchmark_thread_count, operations, duration, duration * 1000.0 / operations);
+}
+
+void benchmark_heap()
+{
+	run_heap_benchmark(false, "heap_alloc/heap_free shared heap");
+	run_heap_benchmark(true, "heap_alloc/heap_free thread cache");
+}
+
+typedef struct queue_benchmark_data_t
+{
+	queue_t* queue;
+	event_t* start;
+	int items_per_thread;
+} queue_benchmark_data_t;
+
+static int queue_benchmark_producer_func(void* user)
+{
+	queue_benchmark_data_t* data = user;
+	event_wait(data->start);
+	for (int i = 0; i < data->items_per_thread; ++i)
+	{
+		queue_push(data->queue, (void*)(intptr_t)(i + 1));
+	}
+	return 0;
+}
+
+static int queue_benchmark_consumer_func(void* user)
+{
+	queue_benchmark_data_t* data = user;
+	event_wait(data->start);
+	for (int i = 0; i < data->items_per_thread; ++i)
+	{
+		queue_pop(data->queue);
+	}
+	return 0;
+}
+
+static void run_queue_benchmark(heap_t* heap, int thread_count)
+{
+	queue_benchmark_data_t data =
+	{
+		.queue = queue_create(heap, k_queue_benchmark_capacity),
+		.start = event_create(),
+		.items_per_thread = k_queue_benchmark_items / thread_count,
+	};
+
+	thread_t* producers[k_benchmark_thread_count];
+	thread_t* consumers[k_benchmark_thread_count];
+	for (int i = 0; i < thread_count; ++i)
+	{
+		producers[i] = thread_create(queue_benchmark_producer_func, &data);
+		consumers[i] = thread_create(queue_benchmark_consumer_func, &data);
+	}
+
+	uint64_t t0 = timer_get_ticks();
+	event_signal(data.start);
+	for (int i = 0; i < thread_count; ++i)
+	{
+		thread_destroy(producers[i]);
+		thread_destroy(consumers[i]);
+	}
+	int duration = (int)timer_ticks_to_us(timer_get_ticks() - t0);
+
+	event_destroy(data.start);
+	queue_destroy(data.queue);
+
+	int items = data.items_per_thread * thread_count;
+	debug_print(k_print_warning, "queue_push/queue_pop: producers=%d consumers=%d items=%d duration=%dus (%.1fns/item, %.2fM items/s)\n",
+		thread_count, thread_count, items, duration, duration * 1000.0 / items, duration ? items / (double)duration : 0.0);
+}
+
+void benchmark_queue()
+{
+	heap_t* heap = heap_create(2 * 1024 * 1024);
+	for (int thread_count = 1; thread_count <= k_benchmark_thread_count; thread_count *= 2)
+	{
+		run_queue_benchmark(heap, thread_count);
+	}
+	heap_destroy(heap);
+}
+
+typedef enum lock_benchmark_kind_t
+{
+	k_lock_benchmark_mutex,
+	k_lock_benchmark_rwlock,
+	k_lock_benchmark_seqlock,
+} lock_benchmark_kind_t;
+
+typedef struct lock_benchmark_data_t
+{
+	lock_benchmark_kind_t kind;
+	mutex_t* mutex;
+	rwlock_t* rwlock;
+	seqlock_t* seqlock;
+	event_t* start;
+	int readers_running;
+
+	// The guarded state: all four values always match.
+	int values[4];
+} lock_benchmark_data_t;
+
+static int lock_benchmark_reader_func(void* user)
+{
+	lock_benchmark_data_t* data = user;
+	event_wait(data->start);
+
+	uint64_t t0 = timer_get_ticks();
+
+	int torn = 0;
+	for (int i = 0; i < k_lock_benchmark_reads; ++i)
+	{
+		int values[4];
+		switch (data->kind)
+		{
+		case k_lock_benchmark_mutex:
+			mutex_lock(data->mutex);
+			memcpy(values, data->values, sizeof(values));
+			mutex_unlock(data->mutex);
+			break;
+		case k_lock_benchmark_rwlock:
+			rwlock_lock_read(data->rwlock);
+			memcpy(values, data->values, sizeof(values));
+			rwlock_unlock_read(data->rwlock);
+			break;
+		case k_lock_benchmark_seqlock:
+		{
+			int sequence;
+			do
+			{
+				sequence = seqlock_read_begin(data->seqlock);
+				memcpy(values, data->values, sizeof(values));
+			} while (seqlock_read_retry(data->seqlock, sequence));
+			break;
+		}
+		}
+		torn += values[0] != values[3];
+	}
+
+	int duration = (int)timer_ticks_to_us(timer_get_ticks() - t0);
+	atomic_decrement(&data->readers_running);
+	if (torn)
+	{
+		debug_print(k_print_error, "Lock benchmark read %d torn values!\n", torn);
+	}
+	return duration;
+}
+
+static int lock_benchmark_writer_func(void* user)
+{
+	lock_benchmark_data_t* data = user;
+	event_wait(data->start);
+
+	int writes = 0;
+	while (atomic_load(&data->readers_running) > 0)
+	{
+		switch (data->kind)
+		{
+		case k_lock_benchmark_mutex:
+			mutex_lock(data->mutex);
+			break;
+		case k_lock_benchmark_rwlock:
+			rwlock_lock_write(data->rwlock);
+			break;
+		case k_lock_benchmark_seqlock:
+			seqlock_write_begin(data->seqlock);
+			break;
+		}
+
+		++writes;
+		for (int i = 0; i < _countof(data->values); ++i)
+		{
+			data->values[i] = writes;
+		}
+
+		switch (data->kind)
+		{
+		case k_lock_benchmark_mutex:
+			mutex_unlock(data->mutex);
+			break;
+		case k_lock_benchmark_rwlock:
+			rwlock_unlock_write(data->rwlock);
+			break;
+		case k_lock_benchmark_seqlock:
+			seqlock_write_end(data->seqlock);
+			break;
+		}
+
+		for (int i = 0; i < k_lock_benchmark_write_spacing; ++i)
+		{
+			atomic_pause();
+		}
+	}
+	return writes;
+}
+
+static void run_lock_benchmark(lock_benchmark_kind_t kind, const char* name, int reader_count)
+{
+	lock_benchmark_data_t data =
+	{
+		.kind = kind,
+		.mutex = mutex_create(),
+		.rwlock = rwlock_create(),
+		.seqlock = seqlock_create(),
+		.start = event_create(),
+		.readers_running = reader_count,
+	};
+
+	thread_t* readers[k_benchmark_thread_count];
+	for (int i = 0; i < reader_count; ++i)
+	{
+		readers[i] = thread_create(lock_benchmark_reader_func, &data);
+	}
+	thread_t* writer = thread_create(lock_benchmark_writer_func, &data);
+
+	event_signal(data.start);
+
+	int duration = 0;
+	for (int i = 0; i < reader_count; ++i)
+	{
+		duration += thread_destroy(readers[i]);
+	}
+	int writes = thread_destroy(writer);
+
+	event_destroy(data.start);
+	seqlock_destroy(data.seqlock);
+	rwlock_destroy(data.rwlock);
+	mutex_destroy(data.mutex);
+
+	int reads = k_lock_benchmark_reads * reader_count;
+	debug_print(k_print_warning, "%s: readers=%d reads=%d writes=%d duration=%dus (%.1fns/read per thread)\n",
+		name, reader_count, reads, writes, duration, duration * 1000.0 / reads);
+}
+
+void benchmark_locks()
+{
+	for (int reader_count = 1; reader_count <= k_benchmark_thread_count; reader_count *= 2)
+	{
+		run_lock_benchmark(k_lock_benchmark_mutex, "mutex", reader_count);
+		run_lock_benchmark(k_lock_benchmark_rwlock, "rwlock", reader_count);
+		run_lock_benchmark(k_lock_benchmark_seqlock, "seqlock", reader_count);
+	}
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+// Engine micro-benchmarks.
+// Results are logged with debug_print() as warnings.
+
+// Time multi-threaded small allocations against one heap,
+// with and without per-thread heap caches.
+void benchmark_heap();
+
+// Time items passed through one queue by equal numbers of producer and
+// consumer threads, at 1, 2, 4 and 8 of each.
+void benchmark_queue();
+
+// Time readers of a small shared structure while one thread keeps
+// writing it, guarded by a mutex, a reader-writer lock and a seqlock,
+// at 1, 2, 4 and 8 readers.
+void benchmark_locks();
@@ -2,13 +2,30 @@
 
 #include "debug.h"
 #include "heap.h"
+#include "job.h"
 
+#include <limits.h>
 #include <string.h>
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 enum
 {
 	k_max_component_types = 64,
-	k_max_entities = 512,
+
+	// Entity records are allocated this many at a time and never move.
+	k_entity_page_shift = 10,
+	k_entity_page_size = 1 << k_entity_page_shift,
+
+	// Entities with the same component mask are stored together in chunks
+	// of this many bytes, one column per component type.
+	k_chunk_size = 16 * 1024,
+	k_chunk_alignment = 64,
+
+	// Per-worker scratch handed to parallel query functions.
+	k_worker_scratch_size = 64 * 1024,
 };
 
 typedef enum entity_state_t
@@ -19,70 +36,518 @@ typedef enum entity_state_t
 	k_entity_pending_remove,
 } entity_state_t;
 
+// Storage for every entity with one component mask.
+// Rows are kept dense across the archetype's chunks: row r lives in chunk
+// r / chunk_capacity. Rows [0, active_count) are visible to queries; rows
+// past that were added since the last update. Removal swaps the last row
+// into the hole, so an entity's components can move during ecs_update.
+typedef struct ecs_archetype_t
+{
+	uint64_t component_mask;
+	int index;
+
+	int type_count;
+	int types[k_max_component_types];
+
+	// Chunk layout: a header, the entity column, then a column per type.
+	int chunk_capacity;
+	size_t chunk_size;
+	size_t entity_offset;
+	size_t column_offsets[k_max_component_types];
+
+	int active_count;
+	int entity_count;
+
+	// Chunks are kept once allocated and reused as the archetype refills.
+	ecs_chunk_t** chunks;
+	int chunk_count;
+	int chunk_array_capacity;
+} ecs_archetype_t;
+
+typedef struct ecs_chunk_t
+{
+	ecs_archetype_t* archetype;
+} ecs_chunk_t;
+
+typedef struct ecs_entity_record_t
+{
+	int sequence;
+	entity_state_t state;
+
+	// Where the entity's components are stored.
+	ecs_archetype_t* archetype;
+	int row;
+
+	// Next slot on the free list while unused.
+	int next_free;
+} ecs_entity_record_t;
+
+// Archetypes matching a registered query, one bit per archetype index.
+typedef struct ecs_query_cache_t
+{
+	uint64_t component_mask;
+	uint64_t unwanted_component_mask;
+	uint64_t* archetype_bits;
+	int word_count;
+} ecs_query_cache_t;
+
+// Growable array of entity indices.
+typedef struct ecs_entity_list_t
+{
+	int* entities;
+	int count;
+	int capacity;
+} ecs_entity_list_t;
+
 typedef struct ecs_t
 {
 	heap_t* heap;
 	int global_sequence;
 
-	int sequences[k_max_entities];
-	entity_state_t entity_states[k_max_entities];
-	uint64_t component_masks[k_max_entities];
+	job_system_t* jobs;
+	job_counter_t* job_counter;
 
-	void* components[k_max_component_types];
+	// One scratch block per worker, plus one for the calling thread.
+	char* worker_scratch;
+	int worker_scratch_count;
+
+	// Entity records in pages, so growing never moves them.
+	ecs_entity_record_t** entity_pages;
+	int entity_page_count;
+	int entity_page_array_capacity;
+
+	// Unused entity slots, linked through the records.
+	int free_entity;
+
+	// Entities whose state changes at the next update.
+	ecs_entity_list_t pending_adds;
+	ecs_entity_list_t pending_removes;
+
+	// Archetypes in creation order, which is the order queries visit them.
+	ecs_archetype_t** archetypes;
+	int archetype_count;
+	int archetype_array_capacity;
+
+	// Registered queries, updated as archetypes are created.
+	ecs_query_cache_t* query_caches;
+	int query_cache_count;
+	int query_cache_array_capacity;
+
+	int component_type_count;
 	size_t component_type_sizes[k_max_component_types];
+	size_t component_type_alignments[k_max_component_types];
 	char component_type_names[k_max_component_types][32];
 } ecs_t;
 
-ecs_t* ecs_create(heap_t* heap)
+// One chunk of a parallel query, passed to its job.
+// Covers rows [begin, end) of one archetype, all in one storage chunk.
+typedef struct parallel_task_t
+{
+	ecs_t* ecs;
+	uint64_t mask;
+	uint64_t unwanted_mask;
+	ecs_parallel_function_t function;
+	ecs_parallel_chunk_function_t chunk_function;
+	const int* column_types;
+	int column_count;
+	void* user;
+	int index;
+	int archetype;
+	int begin;
+	int end;
+} parallel_task_t;
+
+ecs_t* ecs_create(heap_t* heap, job_system_t* jobs)
 {
-	ecs_t* ecs = heap_alloc(heap, sizeof(ecs_t), 8);
+	ecs_t* ecs = heap_alloc_tagged(heap, sizeof(ecs_t), 8, k_heap_tag_ecs);
 	memset(ecs, 0, sizeof(*ecs));
 	ecs->heap = heap;
 	ecs->global_sequence = 1;
+	ecs->free_entity = -1;
+
+	ecs->jobs = jobs;
+	ecs->job_counter = jobs ? job_counter_create(jobs) : NULL;
+	ecs->worker_scratch_count = jobs ? job_system_get_worker_count(jobs) + 1 : 1;
+	ecs->worker_scratch = heap_alloc_tagged(heap, (size_t)k_worker_scratch_size * ecs->worker_scratch_count, 64, k_heap_tag_ecs);
 	return ecs;
 }
 
 void ecs_destroy(ecs_t* ecs)
 {
-	for (int i = 0; i < _countof(ecs->components); ++i)
+	for (int i = 0; i < ecs->archetype_count; ++i)
 	{
-		if (ecs->components[i])
+		ecs_archetype_t* archetype = ecs->archetypes[i];
+		for (int c = 0; c < archetype->chunk_count; ++c)
 		{
-			heap_free(ecs->heap, ecs->components[i]);
+			heap_free(ecs->heap, archetype->chunks[c]);
 		}
+		if (archetype->chunks)
+		{
+			heap_free(ecs->heap, archetype->chunks);
+		}
+		heap_free(ecs->heap, archetype);
+	}
+	if (ecs->archetypes)
+	{
+		heap_free(ecs->heap, ecs->archetypes);
+	}
+	for (int i = 0; i < ecs->query_cache_count; ++i)
+	{
+		if (ecs->query_caches[i].archetype_bits)
+		{
+			heap_free(ecs->heap, ecs->query_caches[i].archetype_bits);
+		}
+	}
+	if (ecs->query_caches)
+	{
+		heap_free(ecs->heap, ecs->query_caches);
 	}
+	for (int i = 0; i < ecs->entity_page_count; ++i)
+	{
+		heap_free(ecs->heap, ecs->entity_pages[i]);
+	}
+	if (ecs->entity_pages)
+	{
+		heap_free(ecs->heap, ecs->entity_pages);
+	}
+	if (ecs->pending_adds.entities)
+	{
+		heap_free(ecs->heap, ecs->pending_adds.entities);
+	}
+	if (ecs->pending_removes.entities)
+	{
+		heap_free(ecs->heap, ecs->pending_removes.entities);
+	}
+	if (ecs->job_counter)
+	{
+		job_counter_destroy(ecs->job_counter);
+	}
+	heap_free(ecs->heap, ecs->worker_scratch);
 	heap_free(ecs->heap, ecs);
 }
 
-void ecs_update(ecs_t* ecs)
+static size_t align_up(size_t value, size_t alignment)
+{
+	return (value + (alignment - 1)) & ~(alignment - 1);
+}
+
+// Grow an array of pointers, charging it to the ecs tag from the start.
+static void* ecs_grow(ecs_t* ecs, void* address, size_t size)
+{
+	return address ? heap_realloc(ecs->heap, address, size, 8) : heap_alloc_tagged(ecs->heap, size, 8, k_heap_tag_ecs);
+}
+
+static ecs_entity_record_t* ecs_entity_record(ecs_t* ecs, int entity)
+{
+	return &ecs->entity_pages[entity >> k_entity_page_shift][entity & (k_entity_page_size - 1)];
+}
+
+static void ecs_entity_list_push(ecs_t* ecs, ecs_entity_list_t* list, int entity)
+{
+	if (list->count == list->capacity)
+	{
+		list->capacity = list->capacity ? list->capacity * 2 : 64;
+		list->entities = ecs_grow(ecs, list->entities, sizeof(int) * list->capacity);
+	}
+	list->entities[list->count++] = entity;
+}
+
+// Add a page of entity records and put its slots on the free list,
+// lowest index first.
+static void ecs_entity_page_add(ecs_t* ecs)
+{
+	if (ecs->entity_page_count == ecs->entity_page_array_capacity)
+	{
+		ecs->entity_page_array_capacity = ecs->entity_page_array_capacity ? ecs->entity_page_array_capacity * 2 : 8;
+		ecs->entity_pages = ecs_grow(ecs, ecs->entity_pages, sizeof(ecs_entity_record_t*) * ecs->entity_page_array_capacity);
+	}
+	ecs_entity_record_t* page = heap_alloc_tagged(ecs->heap, sizeof(ecs_entity_record_t) * k_entity_page_size, 8, k_heap_tag_ecs);
+	memset(page, 0, sizeof(ecs_entity_record_t) * k_entity_page_size);
+
+	int first = ecs->entity_page_count << k_entity_page_shift;
+	ecs->entity_pages[ecs->entity_page_count++] = page;
+	for (int i = k_entity_page_size - 1; i >= 0; --i)
+	{
+		page[i].next_free = ecs->free_entity;
+		ecs->free_entity = first + i;
+	}
+}
+
+static bool ecs_archetype_matches(ecs_archetype_t* archetype, uint64_t mask, uint64_t unwanted_mask)
+{
+	return (archetype->component_mask & mask) == mask && (archetype->component_mask & unwanted_mask) == 0;
+}
+
+static int ecs_count_trailing_zeros(uint64_t value)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, value);
+	return (int)index;
+#else
+	return __builtin_ctzll(value);
+#endif
+}
+
+static void ecs_query_cache_add_archetype(ecs_t* ecs, ecs_query_cache_t* cache, int archetype)
 {
-	for (int i = 0; i < _countof(ecs->entity_states); ++i)
+	int word = archetype >> 6;
+	if (word >= cache->word_count)
 	{
-		if (ecs->entity_states[i] == k_entity_pending_add)
+		int word_count = cache->word_count ? cache->word_count : 1;
+		while (word >= word_count)
 		{
-			ecs->entity_states[i] = k_entity_active;
+			word_count *= 2;
 		}
-		else if (ecs->entity_states[i] == k_entity_pending_remove)
+		cache->archetype_bits = ecs_grow(ecs, cache->archetype_bits, sizeof(uint64_t) * word_count);
+		memset(cache->archetype_bits + cache->word_count, 0, sizeof(uint64_t) * (word_count - cache->word_count));
+		cache->word_count = word_count;
+	}
+	cache->archetype_bits[word] |= 1ULL << (archetype & 63);
+}
+
+static int ecs_query_cache_find(ecs_t* ecs, uint64_t mask, uint64_t unwanted_mask)
+{
+	for (int i = 0; i < ecs->query_cache_count; ++i)
+	{
+		if (ecs->query_caches[i].component_mask == mask && ecs->query_caches[i].unwanted_component_mask == unwanted_mask)
 		{
-			ecs->entity_states[i] = k_entity_unused;
+			return i;
 		}
 	}
+	return -1;
 }
 
-int ecs_register_component_type(ecs_t* ecs, const char* name, size_t size_per_component, size_t alignment)
+// Find the first archetype at or after index that a query matches.
+// With a cache this skips whole words of non-matching archetypes at a time.
+// Returns the archetype count if there is none.
+static int ecs_query_find_archetype(ecs_t* ecs, int cache_index, uint64_t mask, uint64_t unwanted_mask, int index)
 {
-	for (int i = 0; i < _countof(ecs->components); ++i)
+	if (cache_index < 0)
 	{
-		if (ecs->components[i] == NULL)
+		for (; index < ecs->archetype_count; ++index)
 		{
-			size_t aligned_size = (size_per_component + (alignment - 1)) & ~(alignment - 1);
-			strcpy_s(ecs->component_type_names[i], sizeof(ecs->component_type_names[i]), name);
-			ecs->component_type_sizes[i] = aligned_size;
-			ecs->components[i] = heap_alloc(ecs->heap, aligned_size * k_max_entities, alignment);
-			memset(ecs->components[i], 0, aligned_size * k_max_entities);
-			return i;
+			if (ecs_archetype_matches(ecs->archetypes[index], mask, unwanted_mask))
+			{
+				return index;
+			}
+		}
+		return ecs->archetype_count;
+	}
+
+	ecs_query_cache_t* cache = &ecs->query_caches[cache_index];
+	int word = index >> 6;
+	if (word >= cache->word_count)
+	{
+		return ecs->archetype_count;
+	}
+	uint64_t bits = cache->archetype_bits[word] & (~0ULL << (index & 63));
+	while (!bits)
+	{
+		if (++word >= cache->word_count)
+		{
+			return ecs->archetype_count;
+		}
+		bits = cache->archetype_bits[word];
+	}
+	return (word << 6) + ecs_count_trailing_zeros(bits);
+}
+
+// Lay out a chunk holding capacity rows of an archetype.
+// Returns the number of bytes the layout needs.
+static size_t ecs_archetype_layout(ecs_t* ecs, ecs_archetype_t* archetype, int capacity)
+{
+	size_t offset = align_up(sizeof(ecs_chunk_t), k_chunk_alignment);
+	archetype->entity_offset = offset;
+	offset += sizeof(int) * capacity;
+	for (int i = 0; i < archetype->type_count; ++i)
+	{
+		int type = archetype->types[i];
+		offset = align_up(offset, ecs->component_type_alignments[type]);
+		archetype->column_offsets[type] = offset;
+		offset += ecs->component_type_sizes[type] * capacity;
+	}
+	return offset;
+}
+
+static ecs_archetype_t* ecs_archetype_create(ecs_t* ecs, uint64_t component_mask)
+{
+	ecs_archetype_t* archetype = heap_alloc_tagged(ecs->heap, sizeof(ecs_archetype_t), 8, k_heap_tag_ecs);
+	memset(archetype, 0, sizeof(*archetype));
+	archetype->component_mask = component_mask;
+	archetype->index = ecs->archetype_count;
+
+	size_t row_size = sizeof(int);
+	for (int i = 0; i < ecs->component_type_count; ++i)
+	{
+		if (component_mask & (1ULL << i))
+		{
+			archetype->types[archetype->type_count++] = i;
+			row_size += ecs->component_type_sizes[i];
+		}
+	}
+
+	// Start from the estimate ignoring padding and back off until it fits.
+	// Rows bigger than a chunk get a chunk each.
+	size_t header_size = align_up(sizeof(ecs_chunk_t), k_chunk_alignment);
+	int capacity = (int)((k_chunk_size - header_size) / row_size);
+	while (capacity > 1 && ecs_archetype_layout(ecs, archetype, capacity) > k_chunk_size)
+	{
+		--capacity;
+	}
+	if (capacity < 1)
+	{
+		capacity = 1;
+	}
+	archetype->chunk_capacity = capacity;
+	archetype->chunk_size = align_up(ecs_archetype_layout(ecs, archetype, capacity), k_chunk_alignment);
+	if (archetype->chunk_size < k_chunk_size)
+	{
+		archetype->chunk_size = k_chunk_size;
+	}
+
+	if (ecs->archetype_count == ecs->archetype_array_capacity)
+	{
+		ecs->archetype_array_capacity = ecs->archetype_array_capacity ? ecs->archetype_array_capacity * 2 : 8;
+		ecs->archetypes = ecs_grow(ecs, ecs->archetypes, sizeof(ecs_archetype_t*) * ecs->archetype_array_capacity);
+	}
+	ecs->archetypes[ecs->archetype_count++] = archetype;
+
+	for (int i = 0; i < ecs->query_cache_count; ++i)
+	{
+		ecs_query_cache_t* cache = &ecs->query_caches[i];
+		if (ecs_archetype_matches(archetype, cache->component_mask, cache->unwanted_component_mask))
+		{
+			ecs_query_cache_add_archetype(ecs, cache, archetype->index);
+		}
+	}
+	return archetype;
+}
+
+static ecs_archetype_t* ecs_archetype_find(ecs_t* ecs, uint64_t component_mask)
+{
+	for (int i = 0; i < ecs->archetype_count; ++i)
+	{
+		if (ecs->archetypes[i]->component_mask == component_mask)
+		{
+			return ecs->archetypes[i];
+		}
+	}
+	return ecs_archetype_create(ecs, component_mask);
+}
+
+static int* ecs_chunk_entities(ecs_archetype_t* archetype, ecs_chunk_t* chunk)
+{
+	return (int*)((char*)chunk + archetype->entity_offset);
+}
+
+static char* ecs_chunk_component(ecs_t* ecs, ecs_archetype_t* archetype, ecs_chunk_t* chunk, int chunk_row, int component_type)
+{
+	return (char*)chunk + archetype->column_offsets[component_type] + ecs->component_type_sizes[component_type] * chunk_row;
+}
+
+static char* ecs_archetype_component(ecs_t* ecs, ecs_archetype_t* archetype, int row, int component_type)
+{
+	ecs_chunk_t* chunk = archetype->chunks[row / archetype->chunk_capacity];
+	return ecs_chunk_component(ecs, archetype, chunk, row % archetype->chunk_capacity, component_type);
+}
+
+// Append a zeroed row for entity to the end of an archetype.
+static int ecs_archetype_push(ecs_t* ecs, ecs_archetype_t* archetype, int entity)
+{
+	int row = archetype->entity_count++;
+	int chunk_index = row / archetype->chunk_capacity;
+	if (chunk_index == archetype->chunk_count)
+	{
+		if (archetype->chunk_count == archetype->chunk_array_capacity)
+		{
+			archetype->chunk_array_capacity = archetype->chunk_array_capacity ? archetype->chunk_array_capacity * 2 : 4;
+			archetype->chunks = ecs_grow(ecs, archetype->chunks, sizeof(ecs_chunk_t*) * archetype->chunk_array_capacity);
+		}
+		ecs_chunk_t* chunk = heap_alloc_tagged(ecs->heap, archetype->chunk_size, k_chunk_alignment, k_heap_tag_ecs);
+		chunk->archetype = archetype;
+		archetype->chunks[archetype->chunk_count++] = chunk;
+	}
+
+	ecs_chunk_t* chunk = archetype->chunks[chunk_index];
+	int chunk_row = row % archetype->chunk_capacity;
+	ecs_chunk_entities(archetype, chunk)[chunk_row] = entity;
+	for (int i = 0; i < archetype->type_count; ++i)
+	{
+		int type = archetype->types[i];
+		memset(ecs_chunk_component(ecs, archetype, chunk, chunk_row, type), 0, ecs->component_type_sizes[type]);
+	}
+	return row;
+}
+
+// Remove a row by moving the archetype's last row into it.
+static void ecs_archetype_remove(ecs_t* ecs, ecs_archetype_t* archetype, int row)
+{
+	int last = --archetype->entity_count;
+	if (row != last)
+	{
+		ecs_chunk_t* chunk = archetype->chunks[row / archetype->chunk_capacity];
+		ecs_chunk_t* last_chunk = archetype->chunks[last / archetype->chunk_capacity];
+		int chunk_row = row % archetype->chunk_capacity;
+		int last_chunk_row = last % archetype->chunk_capacity;
+		for (int i = 0; i < archetype->type_count; ++i)
+		{
+			int type = archetype->types[i];
+			memcpy(ecs_chunk_component(ecs, archetype, chunk, chunk_row, type),
+				ecs_chunk_component(ecs, archetype, last_chunk, last_chunk_row, type),
+				ecs->component_type_sizes[type]);
+		}
+		int moved = ecs_chunk_entities(archetype, last_chunk)[last_chunk_row];
+		ecs_chunk_entities(archetype, chunk)[chunk_row] = moved;
+		ecs_entity_record(ecs, moved)->row = row;
+	}
+	if (archetype->active_count > archetype->entity_count)
+	{
+		archetype->active_count = archetype->entity_count;
+	}
+}
+
+void ecs_update(ecs_t* ecs)
+{
+	// Everything added since the last update becomes visible at once, so
+	// the pending rows at the end of each archetype simply join the rest.
+	for (int i = 0; i < ecs->archetype_count; ++i)
+	{
+		ecs->archetypes[i]->active_count = ecs->archetypes[i]->entity_count;
+	}
+	for (int i = 0; i < ecs->pending_adds.count; ++i)
+	{
+		ecs_entity_record_t* record = ecs_entity_record(ecs, ecs->pending_adds.entities[i]);
+		if (record->state == k_entity_pending_add)
+		{
+			record->state = k_entity_active;
 		}
 	}
+	ecs->pending_adds.count = 0;
+
+	for (int i = 0; i < ecs->pending_removes.count; ++i)
+	{
+		int entity = ecs->pending_removes.entities[i];
+		ecs_entity_record_t* record = ecs_entity_record(ecs, entity);
+		ecs_archetype_remove(ecs, record->archetype, record->row);
+		record->archetype = NULL;
+		record->state = k_entity_unused;
+		record->next_free = ecs->free_entity;
+		ecs->free_entity = entity;
+	}
+	ecs->pending_removes.count = 0;
+}
+
+int ecs_register_component_type(ecs_t* ecs, const char* name, size_t size_per_component, size_t alignment)
+{
+	if (ecs->component_type_count < k_max_component_types)
+	{
+		int i = ecs->component_type_count++;
+		strcpy_s(ecs->component_type_names[i], sizeof(ecs->component_type_names[i]), name);
+		ecs->component_type_sizes[i] = align_up(size_per_component, alignment);
+		ecs->component_type_alignments[i] = alignment;
+		return i;
+	}
 	debug_print(k_print_warning, "Out of component types.");
 	return -1;
 }
@@ -94,25 +559,32 @@ size_t ecs_get_component_type_size(ecs_t* ecs, int component_type)
 
 ecs_entity_ref_t ecs_entity_add(ecs_t* ecs, uint64_t component_mask)
 {
-	for (int i = 0; i < _countof(ecs->entity_states); ++i)
+	if (ecs->free_entity < 0)
 	{
-		if (ecs->entity_states[i] == k_entity_unused)
-		{
-			ecs->entity_states[i] = k_entity_pending_add;
-			ecs->sequences[i] = ecs->global_sequence++;
-			ecs->component_masks[i] = component_mask;
-			return (ecs_entity_ref_t) { .entity = i, .sequence = ecs->sequences[i] };
-		}
+		ecs_entity_page_add(ecs);
 	}
-	debug_print(k_print_warning, "Out of entities.");
-	return (ecs_entity_ref_t) { .entity = -1, .sequence = -1 };
+	int entity = ecs->free_entity;
+	ecs_entity_record_t* record = ecs_entity_record(ecs, entity);
+	ecs->free_entity = record->next_free;
+
+	record->state = k_entity_pending_add;
+	record->sequence = ecs->global_sequence++;
+	record->archetype = ecs_archetype_find(ecs, component_mask);
+	record->row = ecs_archetype_push(ecs, record->archetype, entity);
+	ecs_entity_list_push(ecs, &ecs->pending_adds, entity);
+	return (ecs_entity_ref_t) { .entity = entity, .sequence = record->sequence };
 }
 
 void ecs_entity_remove(ecs_t* ecs, ecs_entity_ref_t ref, bool allow_pending_add)
 {
 	if (ecs_is_entity_ref_valid(ecs, ref, allow_pending_add))
 	{
-		ecs->entity_states[ref.entity] = k_entity_pending_remove;
+		ecs_entity_record_t* record = ecs_entity_record(ecs, ref.entity);
+		if (record->state != k_entity_pending_remove)
+		{
+			record->state = k_entity_pending_remove;
+			ecs_entity_list_push(ecs, &ecs->pending_removes, ref.entity);
+		}
 	}
 	else
 	{
@@ -122,25 +594,100 @@ void ecs_entity_remove(ecs_t* ecs, ecs_entity_ref_t ref, bool allow_pending_add)
 
 bool ecs_is_entity_ref_valid(ecs_t* ecs, ecs_entity_ref_t ref, bool allow_pending_add)
 {
-	return ref.entity >= 0 &&
-		ecs->sequences[ref.entity] == ref.sequence &&
-		ecs->entity_states[ref.entity] >= (allow_pending_add ? k_entity_pending_add : k_entity_active);
+	if (ref.entity < 0 || ref.entity >= ecs->entity_page_count << k_entity_page_shift)
+	{
+		return false;
+	}
+	ecs_entity_record_t* record = ecs_entity_record(ecs, ref.entity);
+	return record->sequence == ref.sequence &&
+		record->state >= (allow_pending_add ? k_entity_pending_add : k_entity_active);
 }
 
 void* ecs_entity_get_component(ecs_t* ecs, ecs_entity_ref_t ref, int component_type, bool allow_pending_add)
 {
-	if (ecs_is_entity_ref_valid(ecs, ref, allow_pending_add) && ecs->components[component_type])
+	if (ecs_is_entity_ref_valid(ecs, ref, allow_pending_add))
 	{
-		char* components = ecs->components[component_type];
-		return &components[ecs->component_type_sizes[component_type] * ref.entity];
+		ecs_entity_record_t* record = ecs_entity_record(ecs, ref.entity);
+		if (record->archetype->component_mask & (1ULL << component_type))
+		{
+			return ecs_archetype_component(ecs, record->archetype, record->row, component_type);
+		}
 	}
 	return NULL;
 }
 
+void ecs_register_query(ecs_t* ecs, uint64_t mask, uint64_t unwanted_mask)
+{
+	if (ecs_query_cache_find(ecs, mask, unwanted_mask) >= 0)
+	{
+		return;
+	}
+	if (ecs->query_cache_count == ecs->query_cache_array_capacity)
+	{
+		ecs->query_cache_array_capacity = ecs->query_cache_array_capacity ? ecs->query_cache_array_capacity * 2 : 8;
+		ecs->query_caches = ecs_grow(ecs, ecs->query_caches, sizeof(ecs_query_cache_t) * ecs->query_cache_array_capacity);
+	}
+	ecs_query_cache_t* cache = &ecs->query_caches[ecs->query_cache_count++];
+	cache->component_mask = mask;
+	cache->unwanted_component_mask = unwanted_mask;
+	cache->archetype_bits = NULL;
+	cache->word_count = 0;
+	for (int i = 0; i < ecs->archetype_count; ++i)
+	{
+		if (ecs_archetype_matches(ecs->archetypes[i], mask, unwanted_mask))
+		{
+			ecs_query_cache_add_archetype(ecs, cache, i);
+		}
+	}
+}
+
+static int ecs_query_row_end(ecs_query_t* query, ecs_archetype_t* archetype)
+{
+	return query->row_end >= 0 ? query->row_end : archetype->active_count;
+}
+
+// Point the query at its current row, or the first matching row after it.
+static void ecs_query_seek(ecs_t* ecs, ecs_query_t* query)
+{
+	for (;; ++query->archetype, query->row = 0)
+	{
+		int found = ecs_query_find_archetype(ecs, query->cache, query->component_mask, query->unwanted_component_mask, query->archetype);
+		if (found != query->archetype)
+		{
+			query->archetype = found;
+			query->row = 0;
+		}
+		if (query->archetype >= query->archetype_end || query->archetype >= ecs->archetype_count)
+		{
+			break;
+		}
+		ecs_archetype_t* archetype = ecs->archetypes[query->archetype];
+		if (query->row < ecs_query_row_end(query, archetype))
+		{
+			query->chunk = archetype->chunks[query->row / archetype->chunk_capacity];
+			query->chunk_row = query->row % archetype->chunk_capacity;
+			query->entity = ecs_chunk_entities(archetype, query->chunk)[query->chunk_row];
+			return;
+		}
+	}
+	query->entity = -1;
+	query->chunk = NULL;
+}
+
 ecs_query_t ecs_query_create(ecs_t* ecs, uint64_t mask, uint64_t unwanted_mask)
 {
-	ecs_query_t query = { .component_mask = mask, .unwanted_component_mask = unwanted_mask, .entity = -1 };
-	ecs_query_next(ecs, &query);
+	ecs_query_t query =
+	{
+		.component_mask = mask,
+		.unwanted_component_mask = unwanted_mask,
+		.entity = -1,
+		.cache = ecs_query_cache_find(ecs, mask, unwanted_mask),
+		.archetype = 0,
+		.archetype_end = INT_MAX,
+		.row = 0,
+		.row_end = -1,
+	};
+	ecs_query_seek(ecs, &query);
 	return query;
 }
 
@@ -151,28 +698,263 @@ bool ecs_query_is_valid(ecs_t* ecs, ecs_query_t* query)
 
 void ecs_query_next(ecs_t* ecs, ecs_query_t* query)
 {
-	for (int i = query->entity + 1; i < _countof(ecs->component_masks); ++i)
+	if (query->entity < 0)
 	{
-		if(ecs->component_masks[i] & query->unwanted_component_mask)
-		{
-			continue;
-		}
-		if ((ecs->component_masks[i] & query->component_mask) == query->component_mask && ecs->entity_states[i] >= k_entity_active)
+		return;
+	}
+
+	// Stay inside the current chunk without dividing where possible.
+	ecs_archetype_t* archetype = ecs->archetypes[query->archetype];
+	if (++query->row < ecs_query_row_end(query, archetype))
+	{
+		if (++query->chunk_row == archetype->chunk_capacity)
 		{
-			query->entity = i;
-			return;
+			query->chunk = archetype->chunks[query->row / archetype->chunk_capacity];
+			query->chunk_row = 0;
 		}
+		query->entity = ecs_chunk_entities(archetype, query->chunk)[query->chunk_row];
+		return;
 	}
-	query->entity = -1;
+
+	++query->archetype;
+	query->row = 0;
+	ecs_query_seek(ecs, query);
+}
+
+void ecs_query_next_chunk(ecs_t* ecs, ecs_query_t* query)
+{
+	if (query->entity < 0)
+	{
+		return;
+	}
+	int count = ecs_query_get_chunk_count(ecs, query);
+	query->row += count - 1;
+	query->chunk_row += count - 1;
+	ecs_query_next(ecs, query);
+}
+
+int ecs_query_get_chunk_count(ecs_t* ecs, ecs_query_t* query)
+{
+	if (query->entity < 0)
+	{
+		return 0;
+	}
+	ecs_archetype_t* archetype = ecs->archetypes[query->archetype];
+	int chunk_remaining = archetype->chunk_capacity - query->chunk_row;
+	int query_remaining = ecs_query_row_end(query, archetype) - query->row;
+	return chunk_remaining < query_remaining ? chunk_remaining : query_remaining;
 }
 
 void* ecs_query_get_component(ecs_t* ecs, ecs_query_t* query, int component_type)
 {
-	char* components = ecs->components[component_type];
-	return &components[ecs->component_type_sizes[component_type] * query->entity];
+	ecs_archetype_t* archetype = ecs->archetypes[query->archetype];
+	if ((archetype->component_mask & (1ULL << component_type)) == 0)
+	{
+		return NULL;
+	}
+	return ecs_chunk_component(ecs, archetype, query->chunk, query->chunk_row, component_type);
 }
 
 ecs_entity_ref_t ecs_query_get_entity(ecs_t* ecs, ecs_query_t* query)
 {
-	return (ecs_entity_ref_t) { .entity = query->entity, .sequence = ecs->sequences[query->entity] };
+	return (ecs_entity_ref_t) { .entity = query->entity, .sequence = ecs_entity_record(ecs, query->entity)->sequence };
+}
+
+// Limit a requested column count to what a chunk query can hold.
+static int ecs_query_chunk_clamp_columns(int column_count)
+{
+	if (column_count > k_ecs_query_chunk_max_columns)
+	{
+		debug_print(k_print_warning, "Chunk query asked for %d columns; only %d are supported.\n", column_count, k_ecs_query_chunk_max_columns);
+		return k_ecs_query_chunk_max_columns;
+	}
+	return column_count;
+}
+
+// Point a chunk query's count and columns at the run its query is on.
+// Column count must already be clamped.
+static void ecs_query_chunk_fill(ecs_t* ecs, ecs_query_chunk_t* query_chunk, const int* column_types, int column_count)
+{
+	ecs_query_t* query = &query_chunk->query;
+	query_chunk->count = ecs_query_get_chunk_count(ecs, query);
+	query_chunk->column_count = column_count;
+	for (int i = 0; i < column_count; ++i)
+	{
+		int type = column_types[i];
+		query_chunk->column_types[i] = type;
+		query_chunk->columns[i] = query_chunk->count ? ecs_query_get_component(ecs, query, type) : NULL;
+	}
+}
+
+ecs_query_chunk_t ecs_query_chunk_create(ecs_t* ecs, uint64_t mask, uint64_t unwanted_mask, const int* column_types, int column_count)
+{
+	ecs_query_chunk_t query_chunk = { .query = ecs_query_create(ecs, mask, unwanted_mask) };
+	ecs_query_chunk_fill(ecs, &query_chunk, column_types, ecs_query_chunk_clamp_columns(column_count));
+	return query_chunk;
+}
+
+bool ecs_query_chunk_is_valid(ecs_t* ecs, ecs_query_chunk_t* query_chunk)
+{
+	return query_chunk->count > 0;
+}
+
+void ecs_query_chunk_next(ecs_t* ecs, ecs_query_chunk_t* query_chunk)
+{
+	ecs_query_next_chunk(ecs, &query_chunk->query);
+	ecs_query_chunk_fill(ecs, query_chunk, query_chunk->column_types, query_chunk->column_count);
+}
+
+ecs_entity_ref_t ecs_query_chunk_get_entity(ecs_t* ecs, ecs_query_chunk_t* query_chunk, int index)
+{
+	ecs_query_t* query = &query_chunk->query;
+	int entity = ecs_chunk_entities(ecs->archetypes[query->archetype], query->chunk)[query->chunk_row + index];
+	return (ecs_entity_ref_t) { .entity = entity, .sequence = ecs_entity_record(ecs, entity)->sequence };
+}
+
+static void parallel_task_run(void* user)
+{
+	parallel_task_t* task = user;
+	ecs_t* ecs = task->ecs;
+
+	int worker = ecs->jobs ? job_system_get_worker_index(ecs->jobs) + 1 : 0;
+	ecs_parallel_chunk_t chunk =
+	{
+		.index = task->index,
+		.worker = worker,
+		.scratch = ecs->worker_scratch + (size_t)k_worker_scratch_size * worker,
+		.scratch_size = k_worker_scratch_size,
+	};
+
+	ecs_query_t query =
+	{
+		.component_mask = task->mask,
+		.unwanted_component_mask = task->unwanted_mask,
+		.entity = -1,
+		.cache = -1,
+		.archetype = task->archetype,
+		.archetype_end = task->archetype + 1,
+		.row = task->begin,
+		.row_end = task->end,
+	};
+	ecs_query_seek(ecs, &query);
+
+	// A task never straddles a storage chunk, so it is a single run.
+	if (task->chunk_function)
+	{
+		ecs_query_chunk_t query_chunk = { .query = query };
+		ecs_query_chunk_fill(ecs, &query_chunk, task->column_types, task->column_count);
+		if (ecs_query_chunk_is_valid(ecs, &query_chunk))
+		{
+			task->chunk_function(ecs, &query_chunk, &chunk, task->user);
+		}
+		return;
+	}
+
+	for (; ecs_query_is_valid(ecs, &query); ecs_query_next(ecs, &query))
+	{
+		task->function(ecs, &query, &chunk, task->user);
+	}
+}
+
+// Split the matching rows of every archetype into pieces of at most grain
+// rows that never straddle a storage chunk.
+// Fills tasks if non-NULL and returns how many pieces there are.
+static int parallel_tasks_build(ecs_t* ecs, uint64_t mask, uint64_t unwanted_mask, int grain, parallel_task_t* tasks)
+{
+	int count = 0;
+	int cache = ecs_query_cache_find(ecs, mask, unwanted_mask);
+	for (int a = ecs_query_find_archetype(ecs, cache, mask, unwanted_mask, 0);
+		a < ecs->archetype_count;
+		a = ecs_query_find_archetype(ecs, cache, mask, unwanted_mask, a + 1))
+	{
+		ecs_archetype_t* archetype = ecs->archetypes[a];
+		for (int chunk_begin = 0; chunk_begin < archetype->active_count; chunk_begin += archetype->chunk_capacity)
+		{
+			int chunk_end = chunk_begin + archetype->chunk_capacity;
+			if (chunk_end > archetype->active_count)
+			{
+				chunk_end = archetype->active_count;
+			}
+			for (int begin = chunk_begin; begin < chunk_end; begin += grain)
+			{
+				if (tasks)
+				{
+					tasks[count].archetype = a;
+					tasks[count].begin = begin;
+					tasks[count].end = begin + grain < chunk_end ? begin + grain : chunk_end;
+				}
+				++count;
+			}
+		}
+	}
+	return count;
+}
+
+// Run a parallel query, with every task a copy of prototype over its own rows.
+static void parallel_run(ecs_t* ecs, const parallel_task_t* prototype, int grain)
+{
+	int chunk_count = parallel_tasks_build(ecs, prototype->mask, prototype->unwanted_mask, grain, NULL);
+	if (chunk_count == 0)
+	{
+		return;
+	}
+
+	parallel_task_t* tasks = heap_alloc_tagged(ecs->heap, sizeof(parallel_task_t) * chunk_count, 8, k_heap_tag_ecs);
+	for (int i = 0; i < chunk_count; ++i)
+	{
+		tasks[i] = *prototype;
+		tasks[i].index = i;
+	}
+	parallel_tasks_build(ecs, prototype->mask, prototype->unwanted_mask, grain, tasks);
+
+	if (ecs->jobs && chunk_count > 1)
+	{
+		for (int i = 0; i < chunk_count; ++i)
+		{
+			job_submit(ecs->jobs, parallel_task_run, &tasks[i], ecs->job_counter);
+		}
+		job_wait(ecs->job_counter);
+	}
+	else
+	{
+		for (int i = 0; i < chunk_count; ++i)
+		{
+			parallel_task_run(&tasks[i]);
+		}
+	}
+
+	heap_free(ecs->heap, tasks);
+}
+
+void ecs_query_parallel_for(ecs_t* ecs, uint64_t mask, uint64_t unwanted_mask, ecs_parallel_function_t function, void* user, int grain)
+{
+	parallel_task_t prototype =
+	{
+		.ecs = ecs,
+		.mask = mask,
+		.unwanted_mask = unwanted_mask,
+		.function = function,
+		.user = user,
+	};
+	parallel_run(ecs, &prototype, grain);
+}
+
+void ecs_query_parallel_for_chunks(ecs_t* ecs, uint64_t mask, uint64_t unwanted_mask, const int* column_types, int column_count, ecs_parallel_chunk_function_t function, void* user, int grain)
+{
+	parallel_task_t prototype =
+	{
+		.ecs = ecs,
+		.mask = mask,
+		.unwanted_mask = unwanted_mask,
+		.chunk_function = function,
+		.column_types = column_types,
+		.column_count = ecs_query_chunk_clamp_columns(column_count),
+		.user = user,
+	};
+	parallel_run(ecs, &prototype, grain);
+}
+
+int ecs_query_parallel_chunk_count(ecs_t* ecs, uint64_t mask, uint64_t unwanted_mask, int grain)
+{
+	return parallel_tasks_build(ecs, mask, unwanted_mask, grain, NULL);
 }
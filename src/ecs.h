@@ -2,15 +2,27 @@
 
 // Entity Component System
 // Framework for game entities and their components.
+//
+// Entities with the same set of component types are stored together in
+// fixed-size chunks, one contiguous column per component type. Queries
+// visit only the chunks whose component types match, and the entities a
+// query visits within a chunk are contiguous in every column.
+// Components can move when entities are removed, so pointers to them are
+// only good until the next ecs_update.
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct heap_t heap_t;
+typedef struct job_system_t job_system_t;
 
 // Handle to an entity component system interface.
 typedef struct ecs_t ecs_t;
 
+// Handle to a block of storage for entities sharing component types.
+typedef struct ecs_chunk_t ecs_chunk_t;
+
 // Weak reference to an entity.
 typedef struct ecs_entity_ref_t
 {
@@ -24,10 +36,66 @@ typedef struct ecs_query_t
 	uint64_t component_mask;
 	uint64_t unwanted_component_mask;
 	int entity;
+
+	// Registered query whose matching archetypes are cached, or -1.
+	int cache;
+
+	// Current archetype and row within it, and where the query stops.
+	// A row_end of -1 runs to the end of each archetype.
+	int archetype;
+	int archetype_end;
+	int row;
+	int row_end;
+
+	// Storage chunk holding the current row, and the row within it.
+	ecs_chunk_t* chunk;
+	int chunk_row;
 } ecs_query_t;
 
+enum
+{
+	// Most component columns one chunk query can return.
+	k_ecs_query_chunk_max_columns = 8,
+};
+
+// A run of matching entities stored contiguously.
+// columns[i] points to count components of type column_types[i], laid out
+// as a plain array, so systems can loop over them or hand them to batched
+// math. A column is NULL if its type is not on these entities.
+typedef struct ecs_query_chunk_t
+{
+	ecs_query_t query;
+	int count;
+	int column_count;
+	int column_types[k_ecs_query_chunk_max_columns];
+	void* columns[k_ecs_query_chunk_max_columns];
+} ecs_query_chunk_t;
+
+// Where a parallel query function is being run.
+// Chunks are pieces of storage chunks taken in storage order, so for the
+// same entities a chunk's index is the same from run to run whichever
+// thread ends up running it.
+typedef struct ecs_parallel_chunk_t
+{
+	int index;
+	int worker;
+
+	// Memory private to the running worker, valid for the duration of the call.
+	void* scratch;
+	size_t scratch_size;
+} ecs_parallel_chunk_t;
+
+// Function run on each chunk of a parallel query.
+// The query only visits matching entities inside the chunk.
+typedef void (*ecs_parallel_function_t)(ecs_t* ecs, ecs_query_t* query, const ecs_parallel_chunk_t* chunk, void* user);
+
+// Function run on each chunk of a parallel chunk query, with the chunk's
+// entities as one contiguous run.
+typedef void (*ecs_parallel_chunk_function_t)(ecs_t* ecs, ecs_query_chunk_t* query_chunk, const ecs_parallel_chunk_t* chunk, void* user);
+
 // Create an entity component system.
-ecs_t* ecs_create(heap_t* heap);
+// Parallel queries run on the provided job system; if NULL, they run on the calling thread.
+ecs_t* ecs_create(heap_t* heap, job_system_t* jobs);
 
 // Destroy an entity component system.
 void ecs_destroy(ecs_t* ecs);
@@ -42,6 +110,7 @@ int ecs_register_component_type(ecs_t* ecs, const char* name, size_t size_per_co
 size_t ecs_get_component_type_size(ecs_t* ecs, int component_type);
 
 // Spawn an entity with the masked components and return a reference to it.
+// Storage grows as needed; there is no fixed limit on entity count.
 ecs_entity_ref_t ecs_entity_add(ecs_t* ecs, uint64_t component_mask);
 
 // Destroy an entity.
@@ -57,6 +126,13 @@ bool ecs_is_entity_ref_valid(ecs_t* ecs, ecs_entity_ref_t ref, bool allow_pendin
 // If allow_pending_add is true, will return component data for not fully spawned entities.
 void* ecs_entity_get_component(ecs_t* ecs, ecs_entity_ref_t ref, int component_type, bool allow_pending_add);
 
+// Register a query to be kept up to date.
+// The archetypes matching a registered query are tracked in a bitset that
+// is updated as new component combinations appear. Queries created with the
+// same masks, by ecs_query_create or ecs_query_parallel_for, then jump
+// straight to matching storage instead of testing every archetype.
+void ecs_register_query(ecs_t* ecs, uint64_t mask, uint64_t unwanted_mask);
+
 // Creates a new entity query by component type mask and unwanted component type mask
 ecs_query_t ecs_query_create(ecs_t* ecs, uint64_t mask, uint64_t unwanted_mask);
 
@@ -66,8 +142,50 @@ bool ecs_query_is_valid(ecs_t* ecs, ecs_query_t* query);
 // Advances the query to the next matching entity, if any.
 void ecs_query_next(ecs_t* ecs, ecs_query_t* query);
 
+// Advances the query past the rest of the current storage chunk, to the
+// first matching entity in the next one, if any.
+void ecs_query_next_chunk(ecs_t* ecs, ecs_query_t* query);
+
+// Get the number of matching entities stored contiguously from the query's
+// current entity to the end of its chunk. Components of these entities
+// follow the current one's in memory, so pointers from
+// ecs_query_get_component can be indexed as arrays of this length.
+int ecs_query_get_chunk_count(ecs_t* ecs, ecs_query_t* query);
+
 // Get data for a component on the entity referenced by the query, if any.
+// Returns NULL if the entity does not have the component.
 void* ecs_query_get_component(ecs_t* ecs, ecs_query_t* query, int component_type);
 
 // Get a entity reference for the current query location.
 ecs_entity_ref_t ecs_query_get_entity(ecs_t* ecs, ecs_query_t* query);
+
+// Creates a query over runs of matching entities, by component type mask and
+// unwanted component type mask. Each run carries a column for each of the
+// column_count types in column_types.
+ecs_query_chunk_t ecs_query_chunk_create(ecs_t* ecs, uint64_t mask, uint64_t unwanted_mask, const int* column_types, int column_count);
+
+// Determines if the chunk query points at a run of entities.
+bool ecs_query_chunk_is_valid(ecs_t* ecs, ecs_query_chunk_t* query_chunk);
+
+// Advances the chunk query to the next run, if any.
+void ecs_query_chunk_next(ecs_t* ecs, ecs_query_chunk_t* query_chunk);
+
+// Get an entity reference for entity index of the current run.
+ecs_entity_ref_t ecs_query_chunk_get_entity(ecs_t* ecs, ecs_query_chunk_t* query_chunk, int index);
+
+// Run function on each entity matching a query, split into chunks of at most grain entities.
+// Chunks run in parallel on the job system. Returns once every chunk has run.
+// Results that must be combined in order should be written per chunk index
+// and walked in index order after the call returns.
+// Entities must not be added or removed while the query runs, and only one
+// thread may run parallel queries on an ecs at a time.
+void ecs_query_parallel_for(ecs_t* ecs, uint64_t mask, uint64_t unwanted_mask, ecs_parallel_function_t function, void* user, int grain);
+
+// Run function once per chunk of a query, as in ecs_query_parallel_for, with
+// the chunk's entities passed as a run with the given columns.
+// column_types must stay valid until the call returns.
+void ecs_query_parallel_for_chunks(ecs_t* ecs, uint64_t mask, uint64_t unwanted_mask, const int* column_types, int column_count, ecs_parallel_chunk_function_t function, void* user, int grain);
+
+// Get the number of chunks ecs_query_parallel_for will split a query into at the given grain.
+// Holds until the next ecs_update.
+int ecs_query_parallel_chunk_count(ecs_t* ecs, uint64_t mask, uint64_t unwanted_mask, int grain);
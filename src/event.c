@@ -1,30 +1,80 @@
 #include "event.h"
 
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
+#include "atomic.h"
+#include "futex.h"
+
+#include <limits.h>
+#include <stdlib.h>
+
+enum
+{
+	k_event_clear,
+	k_event_raised,
+	k_event_clear_waiting,
+};
+
+enum
+{
+	// Checks made before a waiting thread parks.
+	k_event_spin_count = 128,
+};
+
+// Manual-reset event in one word. The signaler's exchange is its last
+// access to the event, so a waiter may destroy it as soon as it sees the
+// event raised.
+typedef struct event_t
+{
+	int state;
+} event_t;
 
 event_t* event_create()
 {
-	HANDLE evt = CreateEvent(NULL, TRUE, FALSE, NULL);
-	return (event_t*)evt;
+	event_t* event = malloc(sizeof(event_t));
+	event->state = k_event_clear;
+	return event;
 }
 
 void event_destroy(event_t* event)
 {
-	CloseHandle(event);
+	free(event);
 }
 
 void event_signal(event_t* event)
 {
-	SetEvent(event);
+	if (atomic_exchange(&event->state, k_event_raised) == k_event_clear_waiting)
+	{
+		futex_wake(&event->state, INT_MAX);
+	}
 }
 
 void event_wait(event_t* event)
 {
-	WaitForSingleObject(event, INFINITE);
+	for (int spin = 0; spin < k_event_spin_count; ++spin)
+	{
+		if (atomic_load(&event->state) == k_event_raised)
+		{
+			return;
+		}
+		atomic_pause();
+	}
+
+	for (;;)
+	{
+		int state = atomic_load(&event->state);
+		if (state == k_event_raised)
+		{
+			return;
+		}
+		if (state == k_event_clear &&
+			atomic_compare_and_exchange(&event->state, k_event_clear, k_event_clear_waiting) != k_event_clear)
+		{
+			continue;
+		}
+		futex_wait(&event->state, k_event_clear_waiting);
+	}
 }
 
 bool event_is_raised(event_t* event)
 {
-	return WaitForSingleObject(event, 0) == WAIT_OBJECT_0;
+	return atomic_load(&event->state) == k_event_raised;
 }
@@ -2,6 +2,7 @@
 #include "fs.h"
 #include "gpu.h"
 #include "heap.h"
+#include "job.h"
 #include "render.h"
 #include "timer_object.h"
 #include "transform.h"
@@ -44,6 +45,28 @@ typedef struct name_component_t
 	char name[32];
 } name_component_t;
 
+enum
+{
+	// Entities per chunk of a parallel query.
+	k_query_grain = 64,
+};
+
+typedef struct model_uniform_t
+{
+	mat4f_t projection;
+	mat4f_t model;
+	mat4f_t view;
+} model_uniform_t;
+
+// A model draw computed in parallel and pushed to the renderer in order.
+typedef struct model_draw_t
+{
+	ecs_entity_ref_t entity;
+	gpu_mesh_info_t* mesh_info;
+	gpu_shader_info_t* shader_info;
+	model_uniform_t uniform;
+} model_draw_t;
+
 typedef struct final_game_t
 {
 	heap_t* heap;
@@ -71,6 +94,14 @@ typedef struct final_game_t
 	int active_obstacles;
 	int max_obstacles;
 
+	// Per-chunk results of parallel queries: chunk i owns k_query_grain
+	// entries starting at i * k_query_grain, chunk_counts[i] of them used.
+	// Grown to fit the largest query so far.
+	int chunk_capacity;
+	int* chunk_counts;
+	ecs_entity_ref_t* respawn_ents;
+	model_draw_t* draws;
+
 	float time_of_last_obstacle;
 	float time_between_obstacle_spawns;
 	float time_of_last_death;
@@ -104,7 +135,7 @@ static void check_collisions(void* data);
 static vec3f_t get_random_position();
 static vec3f_t get_forward_to_random_pos(vec3f_t initial_pos);
 
-final_game_t* final_game_create(heap_t* heap, fs_t* fs, wm_window_t* window, render_t* render, float aspect, float height)
+final_game_t* final_game_create(heap_t* heap, fs_t* fs, job_system_t* jobs, wm_window_t* window, render_t* render, float aspect, float height)
 {
 	final_game_t* game = heap_alloc(heap, sizeof(final_game_t), 8);
 	game->heap = heap;
@@ -122,7 +153,7 @@ final_game_t* final_game_create(heap_t* heap, fs_t* fs, wm_window_t* window, ren
 	game->max_obstacles = 20;
 	game->time_between_obstacle_spawns = 1000;
 
-	game->ecs = ecs_create(heap);
+	game->ecs = ecs_create(heap, jobs);
 	game->transform_type = ecs_register_component_type(game->ecs, "transform", sizeof(transform_component_t), _Alignof(transform_component_t));
 	game->camera_type = ecs_register_component_type(game->ecs, "camera", sizeof(camera_component_t), _Alignof(camera_component_t));
 	game->model_type = ecs_register_component_type(game->ecs, "model", sizeof(model_component_t), _Alignof(model_component_t));
@@ -131,6 +162,19 @@ final_game_t* final_game_create(heap_t* heap, fs_t* fs, wm_window_t* window, ren
 	game->rigidbody_type = ecs_register_component_type(game->ecs, "rigidbody", sizeof(rigidbody_component_t), _Alignof(rigidbody_component_t));
 	game->box_collider_type = ecs_register_component_type(game->ecs, "box_collider", sizeof(box_collider_component_t), _Alignof(box_collider_component_t));
 
+	// Every query the systems below run each frame.
+	ecs_register_query(game->ecs, (1ULL << game->rigidbody_type) | (1ULL << game->player_type), 0);
+	ecs_register_query(game->ecs, (1ULL << game->rigidbody_type), 0);
+	ecs_register_query(game->ecs, (1ULL << game->transform_type) | (1ULL << game->player_type) | (1ULL << game->rigidbody_type), 0);
+	ecs_register_query(game->ecs, (1ULL << game->transform_type) | (1ULL << game->box_collider_type), 0);
+	ecs_register_query(game->ecs, (1ULL << game->camera_type), 0);
+	ecs_register_query(game->ecs, (1ULL << game->transform_type) | (1ULL << game->model_type), 0);
+
+	game->chunk_capacity = 0;
+	game->chunk_counts = NULL;
+	game->respawn_ents = NULL;
+	game->draws = NULL;
+
 	game->dynamics = heap_alloc(heap, sizeof(dynamics_t), 8);
 	physics_initialize(game->dynamics);
 
@@ -148,6 +192,13 @@ void final_game_destroy(final_game_t* game)
 	physics_end(game->dynamics);
 	heap_free(game->heap, game->dynamics);
 
+	if (game->chunk_capacity)
+	{
+		heap_free(game->heap, game->draws);
+		heap_free(game->heap, game->respawn_ents);
+		heap_free(game->heap, game->chunk_counts);
+	}
+
 	ecs_destroy(game->ecs);
 	timer_object_destroy(game->timer);
 	unload_resources(game);
@@ -507,77 +558,164 @@ static void spawn_camera(final_game_t* game)
 	mat4f_make_lookat(&camera_comp->view, &transform_comp->transform.translation, &forward, &up);
 }
 
-static void update_players(final_game_t* game)
+typedef struct update_players_context_t
 {
-	float dt = (float)timer_object_get_delta_ms(game->timer) * 0.001f;
+	final_game_t* game;
+	uint32_t key_mask;
+} update_players_context_t;
 
-	uint32_t key_mask = wm_get_key_mask(game->window);
+static void update_player_entity(ecs_t* ecs, ecs_query_t* query, const ecs_parallel_chunk_t* chunk, void* user)
+{
+	update_players_context_t* context = user;
+	final_game_t* game = context->game;
+	uint32_t key_mask = context->key_mask;
+
+	transform_component_t* player_transform_comp = ecs_query_get_component(ecs, query, game->transform_type);
+	player_component_t* player_comp = ecs_query_get_component(ecs, query, game->player_type);
+	rigidbody_component_t* player_rigidbody_comp = ecs_query_get_component(ecs, query, game->rigidbody_type);
+
+	player_transform_comp->transform.translation = get_rigidbody_position(player_rigidbody_comp);
+	//Handle input actions and move
+	float speed = 4.0f;
+	vec3f_t vel = (vec3f_t){.x = 0, .y = 0, .z = get_rigidbody_linear_velocity(player_rigidbody_comp).z};
+	if (key_mask & k_key_up)
+	{
+		vel.x += -speed;
+	}
+	if (key_mask & k_key_down)
+	{
+		vel.x += speed;
+	}
+	if (key_mask & k_key_left)
+	{
+		vel.y += -speed;
+	}
+	if (key_mask & k_key_right)
+	{
+		vel.y += speed;
+	}
 
-	uint64_t k_query_mask = (1ULL << game->transform_type) | (1ULL << game->player_type);
+	set_rigidbody_linear_velocity(player_rigidbody_comp, vel);
+}
 
-	for (ecs_query_t query = ecs_query_create(game->ecs, k_query_mask, 0);
-		ecs_query_is_valid(game->ecs, &query);
-		ecs_query_next(game->ecs, &query))
+static void update_players(final_game_t* game)
+{
+	update_players_context_t context =
 	{
-		transform_component_t* player_transform_comp = ecs_query_get_component(game->ecs, &query, game->transform_type);
-		player_component_t* player_comp = ecs_query_get_component(game->ecs, &query, game->player_type);
-		rigidbody_component_t* player_rigidbody_comp = ecs_query_get_component(game->ecs, &query, game->rigidbody_type);
+		.game = game,
+		.key_mask = wm_get_key_mask(game->window),
+	};
 
-		player_transform_comp->transform.translation = get_rigidbody_position(player_rigidbody_comp);
-		//Handle input actions and move
-		float speed = 4.0f;
-		vec3f_t vel = (vec3f_t){.x = 0, .y = 0, .z = get_rigidbody_linear_velocity(player_rigidbody_comp).z};
-		if (key_mask & k_key_up)
-		{
-			vel.x += -speed;
-		}
-		if (key_mask & k_key_down)
-		{
-			vel.x += speed;
-		}
-		if (key_mask & k_key_left)
+	uint64_t k_query_mask = (1ULL << game->transform_type) | (1ULL << game->player_type) | (1ULL << game->rigidbody_type);
+	ecs_query_parallel_for(game->ecs, k_query_mask, 0, update_player_entity, &context, k_query_grain);
+}
+
+static void update_obstacle_chunk(ecs_t* ecs, ecs_query_chunk_t* query_chunk, const ecs_parallel_chunk_t* chunk, void* user)
+{
+	final_game_t* game = user;
+
+	transform_component_t* transform_comps = query_chunk->columns[0];
+	rigidbody_component_t* rigidbody_comps = query_chunk->columns[1];
+	for (int i = 0; i < query_chunk->count; ++i)
+	{
+		transform_component_t* transform_comp = &transform_comps[i];
+		rigidbody_component_t* rigidbody_comp = &rigidbody_comps[i];
+		transform_comp->transform.translation = get_rigidbody_position(rigidbody_comp);
+		set_rigidbody_quaternion(rigidbody_comp, transform_comp->transform.rotation);
+		//Handle out-of-bounds for obstacles
+		if (transform_comp->transform.translation.x > 45 || transform_comp->transform.translation.x < -45 ||
+			transform_comp->transform.translation.y > 45 || transform_comp->transform.translation.y < -45 ||
+			transform_comp->transform.translation.z < -10)
 		{
-			vel.y += -speed;
+			// Respawning draws random numbers, so it is left for the serial
+			// pass to keep the sequence independent of thread timing.
+			int slot = chunk->index * k_query_grain + game->chunk_counts[chunk->index]++;
+			game->respawn_ents[slot] = ecs_query_chunk_get_entity(ecs, query_chunk, i);
+			continue;
 		}
-		if (key_mask & k_key_right)
+		set_rigidbody_position(rigidbody_comp, transform_comp->transform.translation);
+	}
+}
+
+// Make room for the per-chunk results of a parallel query and clear the counts.
+// Returns the number of chunks the query will run.
+static int prepare_chunk_results(final_game_t* game, uint64_t mask)
+{
+	int chunk_count = ecs_query_parallel_chunk_count(game->ecs, mask, 0, k_query_grain);
+	if (chunk_count > game->chunk_capacity)
+	{
+		int capacity = game->chunk_capacity ? game->chunk_capacity : 1;
+		while (capacity < chunk_count)
 		{
-			vel.y += speed;
+			capacity *= 2;
 		}
-
-		set_rigidbody_linear_velocity(player_rigidbody_comp, vel);
+		game->chunk_counts = heap_realloc(game->heap, game->chunk_counts, sizeof(int) * capacity, 8);
+		game->respawn_ents = heap_realloc(game->heap, game->respawn_ents, sizeof(ecs_entity_ref_t) * capacity * k_query_grain, 8);
+		game->draws = heap_realloc(game->heap, game->draws, sizeof(model_draw_t) * capacity * k_query_grain, 16);
+		game->chunk_capacity = capacity;
 	}
+	memset(game->chunk_counts, 0, sizeof(int) * chunk_count);
+	return chunk_count;
 }
 
 static void update_obstacles(final_game_t* game) 
 {
-	float dt = (float)timer_object_get_delta_ms(game->timer) * 0.001f;
+	uint64_t k_query_mask = (1ULL << game->transform_type) | (1ULL << game->box_collider_type);
 
-	uint32_t key_mask = wm_get_key_mask(game->window);
+	int k_columns[] = { game->transform_type, game->rigidbody_type };
 
-	uint64_t k_query_mask = (1ULL << game->transform_type) | (1ULL << game->box_collider_type);
+	int chunk_count = prepare_chunk_results(game, k_query_mask);
+	ecs_query_parallel_for_chunks(game->ecs, k_query_mask, 0, k_columns, _countof(k_columns), update_obstacle_chunk, game, k_query_grain);
 
-	for (ecs_query_t query = ecs_query_create(game->ecs, k_query_mask, 0);
-		ecs_query_is_valid(game->ecs, &query);
-		ecs_query_next(game->ecs, &query))
+	for (int c = 0; c < chunk_count; ++c)
 	{
-		transform_component_t* transform_comp = ecs_query_get_component(game->ecs, &query, game->transform_type);
-		rigidbody_component_t* rigidbody_comp = ecs_query_get_component(game->ecs, &query, game->rigidbody_type);
-		transform_comp->transform.translation = get_rigidbody_position(rigidbody_comp);
-		set_rigidbody_quaternion(rigidbody_comp, transform_comp->transform.rotation);
-		//Handle out-of-bounds for obstacles
-		if (transform_comp->transform.translation.x > 45 || transform_comp->transform.translation.x < -45 || 
-			transform_comp->transform.translation.y > 45 || transform_comp->transform.translation.y < -45 ||
-			transform_comp->transform.translation.z < -10)
+		for (int i = 0; i < game->chunk_counts[c]; ++i)
 		{
+			ecs_entity_ref_t entity = game->respawn_ents[c * k_query_grain + i];
+			transform_component_t* transform_comp = ecs_entity_get_component(game->ecs, entity, game->transform_type, false);
+			rigidbody_component_t* rigidbody_comp = ecs_entity_get_component(game->ecs, entity, game->rigidbody_type, false);
 			transform_comp->transform.translation = get_random_position();
 			vec3f_t forward = get_forward_to_random_pos(transform_comp->transform.translation);
 			transform_comp->transform.rotation = quatf_look_at(forward, vec3f_up());
 			set_rigidbody_linear_velocity(rigidbody_comp, vec3f_scale(forward, transform_comp->transform.scale.y * 2));
+			set_rigidbody_position(rigidbody_comp, transform_comp->transform.translation);
 		}
-		set_rigidbody_position(rigidbody_comp, transform_comp->transform.translation);
 	}
 }
 
+typedef struct draw_models_context_t
+{
+	final_game_t* game;
+	camera_component_t* camera_comp;
+} draw_models_context_t;
+
+static void draw_model_chunk(ecs_t* ecs, ecs_query_chunk_t* query_chunk, const ecs_parallel_chunk_t* chunk, void* user)
+{
+	draw_models_context_t* context = user;
+	final_game_t* game = context->game;
+
+	transform_component_t* transform_comps = query_chunk->columns[0];
+	model_component_t* model_comps = query_chunk->columns[1];
+
+	// The transform column is a plain array, so the whole run's matrices
+	// are built in one batch in worker scratch.
+	mat4f_t* models = chunk->scratch;
+	transform_to_matrices(&transform_comps->transform, models, query_chunk->count);
+
+	model_draw_t* draws = &game->draws[chunk->index * k_query_grain];
+	for (int i = 0; i < query_chunk->count; ++i)
+	{
+		model_draw_t* draw = &draws[i];
+		draw->entity = ecs_query_chunk_get_entity(ecs, query_chunk, i);
+		draw->mesh_info = model_comps[i].mesh_info;
+		draw->shader_info = model_comps[i].shader_info;
+		draw->uniform.projection = context->camera_comp->projection;
+		draw->uniform.view = context->camera_comp->view;
+		draw->uniform.model = models[i];
+	}
+	game->chunk_counts[chunk->index] = query_chunk->count;
+}
+
 static void draw_models(final_game_t* game)
 {
 	uint64_t k_camera_query_mask = (1ULL << game->camera_type);
@@ -585,29 +723,27 @@ static void draw_models(final_game_t* game)
 		ecs_query_is_valid(game->ecs, &camera_query);
 		ecs_query_next(game->ecs, &camera_query))
 	{
-		camera_component_t* camera_comp = ecs_query_get_component(game->ecs, &camera_query, game->camera_type);
+		draw_models_context_t context =
+		{
+			.game = game,
+			.camera_comp = ecs_query_get_component(game->ecs, &camera_query, game->camera_type),
+		};
 
+		// Matrices are built in parallel; the render queue has a single
+		// producer, so the draws are pushed from here in entity order.
 		uint64_t k_model_query_mask = (1ULL << game->transform_type) | (1ULL << game->model_type);
-		for (ecs_query_t query = ecs_query_create(game->ecs, k_model_query_mask, 0);
-			ecs_query_is_valid(game->ecs, &query);
-			ecs_query_next(game->ecs, &query))
-		{
-			transform_component_t* transform_comp = ecs_query_get_component(game->ecs, &query, game->transform_type);
-			model_component_t* model_comp = ecs_query_get_component(game->ecs, &query, game->model_type);
-			ecs_entity_ref_t entity_ref = ecs_query_get_entity(game->ecs, &query);
+		int chunk_count = prepare_chunk_results(game, k_model_query_mask);
+		int k_model_columns[] = { game->transform_type, game->model_type };
+		ecs_query_parallel_for_chunks(game->ecs, k_model_query_mask, 0, k_model_columns, _countof(k_model_columns), draw_model_chunk, &context, k_query_grain);
 
-			struct
+		for (int c = 0; c < chunk_count; ++c)
+		{
+			for (int i = 0; i < game->chunk_counts[c]; ++i)
 			{
-				mat4f_t projection;
-				mat4f_t model;
-				mat4f_t view;
-			} uniform_data;
-			uniform_data.projection = camera_comp->projection;
-			uniform_data.view = camera_comp->view;
-			transform_to_matrix(&transform_comp->transform, &uniform_data.model);
-			gpu_uniform_buffer_info_t uniform_info = { .data = &uniform_data, sizeof(uniform_data) };
-
-			render_push_model(game->render, &entity_ref, model_comp->mesh_info, model_comp->shader_info, &uniform_info);
+				model_draw_t* draw = &game->draws[c * k_query_grain + i];
+				gpu_uniform_buffer_info_t uniform_info = { .data = &draw->uniform, sizeof(draw->uniform) };
+				render_push_model(game->render, &draw->entity, draw->mesh_info, draw->shader_info, &uniform_info);
+			}
 		}
 	}
 }
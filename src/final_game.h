@@ -4,11 +4,12 @@ typedef struct final_game_t final_game_t;
 
 typedef struct fs_t fs_t;
 typedef struct heap_t heap_t;
+typedef struct job_system_t job_system_t;
 typedef struct render_t render_t;
 typedef struct wm_window_t wm_window_t;
 
 // Create an instance of final with a given aspect ratio and height
-final_game_t* final_game_create(heap_t* heap, fs_t* fs, wm_window_t* window, render_t* render, float aspect, float height);
+final_game_t* final_game_create(heap_t* heap, fs_t* fs, job_system_t* jobs, wm_window_t* window, render_t* render, float aspect, float height);
 
 // Destroy an instance of final
 void final_game_destroy(final_game_t* game);
@@ -0,0 +1,142 @@
+#include "frame_arena.h"
+
+#include "atomic.h"
+#include "heap.h"
+#include "mutex.h"
+#include "semaphore.h"
+
+#include <stdint.h>
+
+enum
+{
+	k_frame_arena_max_frames = 3,
+};
+
+typedef struct frame_block_t
+{
+	struct frame_block_t* next;
+	int capacity;
+	int used;
+} frame_block_t;
+
+typedef struct frame_t
+{
+	frame_block_t* first;
+	frame_block_t* current;
+} frame_t;
+
+typedef struct frame_arena_t
+{
+	heap_t* heap;
+	heap_tag_t tag;
+	mutex_t* mutex;
+	semaphore_t* free_frames;
+	size_t block_size;
+	int frame_count;
+	int frame_index;
+	frame_t frames[k_frame_arena_max_frames];
+} frame_arena_t;
+
+static frame_block_t* frame_block_create(heap_t* heap, size_t capacity, heap_tag_t tag)
+{
+	frame_block_t* block = heap_alloc_tagged(heap, sizeof(frame_block_t) + capacity, 16, tag);
+	block->next = NULL;
+	block->capacity = (int)capacity;
+	block->used = 0;
+	return block;
+}
+
+frame_arena_t* frame_arena_create(heap_t* heap, size_t block_size, int frame_count, heap_tag_t tag)
+{
+	frame_count = __max(2, __min(frame_count, k_frame_arena_max_frames));
+
+	frame_arena_t* arena = heap_alloc_tagged(heap, sizeof(frame_arena_t), 8, tag);
+	arena->heap = heap;
+	arena->tag = tag;
+	arena->mutex = mutex_create_named("frame arena");
+	arena->free_frames = semaphore_create(frame_count - 1, frame_count - 1);
+	arena->block_size = block_size;
+	arena->frame_count = frame_count;
+	arena->frame_index = 0;
+	for (int i = 0; i < frame_count; ++i)
+	{
+		arena->frames[i].first = frame_block_create(heap, block_size, tag);
+		arena->frames[i].current = arena->frames[i].first;
+	}
+	return arena;
+}
+
+void frame_arena_destroy(frame_arena_t* arena)
+{
+	for (int i = 0; i < arena->frame_count; ++i)
+	{
+		frame_block_t* block = arena->frames[i].first;
+		while (block)
+		{
+			frame_block_t* next = block->next;
+			heap_free(arena->heap, block);
+			block = next;
+		}
+	}
+	semaphore_destroy(arena->free_frames);
+	mutex_destroy(arena->mutex);
+	heap_free(arena->heap, arena);
+}
+
+void* frame_arena_alloc(frame_arena_t* arena, size_t size, size_t alignment)
+{
+	frame_t* frame = &arena->frames[arena->frame_index];
+	while (true)
+	{
+		frame_block_t* block = frame->current;
+		char* data = (char*)(block + 1);
+
+		int used = atomic_load(&block->used);
+		uintptr_t start = ((uintptr_t)(data + used) + (alignment - 1)) & ~(uintptr_t)(alignment - 1);
+		size_t end = (size_t)(start - (uintptr_t)data) + size;
+		if (end <= (size_t)block->capacity)
+		{
+			if (atomic_compare_and_exchange(&block->used, used, (int)end) == used)
+			{
+				return (void*)start;
+			}
+			continue;
+		}
+
+		// Out of space: move to the next block, reusing one left over
+		// from a previous frame if it is big enough.
+		mutex_lock(arena->mutex);
+		if (frame->current == block)
+		{
+			size_t needed = size + alignment;
+			frame_block_t* next = block->next;
+			if (next && (size_t)next->capacity >= needed)
+			{
+				next->used = 0;
+			}
+			else
+			{
+				next = frame_block_create(arena->heap, __max(arena->block_size, needed), arena->tag);
+				next->next = block->next;
+				block->next = next;
+			}
+			frame->current = next;
+		}
+		mutex_unlock(arena->mutex);
+	}
+}
+
+void frame_arena_advance(frame_arena_t* arena)
+{
+	semaphore_acquire(arena->free_frames);
+
+	arena->frame_index = (arena->frame_index + 1) % arena->frame_count;
+	frame_t* frame = &arena->frames[arena->frame_index];
+	frame->current = frame->first;
+	frame->first->used = 0;
+}
+
+void frame_arena_release(frame_arena_t* arena)
+{
+	semaphore_release(arena->free_frames);
+}
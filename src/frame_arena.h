@@ -0,0 +1,39 @@
+#pragma once
+
+#include "heap.h"
+
+#include <stddef.h>
+
+// Per-frame linear allocator.
+//
+// Memory is bump-allocated from large blocks taken from a heap_t and is
+// never freed individually. The arena holds several frames worth of
+// blocks: the producer allocates into the current frame and advances at
+// the frame boundary, resetting the next frame in O(1). A frame is only
+// reused once the consumer has released it, so data produced on one
+// thread stays valid until another thread has finished with it.
+
+// Handle to a frame arena.
+typedef struct frame_arena_t frame_arena_t;
+
+// Create a frame arena with frame_count buffers (2 or 3).
+// Each buffer grows in blocks of block_size bytes allocated from heap
+// and charged to tag.
+frame_arena_t* frame_arena_create(heap_t* heap, size_t block_size, int frame_count, heap_tag_t tag);
+
+// Destroy a frame arena and return all of its blocks to the heap.
+void frame_arena_destroy(frame_arena_t* arena);
+
+// Allocate memory from the current frame.
+// Memory stays valid until the frame is released and then reused.
+// Safe for multiple threads to allocate at the same time.
+void* frame_arena_alloc(frame_arena_t* arena, size_t size, size_t alignment);
+
+// End the current frame and begin the next one.
+// If every other frame is still held by the consumer, blocks until one
+// is released. Must not be called while other threads are allocating.
+void frame_arena_advance(frame_arena_t* arena);
+
+// Release the oldest frame handed to the consumer.
+// Call once per frame_arena_advance() when done with that frame's data.
+void frame_arena_release(frame_arena_t* arena);
@@ -2,6 +2,8 @@
 
 #include "event.h"
 #include "heap.h"
+#include "job.h"
+#include "object_pool.h"
 #include "queue.h"
 #include "thread.h"
 
@@ -16,12 +18,13 @@
 typedef struct fs_t
 {
 	heap_t* heap;
+	object_pool_t* work_pool;
 	queue_t* file_queue;
-	queue_t* compression_queue;
-	queue_t* decompression_queue;
 	thread_t* file_thread;
-	thread_t* compression_thread;
-	thread_t* decompression_thread;
+
+	// Compression jobs in flight, so shutdown can wait them out.
+	job_system_t* jobs;
+	job_counter_t* job_counter;
 } fs_t;
 
 typedef enum fs_work_op_t
@@ -45,40 +48,48 @@ typedef struct fs_work_t
 	fs_t* fs;
 } fs_work_t;
 
+static void file_compress(fs_work_t* work);
+static void file_decompress(fs_work_t* work);
 static int file_thread_func(void* user);
-static int compression_thread_func(void* user);
-static int decompression_thread_func(void* user);
+static void compress_job_func(void* user);
+static void decompress_job_func(void* user);
 
-fs_t* fs_create(heap_t* heap, int queue_capacity)
+fs_t* fs_create(heap_t* heap, int queue_capacity, job_system_t* jobs)
 {
-	fs_t* fs = heap_alloc(heap, sizeof(fs_t), 8);
+	fs_t* fs = heap_alloc_tagged(heap, sizeof(fs_t), 8, k_heap_tag_fs);
 	fs->heap = heap;
+	fs->work_pool = object_pool_create(heap, sizeof(fs_work_t), 8, queue_capacity, k_heap_tag_fs);
 	fs->file_queue = queue_create(heap, queue_capacity);
-	fs->compression_queue = queue_create(heap, queue_capacity);
-	fs->decompression_queue = queue_create(heap, queue_capacity);
+	fs->jobs = jobs;
+	fs->job_counter = jobs ? job_counter_create(jobs) : NULL;
 	fs->file_thread = thread_create(file_thread_func, fs);
-	fs->compression_thread = thread_create(compression_thread_func, fs);
-	fs->decompression_thread = thread_create(decompression_thread_func, fs);
+	thread_set_name(fs->file_thread, "fs file");
 	return fs;
 }
 
 void fs_destroy(fs_t* fs)
 {
+	// Compression jobs feed the file thread and the file thread starts
+	// decompression jobs, so drain the jobs on both sides of stopping it.
+	if (fs->job_counter)
+	{
+		job_wait(fs->job_counter);
+	}
 	queue_push(fs->file_queue, NULL);
-	queue_push(fs->compression_queue, NULL);
-	queue_push(fs->decompression_queue, NULL);
 	thread_destroy(fs->file_thread);
-	thread_destroy(fs->compression_thread);
-	thread_destroy(fs->decompression_thread);
+	if (fs->job_counter)
+	{
+		job_wait(fs->job_counter);
+		job_counter_destroy(fs->job_counter);
+	}
 	queue_destroy(fs->file_queue);
-	queue_destroy(fs->compression_queue);
-	queue_destroy(fs->decompression_queue);
+	object_pool_destroy(fs->work_pool);
 	heap_free(fs->heap, fs);
 }
 
 fs_work_t* fs_read(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression)
 {
-	fs_work_t* work = heap_alloc(fs->heap, sizeof(fs_work_t), 8);
+	fs_work_t* work = object_pool_alloc(fs->work_pool);
 	work->heap = heap;
 	work->op = k_fs_work_op_read;
 	strcpy_s(work->path, sizeof(work->path), path);
@@ -95,7 +106,7 @@ fs_work_t* fs_read(fs_t* fs, const char* path, heap_t* heap, bool null_terminate
 
 fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size, bool use_compression)
 {
-	fs_work_t* work = heap_alloc(fs->heap, sizeof(fs_work_t), 8);
+	fs_work_t* work = object_pool_alloc(fs->work_pool);
 	work->heap = fs->heap;
 	work->op = k_fs_work_op_write;
 	strcpy_s(work->path, sizeof(work->path), path);
@@ -107,10 +118,9 @@ fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size,
 	work->use_compression = use_compression;
 	work->fs = fs;
 
-	if (use_compression)
+	if (use_compression && fs->jobs)
 	{
-		// HOMEWORK 2: Queue file write work on compression queue!
-		queue_push(fs->compression_queue, work);
+		job_submit(fs->jobs, compress_job_func, work, fs->job_counter);
 	}
 	else
 	{
@@ -158,7 +168,7 @@ void fs_work_destroy(fs_work_t* work)
 		event_wait(work->done);
 		event_destroy(work->done);
 		heap_free(work->heap, work->buffer);
-		heap_free(work->heap, work);
+		object_pool_free(work->fs->work_pool, work);
 	}
 }
 
@@ -189,7 +199,7 @@ static void file_read(fs_work_t* work)
 		return;
 	}
 
-	work->buffer = heap_alloc(work->heap, work->null_terminate ? work->size + 1 : work->size, 8);
+	work->buffer = heap_alloc_tagged(work->heap, work->null_terminate ? work->size + 1 : work->size, 8, k_heap_tag_fs);
 
 	DWORD bytes_read = 0;
 
@@ -233,10 +243,13 @@ static void file_read(fs_work_t* work)
 
 	CloseHandle(handle);
 
-	if (work->use_compression)
+	if (work->use_compression && work->fs->jobs)
+	{
+		job_submit(work->fs->jobs, decompress_job_func, work, work->fs->job_counter);
+	}
+	else if (work->use_compression)
 	{
-		// HOMEWORK 2: Queue file read work on decompression queue!
-		queue_push(work->fs->decompression_queue, work);
+		file_decompress(work);
 	}
 	else
 	{
@@ -316,15 +329,14 @@ static void file_compress(fs_work_t* work)
 {
 	char* temp_buffer = work->buffer;
 	int dest_size = LZ4_compressBound((int)work->size);
-	work->buffer = heap_alloc(work->heap, (size_t)(dest_size), 8);
+	work->buffer = heap_alloc_tagged(work->heap, (size_t)(dest_size), 8, k_heap_tag_fs);
 	int compressed_size = LZ4_compress_default(temp_buffer, work->buffer, (int)work->size, dest_size);
 	work->compression_size = compressed_size;
-	file_write(work);
 }
 
 static void file_decompress(fs_work_t* work)
 {
-	char* dest_buffer = heap_alloc(work->heap, work->size, 8);
+	char* dest_buffer = heap_alloc_tagged(work->heap, work->size, 8, k_heap_tag_fs);
 	char* temp_buffer = work->buffer;
 	LZ4_decompress_safe(work->buffer, dest_buffer, work->compression_size, (int)work->size);
 	work->buffer = dest_buffer;
@@ -354,6 +366,10 @@ static int file_thread_func(void* user)
 			file_read(work);
 			break;
 		case k_fs_work_op_write:
+			if (work->use_compression && !fs->jobs)
+			{
+				file_compress(work);
+			}
 			file_write(work);
 			break;
 		}
@@ -361,34 +377,14 @@ static int file_thread_func(void* user)
 	return 0;
 }
 
-static int compression_thread_func(void* user)
+static void compress_job_func(void* user)
 {
-	fs_t* fs = user;
-	while (true)
-	{
-		fs_work_t* work = queue_pop(fs->compression_queue);
-		if (work == NULL)
-		{
-			break;
-		}
-
-		file_compress(work);
-	}
-	return 0;
+	fs_work_t* work = user;
+	file_compress(work);
+	queue_push(work->fs->file_queue, work);
 }
 
-static int decompression_thread_func(void* user) 
+static void decompress_job_func(void* user)
 {
-	fs_t* fs = user;
-	while (true)
-	{
-		fs_work_t* work = queue_pop(fs->decompression_queue);
-		if (work == NULL)
-		{
-			break;
-		}
-
-		file_decompress(work);
-	}
-	return 0;
-}
\ No newline at end of file
+	file_decompress(user);
+}
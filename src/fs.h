@@ -11,11 +11,14 @@ typedef struct fs_t fs_t;
 typedef struct fs_work_t fs_work_t;
 
 typedef struct heap_t heap_t;
+typedef struct job_system_t job_system_t;
 
 // Create a new file system.
 // Provided heap will be used to allocate space for queue and work buffers.
 // Provided queue size defines number of in-flight file operations.
-fs_t* fs_create(heap_t* heap, int queue_capacity);
+// Compression and decompression run as jobs on the provided job system.
+// If it is NULL, the file thread compresses and decompresses itself.
+fs_t* fs_create(heap_t* heap, int queue_capacity, job_system_t* jobs);
 
 // Destroy a previously created file system.
 void fs_destroy(fs_t* fs);
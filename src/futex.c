@@ -0,0 +1,49 @@
+#if !defined(_WIN32)
+#define _GNU_SOURCE
+#endif
+
+#include "futex.h"
+
+#include <limits.h>
+
+#if defined(_WIN32)
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#pragma comment(lib, "Synchronization.lib")
+
+void futex_wait(int* address, int expected)
+{
+	WaitOnAddress(address, &expected, sizeof(expected), INFINITE);
+}
+
+void futex_wake(int* address, int count)
+{
+	if (count == INT_MAX)
+	{
+		WakeByAddressAll(address);
+		return;
+	}
+	for (int i = 0; i < count; ++i)
+	{
+		WakeByAddressSingle(address);
+	}
+}
+
+#else
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+void futex_wait(int* address, int expected)
+{
+	syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+void futex_wake(int* address, int count)
+{
+	syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+#endif
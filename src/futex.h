@@ -0,0 +1,17 @@
+#pragma once
+
+// Wait on and wake threads by address.
+//
+// The building block for the mutex, semaphore and event: a thread that
+// finds a value not to its liking parks on the value's address, and the
+// thread that changes it wakes the parked threads. Backed by futex on
+// Linux and WaitOnAddress on Windows; no kernel object is created.
+
+// Block the calling thread while *address equals expected.
+// The comparison and the sleep are atomic with respect to futex_wake.
+// May return spuriously; callers must recheck their condition.
+void futex_wait(int* address, int expected);
+
+// Wake up to count threads blocked in futex_wait on address.
+// Pass INT_MAX to wake all of them.
+void futex_wake(int* address, int count);
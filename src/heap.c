@@ -1,45 +1,234 @@
 #include "heap.h"
 
+#include "atomic.h"
 #include "debug.h"
 #include "mutex.h"
+#include "timer.h"
 #include "tlsf/tlsf.h"
+#include "vm.h"
 
+#include <math.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <DbgHelp.h>
 
+enum
+{
+	k_alloc_stack_capacity = 8,
+
+	// Unique call stacks are interned in a fixed-size open-addressed table.
+	// Records are carved from slabs that live until the heap is destroyed.
+	k_stack_table_capacity = 16384,
+	k_stack_table_max_load = k_stack_table_capacity * 3 / 4,
+	k_stack_slab_size = 64 * 1024,
+
+	// Blocks that fit a size class are served from per-thread caches.
+	// Sizes include the allocation header.
+	k_cache_class_count = 16,
+	k_cache_alignment = 16,
+	k_cache_batch_bytes = 16 * 1024,
+	k_cache_batch_max = 32,
+
+	// Allocations at least this big map their own pages by default.
+	k_large_threshold = 256 * 1024,
+	// Class index stored in the header of a large allocation.
+	k_large_class_index = -2,
+};
+
+typedef enum alloc_state_t
+{
+	k_alloc_state_free = 0x46524545,
+	k_alloc_state_live = 0x4c495645,
+} alloc_state_t;
+
+static const size_t k_cache_class_sizes[k_cache_class_count] =
+{
+	48, 64, 96, 128, 160, 192, 256, 320, 384, 512, 640, 768, 1024, 1280, 1536, 2048,
+};
+
+// A TLSF pool and the pages holding it.
+// Reserved arenas live in the heap's reserved range and are never
+// released individually.
 typedef struct arena_t
 {
 	pool_t pool;
+	size_t size;
+	bool reserved;
 	struct arena_t* next;
 } arena_t;
 
-typedef struct alloc_info_t
+// Sits just before the header of a large allocation, which maps pages of
+// its own. Large allocations are linked so leaks can be reported.
+typedef struct large_block_t
+{
+	void* base;
+	size_t size;
+	struct large_block_t* prev;
+	struct large_block_t* next;
+} large_block_t;
+
+// A unique allocation call stack, shared by every allocation made from it.
+// Live totals are estimates scaled up from the sampled allocations.
+typedef struct stack_record_t
+{
+	uint32_t hash;
+	int frame_count;
+	void* frames[k_alloc_stack_capacity];
+	int64_t live_bytes;
+	int64_t live_count;
+	// Exact live totals gathered while building a report.
+	// Guarded by the heap mutex.
+	int64_t report_bytes;
+	int64_t report_count;
+} stack_record_t;
+
+typedef struct stack_slab_t
+{
+	struct stack_slab_t* next;
+	int used;
+} stack_slab_t;
+
+// Stored at the start of every TLSF block handed out by the heap.
+// The address returned to the caller follows the header; the 32 bits
+// just before that address hold the distance back to the header.
+// The stack is NULL for allocations that were not sampled.
+typedef struct alloc_header_t
 {
 	size_t size;
-	void* address;
-	char* stack[256];
-	int stack_frames;
-	struct alloc_info_t* next;
-} alloc_info_t;
+	stack_record_t* stack;
+	alloc_state_t state;
+	int16_t class_index;
+	uint8_t tag;
+	float sample_weight;
+} alloc_header_t;
+
+// Live totals and budgets for one tag. Totals are updated atomically from
+// the locked paths of every thread, so each tag gets a cache line of its own.
+typedef struct tag_totals_t
+{
+	_Alignas(64) int64_t live_bytes;
+	int64_t peak_bytes;
+	int64_t live_count;
+	int64_t total_count;
+	int64_t soft_budget;
+	int64_t hard_budget;
+} tag_totals_t;
+
+// Changes to one tag's totals made through a thread cache that have not
+// been folded into the shared totals yet.
+typedef struct tag_delta_t
+{
+	int64_t live_bytes;
+	int64_t live_count;
+	int64_t total_count;
+} tag_delta_t;
+
+static const char* k_tag_names[k_heap_tag_count] =
+{
+	"general", "ecs", "fs", "net", "render", "gpu",
+};
+
+// Decides which allocations capture a call stack.
+typedef struct sampler_t
+{
+	int epoch;
+	int64_t countdown;
+	uint64_t random;
+} sampler_t;
+
+// Live allocation counters. Each thread cache keeps its own so the cached
+// path never writes shared memory; heap_get_stats sums them.
+typedef struct alloc_counters_t
+{
+	int64_t bytes_in_use;
+	int64_t live_count;
+	int64_t total_count;
+} alloc_counters_t;
+
+typedef struct cache_bin_t
+{
+	void* head;
+	int count;
+} cache_bin_t;
+
+// Per-thread stock of free blocks for each size class.
+// Only the owning thread touches the bins, so no locking is needed.
+typedef struct thread_cache_t
+{
+	heap_t* heap;
+	cache_bin_t bins[k_cache_class_count];
+	alloc_counters_t counters;
+	tag_delta_t tags[k_heap_tag_count];
+	sampler_t sampler;
+	struct thread_cache_t* prev;
+	struct thread_cache_t* next;
+} thread_cache_t;
 
 typedef struct heap_t
 {
 	tlsf_t tlsf;
 	size_t grow_increment;
 	arena_t* arena;
-	alloc_info_t* first_alloc;
+
+	// Address space reserved up front, committed from the start as the
+	// heap grows. The newest arena inside it is extended in place.
+	char* reserve;
+	size_t reserve_size;
+	size_t reserve_used;
+	arena_t* reserve_arena;
 	mutex_t* mutex;
+
+	// Guarded by the mutex.
+	alloc_counters_t counters;
+	size_t bytes_allocated;
+	size_t peak_bytes_allocated;
+	size_t bytes_committed;
+	int arena_count;
+	size_t auto_trim_threshold;
+	size_t trim_mark;
+	large_block_t* large;
+	size_t bytes_large;
+	int large_count;
+
+	tag_totals_t tags[k_heap_tag_count];
+	heap_budget_callback_t budget_callback;
+	void* budget_user;
+
+	const char* leak_report_path;
+
+	size_t page_size;
+	size_t large_threshold;
+	bool large_huge_pages;
+
+	DWORD cache_index;
+	thread_cache_t* caches;
+	bool cache_enabled;
+
+	heap_sample_mode_t sample_mode;
+	uint64_t sample_interval;
+	int sample_epoch;
+	sampler_t fallback_sampler;
+
+	stack_slab_t* stack_slab;
+	stack_record_t unknown_stack;
+	int stack_count;
+	stack_record_t* stack_table[k_stack_table_capacity];
 } heap_t;
 
+static const size_t k_header_size =
+	(sizeof(alloc_header_t) + sizeof(uint32_t) + (k_cache_alignment - 1)) & ~(size_t)(k_cache_alignment - 1);
+
+static void WINAPI thread_cache_exit(void* data);
+
 heap_t* heap_create(size_t grow_increment)
 {
-	heap_t* heap = VirtualAlloc(NULL, sizeof(heap_t) + tlsf_size(),
-		MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	heap_t* heap = vm_alloc(sizeof(heap_t) + tlsf_size());
 	if (!heap)
 	{
 		debug_print(
@@ -48,28 +237,354 @@ heap_t* heap_create(size_t grow_increment)
 		return NULL;
 	}
 
-	heap->mutex = mutex_create();
+	// Pages from the OS are zeroed, so the stack table starts empty.
+	heap->mutex = mutex_create_named("heap");
 	heap->grow_increment = grow_increment;
 	heap->tlsf = tlsf_create(heap + 1);
 	heap->arena = NULL;
-	heap->first_alloc= NULL;
+	heap->caches = NULL;
+	heap->cache_index = FlsAlloc(thread_cache_exit);
+	heap->cache_enabled = heap->cache_index != FLS_OUT_OF_INDEXES;
+	heap->sample_mode = k_heap_sample_all;
+	heap->sample_interval = 1;
+	heap->page_size = vm_page_size();
+	heap->large_threshold = k_large_threshold;
 
 	return heap;
 }
 
-void* heap_alloc(heap_t* heap, size_t size, size_t alignment)
+const char* heap_tag_name(heap_tag_t tag)
+{
+	return k_tag_names[tag];
+}
+
+void heap_set_tag_budget(heap_t* heap, heap_tag_t tag, size_t soft_budget, size_t hard_budget)
+{
+	heap->tags[tag].soft_budget = (int64_t)soft_budget;
+	heap->tags[tag].hard_budget = (int64_t)hard_budget;
+}
+
+void heap_set_budget_callback(heap_t* heap, heap_budget_callback_t callback, void* user)
+{
+	heap->budget_callback = callback;
+	heap->budget_user = user;
+}
+
+void heap_get_tag_stats(heap_t* heap, heap_tag_t tag, heap_tag_stats_t* stats)
+{
+	tag_totals_t* totals = &heap->tags[tag];
+
+	// Caches fold their deltas under the mutex, so nothing is counted twice.
+	mutex_lock(heap->mutex);
+	int64_t live_bytes = atomic_load64(&totals->live_bytes);
+	int64_t live_count = atomic_load64(&totals->live_count);
+	int64_t total_count = atomic_load64(&totals->total_count);
+	for (thread_cache_t* cache = heap->caches; cache; cache = cache->next)
+	{
+		live_bytes += cache->tags[tag].live_bytes;
+		live_count += cache->tags[tag].live_count;
+		total_count += cache->tags[tag].total_count;
+	}
+	mutex_unlock(heap->mutex);
+
+	stats->live_bytes = (size_t)live_bytes;
+	stats->peak_bytes = (size_t)__max(atomic_load64(&totals->peak_bytes), live_bytes);
+	stats->live_count = live_count;
+	stats->total_count = total_count;
+}
+
+static void tag_budget_exceeded(heap_t* heap, heap_tag_t tag, int64_t live_bytes, int64_t budget, bool hard)
+{
+	if (heap->budget_callback)
+	{
+		heap->budget_callback(tag, (size_t)live_bytes, (size_t)budget, hard, heap->budget_user);
+		return;
+	}
+	debug_print(
+		k_print_warning,
+		"Heap tag %s over %s budget: %lld of %lld bytes\n",
+		k_tag_names[tag], hard ? "hard" : "soft", live_bytes, budget);
+}
+
+// Adds bytes and allocations to a tag's totals.
+// With enforce set, refuses growth that would take the tag over its hard
+// budget. Otherwise the growth has already happened and is only counted.
+static bool tag_add(heap_t* heap, heap_tag_t tag, int64_t bytes, int64_t count, int64_t total_count, bool enforce)
+{
+	tag_totals_t* totals = &heap->tags[tag];
+	int64_t live = atomic_add64(&totals->live_bytes, bytes) + bytes;
+	if (bytes > 0)
+	{
+		int64_t hard_budget = totals->hard_budget;
+		if (enforce && hard_budget && live > hard_budget)
+		{
+			atomic_add64(&totals->live_bytes, -bytes);
+			tag_budget_exceeded(heap, tag, live, hard_budget, true);
+			return false;
+		}
+		int64_t soft_budget = totals->soft_budget;
+		if (soft_budget && live > soft_budget && live - bytes <= soft_budget)
+		{
+			tag_budget_exceeded(heap, tag, live, soft_budget, false);
+		}
+
+		int64_t peak = atomic_load64(&totals->peak_bytes);
+		while (live > peak)
+		{
+			int64_t old_peak = atomic_compare_and_exchange64(&totals->peak_bytes, peak, live);
+			if (old_peak == peak)
+			{
+				break;
+			}
+			peak = old_peak;
+		}
+	}
+	if (count)
+	{
+		atomic_add64(&totals->live_count, count);
+	}
+	if (total_count)
+	{
+		atomic_add64(&totals->total_count, total_count);
+	}
+	return true;
+}
+
+// Charges an allocation that takes the heap lock to its tag.
+// Hard budgets are only checked here; see tag_fold().
+static bool tag_reserve(heap_t* heap, heap_tag_t tag, int64_t bytes, int64_t count)
+{
+	return tag_add(heap, tag, bytes, count, count, true);
+}
+
+static void tag_release(heap_t* heap, heap_tag_t tag, int64_t bytes, int64_t count)
+{
+	tag_totals_t* totals = &heap->tags[tag];
+	atomic_add64(&totals->live_bytes, -bytes);
+	if (count)
+	{
+		atomic_add64(&totals->live_count, -count);
+	}
+}
+
+// Charges an allocation served from a thread cache to its tag without
+// touching the shared totals.
+static void tag_delta_add(thread_cache_t* cache, heap_tag_t tag, int64_t bytes, int64_t count)
+{
+	tag_delta_t* delta = &cache->tags[tag];
+	delta->live_bytes += bytes;
+	delta->live_count += count;
+	if (count > 0)
+	{
+		delta->total_count += count;
+	}
+}
+
+// Moves a thread cache's tag deltas into the shared totals.
+// Done whenever the cache refills or flushes, so the shared totals trail by
+// at most what the cache holds; cached allocations are never refused.
+// Heap mutex must be held.
+static void tag_fold(heap_t* heap, thread_cache_t* cache)
+{
+	for (int i = 0; i < k_heap_tag_count; ++i)
+	{
+		tag_delta_t* delta = &cache->tags[i];
+		if (delta->live_bytes || delta->live_count || delta->total_count)
+		{
+			tag_add(heap, i, delta->live_bytes, delta->live_count, delta->total_count, false);
+			delta->live_bytes = 0;
+			delta->live_count = 0;
+			delta->total_count = 0;
+		}
+	}
+}
+
+void heap_set_large_threshold(heap_t* heap, size_t threshold)
+{
+	heap->large_threshold = threshold;
+}
+
+void heap_set_large_huge_pages(heap_t* heap, bool enabled)
+{
+	heap->large_huge_pages = enabled;
+}
+
+heap_t* heap_create_reserved(size_t grow_increment, size_t reserve_size)
+{
+	heap_t* heap = heap_create(grow_increment);
+	if (heap)
+	{
+		heap->reserve_size = (reserve_size + (heap->page_size - 1)) & ~(heap->page_size - 1);
+		heap->reserve = vm_reserve(heap->reserve_size);
+		if (!heap->reserve)
+		{
+			debug_print(
+				k_print_warning,
+				"Heap could not reserve %zu bytes; growing in separate arenas.\n",
+				heap->reserve_size);
+			heap->reserve_size = 0;
+		}
+	}
+	return heap;
+}
+
+void heap_set_sampling(heap_t* heap, heap_sample_mode_t mode, uint64_t interval)
 {
 	mutex_lock(heap->mutex);
+	heap->sample_mode = mode;
+	heap->sample_interval = __max(interval, 1);
+	atomic_increment(&heap->sample_epoch);
+	mutex_unlock(heap->mutex);
+}
+
+// Draw the number of bytes until the next sample from an exponential
+// distribution, so sampled points form a Poisson process over allocated bytes.
+static int64_t sampler_next_byte_interval(sampler_t* sampler, uint64_t mean)
+{
+	sampler->random ^= sampler->random << 13;
+	sampler->random ^= sampler->random >> 7;
+	sampler->random ^= sampler->random << 17;
+	double uniform = ((sampler->random >> 11) + 1) * (1.0 / 9007199254740993.0);
+	return (int64_t)(-log(uniform) * (double)mean) + 1;
+}
+
+// Returns how many allocations' worth of memory this allocation stands for
+// if it should be sampled, or zero if its call stack should be skipped.
+static float sampler_weight(heap_t* heap, sampler_t* sampler, size_t size)
+{
+	heap_sample_mode_t mode = heap->sample_mode;
+	uint64_t interval = heap->sample_interval;
+	int epoch = heap->sample_epoch;
+	if (sampler->epoch != epoch)
+	{
+		sampler->epoch = epoch;
+		if (!sampler->random)
+		{
+			sampler->random = ((uint64_t)(uintptr_t)sampler * 0x9E3779B97F4A7C15ULL) ^ timer_get_ticks();
+			sampler->random |= 1;
+		}
+		sampler->countdown = mode == k_heap_sample_bytes ? sampler_next_byte_interval(sampler, interval) : (int64_t)interval;
+	}
+
+	switch (mode)
+	{
+	case k_heap_sample_all:
+		return 1.0f;
+	case k_heap_sample_every_n:
+		if (--sampler->countdown > 0)
+		{
+			return 0.0f;
+		}
+		sampler->countdown = (int64_t)interval;
+		return (float)interval;
+	case k_heap_sample_bytes:
+		sampler->countdown -= (int64_t)size;
+		if (sampler->countdown > 0)
+		{
+			return 0.0f;
+		}
+		sampler->countdown = sampler_next_byte_interval(sampler, interval);
+		// An allocation of this size is sampled with probability 1 - e^(-size/mean).
+		return (float)(1.0 / -expm1(-(double)__max(size, 1) / (double)interval));
+	default:
+		return 0.0f;
+	}
+}
+
+static void stack_record_add(stack_record_t* record, size_t size, float weight, int sign)
+{
+	atomic_add64(&record->live_bytes, sign * (int64_t)((double)size * weight + 0.5));
+	atomic_add64(&record->live_count, sign * (int64_t)(weight + 0.5f));
+}
+
+void heap_set_thread_cache_enabled(heap_t* heap, bool enabled)
+{
+	heap->cache_enabled = enabled && heap->cache_index != FLS_OUT_OF_INDEXES;
+}
+
+static int size_class_index(size_t size, size_t alignment)
+{
+	if (alignment > k_cache_alignment)
+	{
+		return -1;
+	}
+	for (int i = 0; i < k_cache_class_count; ++i)
+	{
+		if (size <= k_cache_class_sizes[i])
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Picks where an allocation of this size lives: a cache size class, a
+// mapping of its own, or -1 for an arena block of its exact size.
+static int alloc_class_index(heap_t* heap, size_t header_size, size_t size, size_t alignment)
+{
+	if (heap->large_threshold && size >= heap->large_threshold)
+	{
+		return k_large_class_index;
+	}
+	return size_class_index(header_size + size, alignment);
+}
+
+// Commits more of the reserved range. Extends the newest reserved arena so
+// its last free block can merge with the new pages, or starts a new arena
+// once the pool would outgrow what TLSF can manage.
+// Heap mutex must be held.
+static bool reserve_grow_locked(heap_t* heap, size_t size, size_t alignment)
+{
+	size_t grow_size = __max(heap->grow_increment, size + alignment + sizeof(arena_t) + tlsf_pool_overhead());
+	grow_size = (grow_size + (heap->page_size - 1)) & ~(heap->page_size - 1);
+	if (grow_size > heap->reserve_size - heap->reserve_used)
+	{
+		return false;
+	}
+
+	char* address = heap->reserve + heap->reserve_used;
+	if (!vm_commit(address, grow_size))
+	{
+		return false;
+	}
+	heap->reserve_used += grow_size;
+	heap->bytes_committed += grow_size;
+
+	arena_t* arena = heap->reserve_arena;
+	if (arena && arena->size + grow_size - sizeof(arena_t) <= tlsf_block_size_max())
+	{
+		tlsf_extend_pool(heap->tlsf, arena->pool, arena->size - sizeof(arena_t), grow_size);
+		arena->size += grow_size;
+		return true;
+	}
 
+	arena = (arena_t*)address;
+	arena->pool = tlsf_add_pool(heap->tlsf, arena + 1, grow_size - sizeof(arena_t));
+	arena->size = grow_size;
+	arena->reserved = true;
+	arena->next = heap->arena;
+	heap->arena = arena;
+	heap->arena_count++;
+	heap->reserve_arena = arena;
+	return true;
+}
+
+// Allocates a raw TLSF block, growing the heap if it is exhausted.
+// The block is marked free until its owner publishes it as live.
+// Heap mutex must be held.
+static void* block_alloc_locked(heap_t* heap, size_t size, size_t alignment)
+{
 	void* address = tlsf_memalign(heap->tlsf, alignment, size);
+	if (!address && heap->reserve && reserve_grow_locked(heap, size, alignment))
+	{
+		address = tlsf_memalign(heap->tlsf, alignment, size);
+	}
 	if (!address)
 	{
 		size_t arena_size =
 			__max(heap->grow_increment, size * 2) +
 			sizeof(arena_t);
-		arena_t* arena = VirtualAlloc(NULL,
-			arena_size + tlsf_pool_overhead(),
-			MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		arena_t* arena = vm_alloc(arena_size + tlsf_pool_overhead());
 		if (!arena)
 		{
 			debug_print(
@@ -79,119 +594,1090 @@ void* heap_alloc(heap_t* heap, size_t size, size_t alignment)
 		}
 
 		arena->pool = tlsf_add_pool(heap->tlsf, arena + 1, arena_size);
+		arena->size = arena_size + tlsf_pool_overhead();
+		arena->reserved = false;
 
 		arena->next = heap->arena;
 		heap->arena = arena;
+		heap->arena_count++;
+		heap->bytes_committed += arena->size;
 
 		address = tlsf_memalign(heap->tlsf, alignment, size);
+	}
+	if (address)
+	{
+		alloc_header_t* header = address;
+		header->state = k_alloc_state_free;
+		header->stack = NULL;
+		heap->bytes_allocated += tlsf_block_size(address);
+		heap->peak_bytes_allocated = __max(heap->peak_bytes_allocated, heap->bytes_allocated);
+		heap->trim_mark = __min(heap->trim_mark, heap->bytes_committed - heap->bytes_allocated);
+	}
+	return address;
+}
+
+// Size of the pages mapped for a large allocation spanning size bytes from
+// the start of its mapping. Mappings that can use huge pages are rounded
+// out to whole huge pages. Huge may be NULL.
+static size_t large_map_size(heap_t* heap, size_t size, bool* huge)
+{
+	size_t map_size = (size + (heap->page_size - 1)) & ~(heap->page_size - 1);
+	size_t huge_page_size = heap->large_huge_pages ? vm_huge_page_size() : 0;
+	bool use_huge = huge_page_size && map_size >= huge_page_size;
+	if (use_huge)
+	{
+		map_size = (map_size + (huge_page_size - 1)) & ~(huge_page_size - 1);
+	}
+	if (huge)
+	{
+		*huge = use_huge;
+	}
+	return map_size;
+}
 
+// Maps pages for an allocation and returns its header.
+// The block is marked free until its owner publishes it as live.
+// Heap mutex must be held.
+static alloc_header_t* large_alloc_locked(heap_t* heap, size_t size, size_t alignment)
+{
+	// Pages are only page aligned, so stricter alignment needs slack.
+	size_t header_offset = (sizeof(large_block_t) + (alignment - 1)) & ~(alignment - 1);
+	if (alignment > heap->page_size)
+	{
+		header_offset += alignment - heap->page_size;
 	}
 
-	alloc_info_t* info = VirtualAlloc(NULL, sizeof(alloc_info_t), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-	if (!info)
+	bool huge;
+	size_t map_size = large_map_size(heap, header_offset + size, &huge);
+	void* base = huge ? vm_alloc_huge(map_size) : vm_alloc(map_size);
+	if (!base)
 	{
 		debug_print(
 			k_print_error,
 			"OUT OF MEMORY!\n");
 		return NULL;
 	}
-	//Update the heap's pointer to the head of all the allocation information
-	info->next = heap->first_alloc;
-	heap->first_alloc = info;
-	//Record the size and memory address of the allocation
-	heap->first_alloc->size = size;
-	heap->first_alloc->address = address;
 
-	info->stack_frames = CaptureStackBackTrace(1, 8, info->stack, NULL);
-	mutex_unlock(heap->mutex); 
+	uintptr_t header = ((uintptr_t)base + sizeof(large_block_t) + (alignment - 1)) & ~(uintptr_t)(alignment - 1);
+	((alloc_header_t*)header)->state = k_alloc_state_free;
+	((alloc_header_t*)header)->stack = NULL;
+	large_block_t* large = (large_block_t*)header - 1;
+	large->base = base;
+	large->size = map_size;
+	large->prev = NULL;
+	large->next = heap->large;
+	if (heap->large)
+	{
+		heap->large->prev = large;
+	}
+	heap->large = large;
 
-	return address;
+	heap->large_count++;
+	heap->bytes_large += map_size;
+	heap->bytes_committed += map_size;
+	heap->bytes_allocated += map_size;
+	heap->peak_bytes_allocated = __max(heap->peak_bytes_allocated, heap->bytes_allocated);
+	return (alloc_header_t*)header;
 }
 
-void heap_free(heap_t* heap, void* address)
+// Returns the pages of a large allocation to the OS.
+// Heap mutex must be held.
+static void large_free_locked(heap_t* heap, alloc_header_t* block)
 {
-	mutex_lock(heap->mutex);
-	alloc_info_t* current = heap->first_alloc;
-	//If the address is from the head of the heap's allocation info
-	if(current != NULL && current->address == address)
+	large_block_t* large = (large_block_t*)block - 1;
+	if (large->prev)
 	{
-		heap->first_alloc = current->next;
-		VirtualFree(current, 0, MEM_RELEASE);
+		large->prev->next = large->next;
 	}
-	else if(current != NULL)
+	else
 	{
-		//Find the address from the linked list of alloc info
-		//Remove and free the corresponding alloc info
-		while (current->next) 
-		{
-			if(current->next->address == address)
-			{
-				alloc_info_t* temp = current->next->next;
-				VirtualFree(current->next, 0, MEM_RELEASE);
-				current->next = temp;
-				break;
-			}
-			current = current->next;
-		}
+		heap->large = large->next;
 	}
-	tlsf_free(heap->tlsf, address);
-	mutex_unlock(heap->mutex);
+	if (large->next)
+	{
+		large->next->prev = large->prev;
+	}
+
+	heap->large_count--;
+	heap->bytes_large -= large->size;
+	heap->bytes_committed -= large->size;
+	heap->bytes_allocated -= large->size;
+	vm_free(large->base, large->size);
 }
 
-void heap_destroy(heap_t* heap)
+// Resizes the pages of a large allocation without copying where the OS
+// allows. Returns NULL and leaves the allocation alone otherwise.
+// Heap mutex must be held.
+static alloc_header_t* large_realloc_locked(heap_t* heap, alloc_header_t* block, size_t size)
 {
+	large_block_t* large = (large_block_t*)block - 1;
+	size_t large_offset = (char*)large - (char*)large->base;
+	// Rounded as when allocated, so a huge-page block that still fits its
+	// last huge page stays put.
+	size_t map_size = large_map_size(heap, large_offset + sizeof(large_block_t) + size, NULL);
+	size_t old_map_size = large->size;
+	if (map_size == old_map_size)
+	{
+		return block;
+	}
 
-	tlsf_destroy(heap->tlsf);
-	alloc_info_t* current = heap->first_alloc;
+	char* base = vm_remap(large->base, old_map_size, map_size);
+	if (!base)
+	{
+		// Pages that cannot be shrunk are simply kept.
+		return map_size < old_map_size ? block : NULL;
+	}
 
-	//Go through all the unfreed allocations and print out their size and call stacks
-	while (current)
+	large = (large_block_t*)(base + large_offset);
+	large->base = base;
+	large->size = map_size;
+	if (large->prev)
 	{
-		DWORD  error;
-		HANDLE h_process;
+		large->prev->next = large;
+	}
+	else
+	{
+		heap->large = large;
+	}
+	if (large->next)
+	{
+		large->next->prev = large;
+	}
+
+	heap->bytes_large = heap->bytes_large - old_map_size + map_size;
+	heap->bytes_committed = heap->bytes_committed - old_map_size + map_size;
+	heap->bytes_allocated = heap->bytes_allocated - old_map_size + map_size;
+	heap->peak_bytes_allocated = __max(heap->peak_bytes_allocated, heap->bytes_allocated);
+	return (alloc_header_t*)(large + 1);
+}
 
-		SymSetOptions(SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS);
+static void count_used_walker(void* ptr, size_t size, int used, void* user)
+{
+	*(int*)user += used;
+}
 
-		h_process = GetCurrentProcess();
+static void discard_free_walker(void* ptr, size_t size, int used, void* user)
+{
+	// A free block starts with TLSF's free list links and ends with the
+	// next block's back pointer. Everything in between can be discarded.
+	size_t links_size = 2 * sizeof(void*);
+	if (!used && size > links_size + sizeof(void*))
+	{
+		vm_discard((char*)ptr + links_size, size - links_size - sizeof(void*));
+	}
+}
 
-		if (!SymInitialize(h_process, NULL, TRUE))
+// Release arenas with no used blocks and discard free pages in the rest.
+// Heap mutex must be held.
+static size_t heap_trim_locked(heap_t* heap)
+{
+	size_t released = 0;
+	arena_t** link = &heap->arena;
+	while (*link)
+	{
+		arena_t* arena = *link;
+		int used_blocks = 0;
+		tlsf_walk_pool(arena->pool, count_used_walker, &used_blocks);
+		if (used_blocks == 0 && !arena->reserved)
 		{
-			// SymInitialize failed
-			error = GetLastError();
-			debug_print(
-				k_print_error,
-				"SymInitialize returned error : %d\n",
-				error);
-			return;
+			*link = arena->next;
+			tlsf_remove_pool(heap->tlsf, arena->pool);
+			heap->arena_count--;
+			heap->bytes_committed -= arena->size;
+			released += arena->size;
+			vm_free(arena, arena->size);
 		}
-
-		char symbol_mem[sizeof(IMAGEHLP_SYMBOL64) + 256];
-		IMAGEHLP_SYMBOL64* symbol = (IMAGEHLP_SYMBOL64*)symbol_mem;
-		symbol->SizeOfStruct = sizeof(IMAGEHLP_SYMBOL64);
-		symbol->MaxNameLength = 255;
-
-		printf("Memory leak of size %zu bytes with callstack:\n", current->size);
-		for(int i = 0; i < current->stack_frames; ++i)
+		else
 		{
-			SymGetSymFromAddr64(h_process, (DWORD64)current->stack[i], NULL, symbol);
-			printf("[%d] %s\n", i, symbol->Name);
+			tlsf_walk_pool(arena->pool, discard_free_walker, NULL);
+			link = &arena->next;
 		}
+	}
+	heap->trim_mark = heap->bytes_committed - heap->bytes_allocated;
+	return released;
+}
 
-		alloc_info_t* temp = current;
-		current = current->next;
-		VirtualFree(temp, 0, MEM_RELEASE);
-		SymCleanup(h_process);
+// Resizes a raw TLSF block, in place if it shrinks or the next block is
+// free, otherwise by moving it and copying its contents.
+// Returns the block's address, which may have changed, or NULL and leaves
+// the block alone if it cannot be resized.
+// Heap mutex must be held.
+static void* block_realloc_locked(heap_t* heap, void* block, size_t size, size_t alignment)
+{
+	// When TLSF has to move a block it only keeps its own alignment.
+	// Growth that needs more is left to the caller.
+	size_t old_block_size = tlsf_block_size(block);
+	if (size > old_block_size && alignment > tlsf_align_size())
+	{
+		return NULL;
 	}
-	
-	arena_t* arena = heap->arena;
-	while (arena)
+
+	void* address = tlsf_realloc(heap->tlsf, block, size);
+	if (address)
 	{
-		arena_t* next = arena->next;
-		VirtualFree(arena, 0, MEM_RELEASE);
-		arena = next;
+		heap->bytes_allocated = heap->bytes_allocated - old_block_size + tlsf_block_size(address);
+		heap->peak_bytes_allocated = __max(heap->peak_bytes_allocated, heap->bytes_allocated);
+		heap->trim_mark = __min(heap->trim_mark, heap->bytes_committed - heap->bytes_allocated);
+	}
+	return address;
+}
+
+// Returns a raw TLSF block to the heap.
+// Heap mutex must be held.
+static void block_free_locked(heap_t* heap, void* block)
+{
+	heap->bytes_allocated -= tlsf_block_size(block);
+	tlsf_free(heap->tlsf, block);
+
+	if (heap->auto_trim_threshold &&
+		heap->bytes_committed - heap->bytes_allocated > heap->trim_mark + heap->auto_trim_threshold)
+	{
+		heap_trim_locked(heap);
+	}
+}
+
+static uint32_t stack_hash(void** frames, int frame_count)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (int i = 0; i < frame_count; ++i)
+	{
+		hash ^= (uint64_t)(uintptr_t)frames[i];
+		hash *= 1099511628211ULL;
+	}
+	return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static stack_record_t* stack_table_find(heap_t* heap, uint32_t hash, void** frames, int frame_count, int* slot)
+{
+	int index = hash & (k_stack_table_capacity - 1);
+	while (true)
+	{
+		stack_record_t* record = ((stack_record_t* volatile*)heap->stack_table)[index];
+		if (!record ||
+			(record->hash == hash &&
+			record->frame_count == frame_count &&
+			memcmp(record->frames, frames, sizeof(void*) * frame_count) == 0))
+		{
+			*slot = index;
+			return record;
+		}
+		index = (index + 1) & (k_stack_table_capacity - 1);
+	}
+}
+
+// Returns the interned record for the calling stack.
+// Lookups are lock-free; only the first allocation from a new call stack
+// takes the heap mutex to insert a record.
+static stack_record_t* stack_record_capture(heap_t* heap)
+{
+	void* frames[k_alloc_stack_capacity];
+	int frame_count = CaptureStackBackTrace(2, k_alloc_stack_capacity, frames, NULL);
+	uint32_t hash = stack_hash(frames, frame_count);
+
+	int slot;
+	stack_record_t* record = stack_table_find(heap, hash, frames, frame_count, &slot);
+	if (record)
+	{
+		return record;
+	}
+
+	mutex_lock(heap->mutex);
+	record = stack_table_find(heap, hash, frames, frame_count, &slot);
+	if (!record && heap->stack_count < k_stack_table_max_load)
+	{
+		stack_slab_t* slab = heap->stack_slab;
+		if (!slab || sizeof(stack_slab_t) + (slab->used + 1) * sizeof(stack_record_t) > k_stack_slab_size)
+		{
+			slab = vm_alloc(k_stack_slab_size);
+			if (slab)
+			{
+				slab->next = heap->stack_slab;
+				slab->used = 0;
+				heap->stack_slab = slab;
+			}
+		}
+		if (slab)
+		{
+			record = (stack_record_t*)(slab + 1) + slab->used++;
+			record->hash = hash;
+			record->frame_count = frame_count;
+			memcpy(record->frames, frames, sizeof(void*) * frame_count);
+			InterlockedExchangePointer((void* volatile*)&heap->stack_table[slot], record);
+			heap->stack_count++;
+		}
+	}
+	mutex_unlock(heap->mutex);
+
+	return record ? record : &heap->unknown_stack;
+}
+
+static thread_cache_t* thread_cache_get(heap_t* heap)
+{
+	thread_cache_t* cache = FlsGetValue(heap->cache_index);
+	if (!cache)
+	{
+		cache = vm_alloc(sizeof(thread_cache_t));
+		if (!cache)
+		{
+			return NULL;
+		}
+		cache->heap = heap;
+		cache->prev = NULL;
+
+		mutex_lock(heap->mutex);
+		cache->next = heap->caches;
+		if (heap->caches)
+		{
+			heap->caches->prev = cache;
+		}
+		heap->caches = cache;
+		mutex_unlock(heap->mutex);
+
+		FlsSetValue(heap->cache_index, cache);
+	}
+	return cache;
+}
+
+static int cache_batch_count(int class_index)
+{
+	size_t count = k_cache_batch_bytes / k_cache_class_sizes[class_index];
+	return (int)__max(2, __min(count, k_cache_batch_max));
+}
+
+// Moves a batch of blocks from the shared TLSF instance into a bin.
+static void thread_cache_refill(thread_cache_t* cache, int class_index)
+{
+	heap_t* heap = cache->heap;
+	cache_bin_t* bin = &cache->bins[class_index];
+	int batch = cache_batch_count(class_index);
+
+	mutex_lock(heap->mutex);
+	for (int i = 0; i < batch; ++i)
+	{
+		alloc_header_t* block = block_alloc_locked(heap, k_cache_class_sizes[class_index], k_cache_alignment);
+		if (!block)
+		{
+			break;
+		}
+		block->state = k_alloc_state_free;
+		block->class_index = class_index;
+		*(void**)(block + 1) = bin->head;
+		bin->head = block;
+		bin->count++;
+	}
+	tag_fold(heap, cache);
+	mutex_unlock(heap->mutex);
+}
+
+// Returns count blocks from a bin to the shared TLSF instance.
+static void thread_cache_flush(thread_cache_t* cache, int class_index, int count)
+{
+	heap_t* heap = cache->heap;
+	cache_bin_t* bin = &cache->bins[class_index];
+
+	mutex_lock(heap->mutex);
+	for (int i = 0; i < count && bin->head; ++i)
+	{
+		alloc_header_t* block = bin->head;
+		bin->head = *(void**)(block + 1);
+		bin->count--;
+		block_free_locked(heap, block);
+	}
+	tag_fold(heap, cache);
+	mutex_unlock(heap->mutex);
+}
+
+static void thread_cache_destroy(thread_cache_t* cache)
+{
+	heap_t* heap = cache->heap;
+
+	mutex_lock(heap->mutex);
+	for (int i = 0; i < k_cache_class_count; ++i)
+	{
+		thread_cache_flush(cache, i, cache->bins[i].count);
+	}
+	heap->counters.bytes_in_use += cache->counters.bytes_in_use;
+	heap->counters.live_count += cache->counters.live_count;
+	heap->counters.total_count += cache->counters.total_count;
+	if (cache->prev)
+	{
+		cache->prev->next = cache->next;
+	}
+	else
+	{
+		heap->caches = cache->next;
+	}
+	if (cache->next)
+	{
+		cache->next->prev = cache->prev;
+	}
+	mutex_unlock(heap->mutex);
+
+	vm_free(cache, sizeof(thread_cache_t));
+}
+
+// Called by the OS when a thread that touched the heap exits.
+static void WINAPI thread_cache_exit(void* data)
+{
+	if (data)
+	{
+		thread_cache_destroy(data);
+	}
+}
+
+void* heap_alloc(heap_t* heap, size_t size, size_t alignment)
+{
+	return heap_alloc_tagged(heap, size, alignment, k_heap_tag_general);
+}
+
+void* heap_alloc_tagged(heap_t* heap, size_t size, size_t alignment, heap_tag_t tag)
+{
+	size_t header_size = (k_header_size + (alignment - 1)) & ~(alignment - 1);
+	int class_index = alloc_class_index(heap, header_size, size, alignment);
+
+	thread_cache_t* cache = heap->cache_index != FLS_OUT_OF_INDEXES ? thread_cache_get(heap) : NULL;
+
+	alloc_header_t* block = NULL;
+	if (class_index >= 0 && heap->cache_enabled)
+	{
+		if (cache)
+		{
+			cache_bin_t* bin = &cache->bins[class_index];
+			if (!bin->head)
+			{
+				thread_cache_refill(cache, class_index);
+			}
+			block = bin->head;
+			if (block)
+			{
+				bin->head = *(void**)(block + 1);
+				bin->count--;
+				cache->counters.bytes_in_use += size;
+				cache->counters.live_count++;
+				cache->counters.total_count++;
+				tag_delta_add(cache, tag, (int64_t)size, 1);
+			}
+		}
+	}
+	if (!block)
+	{
+		if (!tag_reserve(heap, tag, (int64_t)size, 1))
+		{
+			return NULL;
+		}
+
+		mutex_lock(heap->mutex);
+		if (class_index == k_large_class_index)
+		{
+			block = large_alloc_locked(heap, header_size + size, __max(alignment, k_cache_alignment));
+		}
+		else if (class_index >= 0)
+		{
+			block = block_alloc_locked(heap, k_cache_class_sizes[class_index], k_cache_alignment);
+		}
+		else
+		{
+			block = block_alloc_locked(heap, header_size + size, __max(alignment, k_cache_alignment));
+		}
+		if (block)
+		{
+			heap->counters.bytes_in_use += size;
+			heap->counters.live_count++;
+			heap->counters.total_count++;
+		}
+		mutex_unlock(heap->mutex);
+		if (!block)
+		{
+			tag_release(heap, tag, (int64_t)size, 1);
+			return NULL;
+		}
+	}
+
+	// Live reports walk blocks under the mutex without waiting for this
+	// thread, so the header is filled in before the state publishes it.
+	block->size = size;
+	block->class_index = (int16_t)class_index;
+	block->tag = (uint8_t)tag;
+	block->sample_weight = sampler_weight(heap, cache ? &cache->sampler : &heap->fallback_sampler, size);
+	block->stack = NULL;
+	if (block->sample_weight > 0.0f)
+	{
+		block->stack = stack_record_capture(heap);
+		stack_record_add(block->stack, size, block->sample_weight, 1);
+	}
+	atomic_store((int*)&block->state, k_alloc_state_live);
+
+	char* address = (char*)block + header_size;
+	((uint32_t*)address)[-1] = (uint32_t)header_size;
+	return address;
+}
+
+void heap_free(heap_t* heap, void* address)
+{
+	if (!address)
+	{
+		return;
+	}
+
+	uint32_t header_size = ((uint32_t*)address)[-1];
+	alloc_header_t* block = (alloc_header_t*)((char*)address - header_size);
+	// Unpublish before the header can be reused.
+	atomic_store((int*)&block->state, k_alloc_state_free);
+	if (block->stack)
+	{
+		stack_record_add(block->stack, block->size, block->sample_weight, -1);
+	}
+
+	if (block->class_index >= 0 && heap->cache_enabled)
+	{
+		thread_cache_t* cache = thread_cache_get(heap);
+		if (cache)
+		{
+			cache_bin_t* bin = &cache->bins[block->class_index];
+			*(void**)(block + 1) = bin->head;
+			bin->head = block;
+			bin->count++;
+			cache->counters.bytes_in_use -= block->size;
+			cache->counters.live_count--;
+			tag_delta_add(cache, block->tag, -(int64_t)block->size, -1);
+
+			int batch = cache_batch_count(block->class_index);
+			if (bin->count > batch * 2)
+			{
+				thread_cache_flush(cache, block->class_index, batch);
+			}
+			return;
+		}
+	}
+
+	tag_release(heap, block->tag, (int64_t)block->size, 1);
+
+	mutex_lock(heap->mutex);
+	heap->counters.bytes_in_use -= block->size;
+	heap->counters.live_count--;
+	if (block->class_index == k_large_class_index)
+	{
+		large_free_locked(heap, block);
+	}
+	else
+	{
+		block_free_locked(heap, block);
+	}
+	mutex_unlock(heap->mutex);
+}
+
+void* heap_realloc(heap_t* heap, void* address, size_t size, size_t alignment)
+{
+	if (!address)
+	{
+		return heap_alloc(heap, size, alignment);
+	}
+
+	uint32_t header_size = ((uint32_t*)address)[-1];
+	alloc_header_t* block = (alloc_header_t*)((char*)address - header_size);
+	size_t old_size = block->size;
+	heap_tag_t tag = block->tag;
+
+	// Resize the existing block only when a fresh allocation would be laid
+	// out alike.
+	size_t new_header_size = (k_header_size + (alignment - 1)) & ~(alignment - 1);
+	int class_index = alloc_class_index(heap, new_header_size, size, alignment);
+	alloc_header_t* resized = NULL;
+	if (new_header_size == header_size &&
+		((uintptr_t)address & (alignment - 1)) == 0 &&
+		class_index == block->class_index)
+	{
+		if (class_index >= 0)
+		{
+			// Still fits its size class.
+			thread_cache_t* cache = heap->cache_index != FLS_OUT_OF_INDEXES ? FlsGetValue(heap->cache_index) : NULL;
+			if (cache)
+			{
+				resized = block;
+				cache->counters.bytes_in_use += (int64_t)size - (int64_t)old_size;
+				tag_delta_add(cache, tag, (int64_t)size - (int64_t)old_size, 0);
+			}
+			else if (tag_reserve(heap, tag, (int64_t)size - (int64_t)old_size, 0))
+			{
+				resized = block;
+				mutex_lock(heap->mutex);
+				heap->counters.bytes_in_use += (int64_t)size - (int64_t)old_size;
+				mutex_unlock(heap->mutex);
+			}
+			else
+			{
+				return NULL;
+			}
+		}
+		else
+		{
+			if (!tag_reserve(heap, tag, (int64_t)size - (int64_t)old_size, 0))
+			{
+				return NULL;
+			}
+			mutex_lock(heap->mutex);
+			if (class_index == k_large_class_index)
+			{
+				resized = large_realloc_locked(heap, block, header_size + size);
+			}
+			else
+			{
+				resized = block_realloc_locked(heap, block, header_size + size, alignment);
+			}
+			if (resized)
+			{
+				heap->counters.bytes_in_use += (int64_t)size - (int64_t)old_size;
+			}
+			mutex_unlock(heap->mutex);
+			if (!resized)
+			{
+				// The copy is counted by the new allocation.
+				tag_release(heap, tag, (int64_t)size - (int64_t)old_size, 0);
+			}
+		}
+	}
+
+	if (!resized)
+	{
+		void* new_address = heap_alloc_tagged(heap, size, alignment, tag);
+		if (new_address)
+		{
+			memcpy(new_address, address, __min(old_size, size));
+			heap_free(heap, address);
+		}
+		return new_address;
+	}
+
+	// The allocation stays attributed to the call stack that made it.
+	if (resized->stack)
+	{
+		stack_record_add(resized->stack, old_size, resized->sample_weight, -1);
+		stack_record_add(resized->stack, size, resized->sample_weight, 1);
+	}
+	resized->size = size;
+	return (char*)resized + header_size;
+}
+
+size_t heap_trim(heap_t* heap)
+{
+	// Blocks cached by the calling thread would keep their arenas alive.
+	thread_cache_t* cache = heap->cache_index != FLS_OUT_OF_INDEXES ? FlsGetValue(heap->cache_index) : NULL;
+	if (cache)
+	{
+		for (int i = 0; i < k_cache_class_count; ++i)
+		{
+			thread_cache_flush(cache, i, cache->bins[i].count);
+		}
+	}
+
+	mutex_lock(heap->mutex);
+	size_t released = heap_trim_locked(heap);
+	mutex_unlock(heap->mutex);
+	return released;
+}
+
+void heap_set_auto_trim(heap_t* heap, size_t threshold)
+{
+	mutex_lock(heap->mutex);
+	heap->auto_trim_threshold = threshold;
+	heap->trim_mark = heap->bytes_committed - heap->bytes_allocated;
+	mutex_unlock(heap->mutex);
+}
+
+static void stats_walker(void* ptr, size_t size, int used, void* user)
+{
+	heap_stats_t* stats = user;
+	if (!used)
+	{
+		stats->bytes_free += size;
+		stats->free_block_count++;
+		stats->largest_free_block = __max(stats->largest_free_block, size);
+	}
+}
+
+void heap_get_stats(heap_t* heap, heap_stats_t* stats, bool walk_pools)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	mutex_lock(heap->mutex);
+
+	alloc_counters_t counters = heap->counters;
+	for (thread_cache_t* cache = heap->caches; cache; cache = cache->next)
+	{
+		counters.bytes_in_use += cache->counters.bytes_in_use;
+		counters.live_count += cache->counters.live_count;
+		counters.total_count += cache->counters.total_count;
+	}
+	stats->bytes_in_use = (size_t)counters.bytes_in_use;
+	stats->allocation_count = counters.live_count;
+	stats->total_allocation_count = counters.total_count;
+	stats->bytes_allocated = heap->bytes_allocated;
+	stats->peak_bytes_allocated = heap->peak_bytes_allocated;
+	stats->bytes_committed = heap->bytes_committed;
+	stats->arena_count = heap->arena_count;
+	stats->bytes_large = heap->bytes_large;
+	stats->large_count = heap->large_count;
+
+	if (walk_pools)
+	{
+		for (arena_t* arena = heap->arena; arena; arena = arena->next)
+		{
+			tlsf_walk_pool(arena->pool, stats_walker, stats);
+		}
+		if (stats->bytes_free)
+		{
+			stats->fragmentation = 1.0f - (float)stats->largest_free_block / (float)stats->bytes_free;
+		}
+	}
+
+	mutex_unlock(heap->mutex);
+}
+
+static void site_report(stack_record_t* record, heap_site_callback_t callback, void* user)
+{
+	heap_site_t site =
+	{
+		.frames = record->frames,
+		.frame_count = record->frame_count,
+		.live_bytes = atomic_load64(&record->live_bytes),
+		.live_count = atomic_load64(&record->live_count),
+	};
+	if (site.live_count > 0)
+	{
+		callback(&site, user);
+	}
+}
+
+void heap_enumerate_sites(heap_t* heap, heap_site_callback_t callback, void* user)
+{
+	for (int i = 0; i < k_stack_table_capacity; ++i)
+	{
+		stack_record_t* record = ((stack_record_t* volatile*)heap->stack_table)[i];
+		if (record)
+		{
+			site_report(record, callback, user);
+		}
+	}
+	site_report(&heap->unknown_stack, callback, user);
+}
+
+// Live allocations from one call stack, gathered for a report.
+typedef struct report_site_t
+{
+	stack_record_t* record;
+	size_t bytes;
+	int64_t count;
+} report_site_t;
+
+// Live allocations grouped by call stack, largest first.
+typedef struct report_t
+{
+	report_site_t* sites;
+	int site_count;
+	size_t sites_size;
+	size_t total_bytes;
+	int64_t total_count;
+} report_t;
+
+// Counts a block if its owner has published it as live.
+// Heap mutex must be held.
+static void report_count_block(heap_t* heap, alloc_header_t* block)
+{
+	if (atomic_load((int*)&block->state) != k_alloc_state_live)
+	{
+		return;
+	}
+	stack_record_t* record = block->stack ? block->stack : &heap->unknown_stack;
+	record->report_bytes += block->size;
+	record->report_count++;
+}
+
+static void report_walker(void* ptr, size_t size, int used, void* user)
+{
+	if (used)
+	{
+		report_count_block(user, ptr);
+	}
+}
+
+static void report_take_site(report_t* report, stack_record_t* record)
+{
+	if (record->report_count)
+	{
+		report_site_t* site = &report->sites[report->site_count++];
+		site->record = record;
+		site->bytes = (size_t)record->report_bytes;
+		site->count = record->report_count;
+		report->total_bytes += site->bytes;
+		report->total_count += site->count;
+		record->report_bytes = 0;
+		record->report_count = 0;
+	}
+}
+
+static int report_site_compare(const void* a, const void* b)
+{
+	const report_site_t* site_a = a;
+	const report_site_t* site_b = b;
+	return site_a->bytes < site_b->bytes ? 1 : site_a->bytes > site_b->bytes ? -1 : 0;
+}
+
+// Walks every live allocation and groups them by call stack.
+// Blocks allocation only for the duration of the walk. Allocations made
+// from thread caches while the walk runs may be missed.
+static bool report_collect(heap_t* heap, report_t* report)
+{
+	memset(report, 0, sizeof(*report));
+
+	mutex_lock(heap->mutex);
+
+	report->sites_size = sizeof(report_site_t) * (heap->stack_count + 1);
+	report->sites = vm_alloc(report->sites_size);
+	if (!report->sites)
+	{
+		mutex_unlock(heap->mutex);
+		return false;
+	}
+
+	for (arena_t* arena = heap->arena; arena; arena = arena->next)
+	{
+		tlsf_walk_pool(arena->pool, report_walker, heap);
+	}
+	for (large_block_t* large = heap->large; large; large = large->next)
+	{
+		report_count_block(heap, (alloc_header_t*)(large + 1));
+	}
+
+	for (int i = 0; i < k_stack_table_capacity; ++i)
+	{
+		if (heap->stack_table[i])
+		{
+			report_take_site(report, heap->stack_table[i]);
+		}
+	}
+	report_take_site(report, &heap->unknown_stack);
+
+	mutex_unlock(heap->mutex);
+
+	qsort(report->sites, report->site_count, sizeof(report_site_t), report_site_compare);
+	return true;
+}
+
+static void report_destroy(report_t* report)
+{
+	if (report->sites)
+	{
+		vm_free(report->sites, report->sites_size);
+	}
+}
+
+// Symbol lookup for a whole report, so DbgHelp is initialized only once.
+typedef struct symbolizer_t
+{
+	HANDLE process;
+	bool initialized;
+	char symbol_mem[sizeof(IMAGEHLP_SYMBOL64) + 256];
+} symbolizer_t;
+
+static void symbolizer_init(symbolizer_t* symbolizer)
+{
+	SymSetOptions(SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS);
+
+	symbolizer->process = GetCurrentProcess();
+	symbolizer->initialized = SymInitialize(symbolizer->process, NULL, TRUE);
+	if (!symbolizer->initialized)
+	{
+		debug_print(
+			k_print_error,
+			"SymInitialize returned error : %d\n",
+			GetLastError());
+	}
+
+	IMAGEHLP_SYMBOL64* symbol = (IMAGEHLP_SYMBOL64*)symbolizer->symbol_mem;
+	symbol->SizeOfStruct = sizeof(IMAGEHLP_SYMBOL64);
+	symbol->MaxNameLength = 255;
+}
+
+static void symbolizer_destroy(symbolizer_t* symbolizer)
+{
+	if (symbolizer->initialized)
+	{
+		SymCleanup(symbolizer->process);
+	}
+}
+
+static const char* symbolizer_name(symbolizer_t* symbolizer, void* address)
+{
+	IMAGEHLP_SYMBOL64* symbol = (IMAGEHLP_SYMBOL64*)symbolizer->symbol_mem;
+	if (!symbolizer->initialized ||
+		!SymGetSymFromAddr64(symbolizer->process, (DWORD64)address, NULL, symbol))
+	{
+		return "??";
+	}
+	return symbol->Name;
+}
+
+static void report_print_leaks(report_t* report, symbolizer_t* symbolizer)
+{
+	printf("Memory leaks: %zu bytes in %lld allocations from %d call stacks\n",
+		report->total_bytes, report->total_count, report->site_count);
+	for (int i = 0; i < report->site_count; ++i)
+	{
+		report_site_t* site = &report->sites[i];
+		if (!site->record->frame_count)
+		{
+			printf("Memory leak of %zu bytes in %lld allocations (call stack not sampled)\n", site->bytes, site->count);
+			continue;
+		}
+		printf("Memory leak of %zu bytes in %lld allocations with callstack:\n", site->bytes, site->count);
+		for (int j = 0; j < site->record->frame_count; ++j)
+		{
+			printf("[%d] %s\n", j, symbolizer_name(symbolizer, site->record->frames[j]));
+		}
+	}
+}
+
+static void json_write_string(FILE* file, const char* string)
+{
+	fputc('"', file);
+	for (const char* c = string; *c; ++c)
+	{
+		if (*c == '"' || *c == '\\')
+		{
+			fputc('\\', file);
+		}
+		fputc(*c, file);
+	}
+	fputc('"', file);
+}
+
+// Writes a report as JSON: totals, then one entry per call stack with its
+// live bytes, allocation count and symbolized frames.
+static bool report_write(report_t* report, symbolizer_t* symbolizer, const char* path)
+{
+	FILE* file = NULL;
+	if (fopen_s(&file, path, "w") != 0 || !file)
+	{
+		debug_print(k_print_error, "Heap report could not open %s\n", path);
+		return false;
+	}
+
+	fprintf(file, "{\n\"live_bytes\": %zu, \"live_count\": %lld,\n\"sites\": [\n", report->total_bytes, report->total_count);
+	for (int i = 0; i < report->site_count; ++i)
+	{
+		report_site_t* site = &report->sites[i];
+		fprintf(file, "{\"bytes\": %zu, \"count\": %lld, \"frames\": [", site->bytes, site->count);
+		for (int j = 0; j < site->record->frame_count; ++j)
+		{
+			if (j)
+			{
+				fputs(", ", file);
+			}
+			json_write_string(file, symbolizer_name(symbolizer, site->record->frames[j]));
+		}
+		fprintf(file, "]}%s\n", i + 1 < report->site_count ? "," : "");
+	}
+	fprintf(file, "]\n}\n");
+
+	fclose(file);
+	return true;
+}
+
+bool heap_dump_live(heap_t* heap, const char* path)
+{
+	report_t report;
+	if (!report_collect(heap, &report))
+	{
+		return false;
+	}
+
+	symbolizer_t symbolizer;
+	symbolizer_init(&symbolizer);
+	bool result = report_write(&report, &symbolizer, path);
+	symbolizer_destroy(&symbolizer);
+
+	report_destroy(&report);
+	return result;
+}
+
+void heap_set_leak_report_path(heap_t* heap, const char* path)
+{
+	heap->leak_report_path = path;
+}
+
+void heap_destroy(heap_t* heap)
+{
+	// Freeing the index flushes the calling thread's cache.
+	// Caches of threads that are still running are flushed here.
+	if (heap->cache_index != FLS_OUT_OF_INDEXES)
+	{
+		FlsFree(heap->cache_index);
+	}
+	while (heap->caches)
+	{
+		thread_cache_destroy(heap->caches);
+	}
+
+	for (int i = 0; i < k_heap_tag_count; ++i)
+	{
+		tag_totals_t* totals = &heap->tags[i];
+		if (totals->total_count)
+		{
+			debug_print(
+				k_print_info,
+				"Heap tag %s: %lld bytes live in %lld allocations, peak %lld bytes, %lld allocations total\n",
+				k_tag_names[i], totals->live_bytes, totals->live_count, totals->peak_bytes, totals->total_count);
+		}
+	}
+
+	// Report unfreed allocations grouped by call stack.
+	report_t report;
+	if (report_collect(heap, &report) && report.site_count)
+	{
+		symbolizer_t symbolizer;
+		symbolizer_init(&symbolizer);
+		report_print_leaks(&report, &symbolizer);
+		if (heap->leak_report_path)
+		{
+			report_write(&report, &symbolizer, heap->leak_report_path);
+		}
+		symbolizer_destroy(&symbolizer);
+	}
+	report_destroy(&report);
+
+	tlsf_destroy(heap->tlsf);
+
+	arena_t* arena = heap->arena;
+	while (arena)
+	{
+		arena_t* next = arena->next;
+		if (!arena->reserved)
+		{
+			vm_free(arena, arena->size);
+		}
+		arena = next;
+	}
+	if (heap->reserve)
+	{
+		vm_free(heap->reserve, heap->reserve_size);
+	}
+
+	while (heap->large)
+	{
+		large_block_t* next = heap->large->next;
+		vm_free(heap->large->base, heap->large->size);
+		heap->large = next;
+	}
+
+	stack_slab_t* slab = heap->stack_slab;
+	while (slab)
+	{
+		stack_slab_t* next = slab->next;
+		vm_free(slab, k_stack_slab_size);
+		slab = next;
 	}
 
 	mutex_destroy(heap->mutex);
 
-	VirtualFree(heap, 0, MEM_RELEASE);
+	vm_free(heap, sizeof(heap_t) + tlsf_size());
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 // Heap Memory Manager
@@ -10,19 +12,197 @@
 // Handle to a heap.
 typedef struct heap_t heap_t;
 
-// Holds the address, size, and call stack of memory that was allocated
-typedef struct alloc_info_t alloc_info_t;
+// Subsystem an allocation is charged to. See heap_alloc_tagged().
+typedef enum heap_tag_t
+{
+	k_heap_tag_general,
+	k_heap_tag_ecs,
+	k_heap_tag_fs,
+	k_heap_tag_net,
+	k_heap_tag_render,
+	k_heap_tag_gpu,
+
+	k_heap_tag_count,
+} heap_tag_t;
+
+// Memory charged to one tag. See heap_get_tag_stats().
+typedef struct heap_tag_stats_t
+{
+	// Bytes requested by live allocations and the highest this has been.
+	size_t live_bytes;
+	size_t peak_bytes;
+	// Number of live allocations and allocations made since creation.
+	int64_t live_count;
+	int64_t total_count;
+} heap_tag_stats_t;
+
+// Called when an allocation takes a tag over its soft budget, and when an
+// allocation is refused for exceeding the tag's hard budget.
+// May be called with the heap locked.
+typedef void (*heap_budget_callback_t)(heap_tag_t tag, size_t live_bytes, size_t budget, bool hard, void* user);
+
+// How allocations are chosen to record their call stack.
+// See heap_set_sampling().
+typedef enum heap_sample_mode_t
+{
+	// Record every allocation. This is the default.
+	k_heap_sample_all,
+	// Record one in every interval allocations.
+	k_heap_sample_every_n,
+	// Record at random points averaging one per interval bytes allocated.
+	// Large allocations are more likely to be sampled than small ones.
+	k_heap_sample_bytes,
+	// Record no call stacks.
+	k_heap_sample_none,
+} heap_sample_mode_t;
+
+// A call site with live sampled allocations. See heap_enumerate_sites().
+// Totals are estimates scaled up from the sampled allocations.
+typedef struct heap_site_t
+{
+	void* const* frames;
+	int frame_count;
+	int64_t live_bytes;
+	int64_t live_count;
+} heap_site_t;
+
+// Called once per call site by heap_enumerate_sites().
+typedef void (*heap_site_callback_t)(const heap_site_t* site, void* user);
+
+// Memory usage of a heap. See heap_get_stats().
+typedef struct heap_stats_t
+{
+	// Bytes requested by live allocations.
+	size_t bytes_in_use;
+	// Bytes in blocks handed out by the allocator, including headers and
+	// blocks held in thread caches, and the highest this has been.
+	size_t bytes_allocated;
+	size_t peak_bytes_allocated;
+	// Bytes obtained from the OS and the number of arenas holding them.
+	size_t bytes_committed;
+	int arena_count;
+	// Number of live allocations and allocations made since creation.
+	int64_t allocation_count;
+	int64_t total_allocation_count;
+	// Bytes mapped for large allocations and their number.
+	// Included in bytes_allocated and bytes_committed.
+	size_t bytes_large;
+	int large_count;
+
+	// Only filled in when the pools are walked.
+	size_t bytes_free;
+	size_t largest_free_block;
+	int free_block_count;
+	// 0 when all free memory is one block, approaching 1 as it splinters.
+	float fragmentation;
+} heap_stats_t;
 
 // Creates a new memory heap.
 // The grow increment is the default size with which the heap grows.
 // Should be a multiple of OS page size.
 heap_t* heap_create(size_t grow_increment);
 
+// Creates a new memory heap inside reserve_size bytes of address space
+// reserved up front. Pages are committed grow_increment at a time as the
+// heap grows, and each step extends the previous pool so free memory can
+// merge across steps. Reserving costs no memory; 64 GB is reasonable on
+// 64-bit systems. Grows in separate arenas if the range is used up or
+// cannot be reserved.
+heap_t* heap_create_reserved(size_t grow_increment, size_t reserve_size);
+
 // Destroy a previously created heap.
 void heap_destroy(heap_t* heap);
 
 // Allocate memory from a heap.
+// Small requests are served from a cache owned by the calling thread,
+// which is refilled from and flushed to the shared heap in batches.
+// Large requests get pages of their own. See heap_set_large_threshold().
 void* heap_alloc(heap_t* heap, size_t size, size_t alignment);
 
+// Allocate memory from a heap and charge it to a subsystem.
+// Returns NULL if the allocation would exceed the tag's hard budget.
+// heap_alloc() charges its allocations to k_heap_tag_general.
+void* heap_alloc_tagged(heap_t* heap, size_t size, size_t alignment, heap_tag_t tag);
+
+// Resize memory previously allocated from a heap, keeping its contents up
+// to the smaller of the old and new sizes.
+// Grows in place where possible: into free space after the block, or for
+// large allocations by resizing their pages. Otherwise allocates, copies
+// and frees. A NULL address allocates. The memory keeps its tag.
+// Returns NULL if out of memory; the original memory is then untouched.
+void* heap_realloc(heap_t* heap, void* address, size_t size, size_t alignment);
+
 // Free memory previously allocated from a heap.
 void heap_free(heap_t* heap, void* address);
+
+// Enable or disable the per-thread caches used for small allocations.
+// Caches are enabled by default. Memory may be freed on any thread
+// regardless of this setting.
+void heap_set_thread_cache_enabled(heap_t* heap, bool enabled);
+
+// Get memory usage of a heap.
+// Counters are maintained on every allocation and are cheap to read.
+// If walk_pools is true, also walks every free block to measure free space
+// and fragmentation; this holds the heap lock for the duration of the walk.
+void heap_get_stats(heap_t* heap, heap_stats_t* stats, bool walk_pools);
+
+// Choose which allocations capture a call stack.
+// Capturing is costly; sampling keeps attribution cheap enough for
+// production. Only sampled allocations are attributed in leak reports.
+// May be changed at any time.
+void heap_set_sampling(heap_t* heap, heap_sample_mode_t mode, uint64_t interval);
+
+// Report estimated live bytes for each allocation call site.
+// Does not block allocation on other threads.
+void heap_enumerate_sites(heap_t* heap, heap_site_callback_t callback, void* user);
+
+// Return unused memory to the OS.
+// Arenas with no live allocations are released. Free space in the other
+// arenas is discarded so the OS can reclaim its pages.
+// Blocks cached by other threads keep their arenas alive.
+// Returns the number of bytes released.
+size_t heap_trim(heap_t* heap);
+
+// Trim automatically once free memory grows by more than threshold bytes
+// since the last trim. A threshold of zero, the default, disables it.
+void heap_set_auto_trim(heap_t* heap, size_t threshold);
+
+// Allocations of at least threshold bytes bypass the arenas: each maps its
+// own pages and returns them to the OS when freed. Defaults to 256 KB.
+// A threshold of zero sends every allocation through the arenas.
+void heap_set_large_threshold(heap_t* heap, size_t threshold);
+
+// Back large allocations with huge pages where the OS allows.
+// Allocations of at least one huge page are rounded up to a multiple of it.
+// Off by default.
+void heap_set_large_huge_pages(heap_t* heap, bool enabled);
+
+// Get the name of a tag, for reports.
+const char* heap_tag_name(heap_tag_t tag);
+
+// Get live and peak memory charged to a tag.
+// Totals are updated without locking and are cheap to read.
+void heap_get_tag_stats(heap_t* heap, heap_tag_t tag, heap_tag_stats_t* stats);
+
+// Set budgets for memory charged to a tag. Zero means no budget.
+// Exceeding the soft budget only reports it; allocations that would
+// exceed the hard budget fail. Blocks served from thread caches are counted
+// when the cache next refills or flushes and are never refused, so a tag
+// can run over its hard budget by what the caches hold.
+// See heap_set_budget_callback().
+void heap_set_tag_budget(heap_t* heap, heap_tag_t tag, size_t soft_budget, size_t hard_budget);
+
+// Set the function called when a tag exceeds a budget.
+// Without one, budget overruns are logged as warnings.
+void heap_set_budget_callback(heap_t* heap, heap_budget_callback_t callback, void* user);
+
+// Write every live allocation to a JSON file, grouped by call stack with
+// the number of allocations and bytes from each, largest first.
+// Call stacks are symbolized once each. Allocation is blocked only while
+// live blocks are gathered, not while the file is written.
+// Returns false if the file could not be written.
+bool heap_dump_live(heap_t* heap, const char* path);
+
+// Also write the leak report printed by heap_destroy() to a JSON file in
+// the heap_dump_live() format. The path must stay valid until then.
+void heap_set_leak_report_path(heap_t* heap, const char* path);
@@ -0,0 +1,475 @@
+#include "job.h"
+
+#include "atomic.h"
+#include "debug.h"
+#include "heap.h"
+#include "mutex.h"
+#include "object_pool.h"
+#include "queue.h"
+#include "semaphore.h"
+#include "thread.h"
+
+#include <limits.h>
+#include <stdio.h>
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+enum
+{
+	k_job_cache_line_size = 64,
+
+	// Jobs each worker's deque can hold before spilling to the injection queue.
+	k_job_deque_capacity = 1024,
+	k_job_injection_capacity = 1024,
+	k_job_pool_chunk = 256,
+
+	// Failed searches for work before an idle worker goes to sleep.
+	k_job_spin_count = 128,
+};
+
+typedef struct job_t
+{
+	job_function_t function;
+	void* data;
+	job_counter_t* counter;
+
+	// Link on a dependency's list of held jobs.
+	struct job_t* next;
+} job_t;
+
+typedef struct job_counter_t
+{
+	job_system_t* system;
+	int value;
+
+	// Jobs held until value reaches zero.
+	mutex_t* mutex;
+	job_t* held;
+} job_counter_t;
+
+// Chase-Lev deque.
+// The owner pushes and pops at bottom; thieves take from top with a CAS.
+// Indices wrap modulo 2^32, so they are only ever compared by distance.
+typedef struct job_deque_t
+{
+	job_t* slots[k_job_deque_capacity];
+
+	char top_padding[k_job_cache_line_size];
+	int top;
+	char bottom_padding[k_job_cache_line_size];
+	int bottom;
+	char end_padding[k_job_cache_line_size];
+} job_deque_t;
+
+typedef struct job_worker_t
+{
+	job_system_t* system;
+	int index;
+	unsigned int random;
+	thread_t* thread;
+	job_deque_t deque;
+} job_worker_t;
+
+typedef struct job_system_t
+{
+	heap_t* heap;
+	object_pool_t* job_pool;
+	queue_t* injection_queue;
+
+	// TLS slot holding the calling thread's job_worker_t, if it is one.
+	DWORD worker_index;
+	job_worker_t* workers;
+	int worker_count;
+
+	semaphore_t* wake;
+	int sleepers;
+	int quit;
+} job_system_t;
+
+static int worker_thread_func(void* user);
+
+static int job_distance(int a, int b)
+{
+	return (int)((unsigned int)a - (unsigned int)b);
+}
+
+static int job_advance(int index, int count)
+{
+	return (int)((unsigned int)index + (unsigned int)count);
+}
+
+static bool job_deque_push(job_deque_t* deque, job_t* job)
+{
+	int bottom = deque->bottom;
+	int top = atomic_load(&deque->top);
+	if (job_distance(bottom, top) >= k_job_deque_capacity)
+	{
+		return false;
+	}
+	deque->slots[(unsigned int)bottom % k_job_deque_capacity] = job;
+	atomic_store(&deque->bottom, job_advance(bottom, 1));
+	return true;
+}
+
+static job_t* job_deque_pop(job_deque_t* deque)
+{
+	int bottom = job_advance(deque->bottom, -1);
+	atomic_store(&deque->bottom, bottom);
+
+	// The bottom store must be visible before top is read, or a thief and
+	// the owner can both take the last job.
+	atomic_fence();
+	int top = atomic_load(&deque->top);
+
+	if (job_distance(bottom, top) < 0)
+	{
+		atomic_store(&deque->bottom, job_advance(bottom, 1));
+		return NULL;
+	}
+
+	job_t* job = deque->slots[(unsigned int)bottom % k_job_deque_capacity];
+	if (bottom == top)
+	{
+		// Last job: race thieves for it.
+		if (atomic_compare_and_exchange(&deque->top, top, job_advance(top, 1)) != top)
+		{
+			job = NULL;
+		}
+		atomic_store(&deque->bottom, job_advance(top, 1));
+	}
+	return job;
+}
+
+static job_t* job_deque_steal(job_deque_t* deque)
+{
+	int top = atomic_load(&deque->top);
+	atomic_fence();
+	int bottom = atomic_load(&deque->bottom);
+	if (job_distance(bottom, top) <= 0)
+	{
+		return NULL;
+	}
+
+	job_t* job = deque->slots[(unsigned int)top % k_job_deque_capacity];
+	if (atomic_compare_and_exchange(&deque->top, top, job_advance(top, 1)) != top)
+	{
+		return NULL;
+	}
+	return job;
+}
+
+job_system_t* job_system_create(heap_t* heap, int worker_count)
+{
+	if (worker_count <= 0)
+	{
+		worker_count = thread_get_core_count() - 1;
+		if (worker_count < 1)
+		{
+			worker_count = 1;
+		}
+	}
+
+	job_system_t* system = heap_alloc(heap, sizeof(job_system_t), 8);
+	system->heap = heap;
+	system->job_pool = object_pool_create(heap, sizeof(job_t), 8, k_job_pool_chunk, k_heap_tag_general);
+	system->injection_queue = queue_create(heap, k_job_injection_capacity);
+	system->worker_index = TlsAlloc();
+	system->wake = semaphore_create(0, INT_MAX);
+	system->sleepers = 0;
+	system->quit = 0;
+
+	system->worker_count = worker_count;
+	system->workers = heap_alloc(heap, sizeof(job_worker_t) * worker_count, k_job_cache_line_size);
+	for (int i = 0; i < worker_count; ++i)
+	{
+		job_worker_t* worker = &system->workers[i];
+		worker->system = system;
+		worker->index = i;
+		worker->random = 2654435761u * (i + 1);
+		worker->deque.top = 0;
+		worker->deque.bottom = 0;
+	}
+	for (int i = 0; i < worker_count; ++i)
+	{
+		system->workers[i].thread = thread_create(worker_thread_func, &system->workers[i]);
+		char name[32];
+		snprintf(name, sizeof(name), "job worker %d", i);
+		thread_set_name(system->workers[i].thread, name);
+	}
+
+	return system;
+}
+
+void job_system_destroy(job_system_t* system)
+{
+	atomic_store(&system->quit, 1);
+	for (int i = 0; i < system->worker_count; ++i)
+	{
+		semaphore_release(system->wake);
+	}
+	for (int i = 0; i < system->worker_count; ++i)
+	{
+		thread_destroy(system->workers[i].thread);
+	}
+
+	TlsFree(system->worker_index);
+	semaphore_destroy(system->wake);
+	queue_destroy(system->injection_queue);
+	object_pool_destroy(system->job_pool);
+	heap_free(system->heap, system->workers);
+	heap_free(system->heap, system);
+}
+
+int job_system_get_worker_count(job_system_t* system)
+{
+	return system->worker_count;
+}
+
+int job_system_get_worker_index(job_system_t* system)
+{
+	job_worker_t* worker = TlsGetValue(system->worker_index);
+	return worker ? worker->index : -1;
+}
+
+job_counter_t* job_counter_create(job_system_t* system)
+{
+	job_counter_t* counter = heap_alloc(system->heap, sizeof(job_counter_t), 8);
+	counter->system = system;
+	counter->value = 0;
+	counter->mutex = mutex_create_named("job counter");
+	counter->held = NULL;
+	return counter;
+}
+
+void job_counter_destroy(job_counter_t* counter)
+{
+	if (atomic_load(&counter->value) != 0)
+	{
+		debug_print(k_print_warning, "Job counter destroyed with %d jobs pending!\n", counter->value);
+	}
+	// Wait out a release that has published zero but not yet unlocked.
+	mutex_lock(counter->mutex);
+	mutex_unlock(counter->mutex);
+	mutex_destroy(counter->mutex);
+	heap_free(counter->system->heap, counter);
+}
+
+bool job_counter_is_done(job_counter_t* counter)
+{
+	return atomic_load(&counter->value) == 0;
+}
+
+// Wakes one sleeping worker if any are registered.
+// The interlocked read orders the check after the job was published, so a
+// worker that registered before the publish is always seen.
+static void job_wake(job_system_t* system)
+{
+	if (atomic_compare_and_exchange(&system->sleepers, 0, 0) > 0)
+	{
+		semaphore_release(system->wake);
+	}
+}
+
+static void job_push(job_system_t* system, job_t* job)
+{
+	job_worker_t* worker = TlsGetValue(system->worker_index);
+	if (!worker || !job_deque_push(&worker->deque, job))
+	{
+		queue_push(system->injection_queue, job);
+	}
+	job_wake(system);
+}
+
+static job_t* job_find(job_system_t* system, job_worker_t* worker)
+{
+	job_t* job = NULL;
+	if (worker)
+	{
+		job = job_deque_pop(&worker->deque);
+		if (job)
+		{
+			return job;
+		}
+	}
+
+	job = queue_try_pop(system->injection_queue);
+	if (job)
+	{
+		return job;
+	}
+
+	// Start at a random victim so thieves spread out.
+	unsigned int start = 0;
+	if (worker)
+	{
+		worker->random ^= worker->random << 13;
+		worker->random ^= worker->random >> 17;
+		worker->random ^= worker->random << 5;
+		start = worker->random;
+	}
+	for (int i = 0; i < system->worker_count; ++i)
+	{
+		job_worker_t* victim = &system->workers[(start + i) % system->worker_count];
+		if (victim != worker)
+		{
+			job = job_deque_steal(&victim->deque);
+			if (job)
+			{
+				return job;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void job_counter_release(job_counter_t* counter)
+{
+	// Only the final decrement needs the mutex; the others are lock-free.
+	int value = atomic_load(&counter->value);
+	while (value > 1)
+	{
+		int previous = atomic_compare_and_exchange(&counter->value, value, value - 1);
+		if (previous == value)
+		{
+			return;
+		}
+		value = previous;
+	}
+
+	// The counter may be destroyed as soon as it reads zero, so the held jobs
+	// are taken and zero is published under the mutex, which
+	// job_counter_destroy acquires before freeing. A job submitted against
+	// the counter since may have raised it again; held jobs then stay until
+	// that one finishes.
+	mutex_lock(counter->mutex);
+	job_system_t* system = counter->system;
+	job_t* held = NULL;
+	if (atomic_decrement(&counter->value) == 1)
+	{
+		held = counter->held;
+		counter->held = NULL;
+	}
+	mutex_unlock(counter->mutex);
+
+	while (held)
+	{
+		job_t* next = held->next;
+		job_push(system, held);
+		held = next;
+	}
+}
+
+static void job_run(job_system_t* system, job_t* job)
+{
+	job->function(job->data);
+
+	job_counter_t* counter = job->counter;
+	object_pool_free(system->job_pool, job);
+	if (counter)
+	{
+		job_counter_release(counter);
+	}
+}
+
+static job_t* job_alloc(job_system_t* system, job_function_t function, void* data, job_counter_t* counter)
+{
+	job_t* job = object_pool_alloc(system->job_pool);
+	job->function = function;
+	job->data = data;
+	job->counter = counter;
+	job->next = NULL;
+	if (counter)
+	{
+		atomic_increment(&counter->value);
+	}
+	return job;
+}
+
+void job_submit(job_system_t* system, job_function_t function, void* data, job_counter_t* counter)
+{
+	job_push(system, job_alloc(system, function, data, counter));
+}
+
+void job_submit_after(job_system_t* system, job_counter_t* dependency, job_function_t function, void* data, job_counter_t* counter)
+{
+	job_t* job = job_alloc(system, function, data, counter);
+
+	mutex_lock(dependency->mutex);
+	bool hold = atomic_load(&dependency->value) != 0;
+	if (hold)
+	{
+		job->next = dependency->held;
+		dependency->held = job;
+	}
+	mutex_unlock(dependency->mutex);
+
+	if (!hold)
+	{
+		job_push(system, job);
+	}
+}
+
+void job_wait(job_counter_t* counter)
+{
+	job_system_t* system = counter->system;
+	job_worker_t* worker = TlsGetValue(system->worker_index);
+	int spin = 0;
+	while (atomic_load(&counter->value) != 0)
+	{
+		job_t* job = job_find(system, worker);
+		if (job)
+		{
+			job_run(system, job);
+			spin = 0;
+		}
+		else if (spin++ < k_job_spin_count)
+		{
+			atomic_pause();
+		}
+		else
+		{
+			// The jobs being waited on are running elsewhere; give up the core.
+			thread_sleep(0);
+		}
+	}
+}
+
+static int worker_thread_func(void* user)
+{
+	job_worker_t* worker = user;
+	job_system_t* system = worker->system;
+	TlsSetValue(system->worker_index, worker);
+
+	int spin = 0;
+	while (!atomic_load(&system->quit))
+	{
+		job_t* job = job_find(system, worker);
+		if (job)
+		{
+			job_run(system, job);
+			spin = 0;
+			continue;
+		}
+		if (spin++ < k_job_spin_count)
+		{
+			atomic_pause();
+			continue;
+		}
+
+		// Register before the last look so a submit after it wakes us.
+		atomic_increment(&system->sleepers);
+		job = job_find(system, worker);
+		if (!job)
+		{
+			semaphore_acquire(system->wake);
+		}
+		atomic_decrement(&system->sleepers);
+		if (job)
+		{
+			job_run(system, job);
+		}
+		spin = 0;
+	}
+	return 0;
+}
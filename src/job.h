@@ -0,0 +1,65 @@
+#pragma once
+
+#include "heap.h"
+
+#include <stdbool.h>
+
+// Work-stealing job system.
+//
+// A fixed pool of worker threads runs short jobs. Each worker owns a
+// Chase-Lev deque: it pushes and pops its own jobs at the bottom, while
+// idle workers steal from the top of other workers' deques. Jobs submitted
+// from threads outside the pool go on a shared injection queue.
+//
+// Completion is tracked with counters. Submitting a job against a counter
+// raises it by one, and the counter drops again when the job has run.
+// A job can be held back until a counter reaches zero, and any thread can
+// wait on a counter with job_wait, which runs pending jobs while it waits.
+
+// Handle to a job system.
+typedef struct job_system_t job_system_t;
+
+// Handle to a job counter.
+typedef struct job_counter_t job_counter_t;
+
+// Function run by a job.
+typedef void (*job_function_t)(void* data);
+
+// Create a job system with worker_count worker threads.
+// If worker_count is zero, one worker is started per core, less one for
+// the calling thread, which is expected to help out in job_wait.
+job_system_t* job_system_create(heap_t* heap, int worker_count);
+
+// Destroy a job system.
+// Jobs still pending are not run; wait on their counters first.
+void job_system_destroy(job_system_t* system);
+
+// Get the number of worker threads in the job system.
+int job_system_get_worker_count(job_system_t* system);
+
+// Get the index of the calling worker thread, in [0, worker count).
+// Returns -1 when called from a thread outside the pool.
+int job_system_get_worker_index(job_system_t* system);
+
+// Create a counter with a value of zero.
+job_counter_t* job_counter_create(job_system_t* system);
+
+// Destroy a counter.
+// No job may be pending on the counter.
+void job_counter_destroy(job_counter_t* counter);
+
+// Determine if every job submitted against a counter has run.
+bool job_counter_is_done(job_counter_t* counter);
+
+// Queue function to run with data on the job system.
+// If counter is non-NULL, it is raised now and lowered once the job has run.
+// Called from a worker, the job goes on that worker's own deque.
+void job_submit(job_system_t* system, job_function_t function, void* data, job_counter_t* counter);
+
+// Queue function to run with data once dependency reaches zero.
+// If counter is non-NULL, it is raised now and lowered once the job has run.
+void job_submit_after(job_system_t* system, job_counter_t* dependency, job_function_t function, void* data, job_counter_t* counter);
+
+// Wait for a counter to reach zero.
+// The calling thread runs other pending jobs until then rather than blocking.
+void job_wait(job_counter_t* counter);
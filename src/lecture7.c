@@ -11,7 +11,12 @@ typedef struct thread_data_t
 {
 	int* counter;
 	mutex_t* mutex;
+	semaphore_t* semaphore;
 	event_t* start;
+
+	// Kernel objects, to compare against the futex-based primitives.
+	HANDLE win32_mutex;
+	HANDLE win32_semaphore;
 } thread_data_t;
 
 static int no_synchronization_func(void* user)
@@ -76,19 +81,73 @@ static int mutex_func(void* user)
 	return timeGetTime() - t0;
 }
 
-static void run_timed_test(int (*thread_func)(void*), const char* name)
+static int win32_mutex_func(void* user)
+{
+	thread_data_t* thread_data = user;
+	event_wait(thread_data->start);
+
+	DWORD t0 = timeGetTime();
+
+	for (int i = 0; i < 100000; ++i)
+	{
+		WaitForSingleObject(thread_data->win32_mutex, INFINITE);
+		*thread_data->counter = *thread_data->counter + 1;
+		ReleaseMutex(thread_data->win32_mutex);
+	}
+
+	return timeGetTime() - t0;
+}
+
+static int semaphore_func(void* user)
+{
+	thread_data_t* thread_data = user;
+	event_wait(thread_data->start);
+
+	DWORD t0 = timeGetTime();
+
+	for (int i = 0; i < 100000; ++i)
+	{
+		semaphore_acquire(thread_data->semaphore);
+		*thread_data->counter = *thread_data->counter + 1;
+		semaphore_release(thread_data->semaphore);
+	}
+
+	return timeGetTime() - t0;
+}
+
+static int win32_semaphore_func(void* user)
+{
+	thread_data_t* thread_data = user;
+	event_wait(thread_data->start);
+
+	DWORD t0 = timeGetTime();
+
+	for (int i = 0; i < 100000; ++i)
+	{
+		WaitForSingleObject(thread_data->win32_semaphore, INFINITE);
+		*thread_data->counter = *thread_data->counter + 1;
+		ReleaseSemaphore(thread_data->win32_semaphore, 1, NULL);
+	}
+
+	return timeGetTime() - t0;
+}
+
+static void run_timed_test(int (*thread_func)(void*), const char* name, int thread_count)
 {
 	int counter = 0;
 	thread_data_t thread_data =
 	{
 		.counter = &counter,
 		.mutex = mutex_create(),
+		.semaphore = semaphore_create(1, 1),
 		.start = event_create(),
+		.win32_mutex = CreateMutex(NULL, FALSE, NULL),
+		.win32_semaphore = CreateSemaphore(NULL, 1, 1, NULL),
 	};
 
 	// Create threads.
 	thread_t* threads[8];
-	for (int i = 0; i < _countof(threads); ++i)
+	for (int i = 0; i < thread_count; ++i)
 	{
 		threads[i] = thread_create(thread_func, &thread_data);
 	}
@@ -98,20 +157,32 @@ static void run_timed_test(int (*thread_func)(void*), const char* name)
 
 	// Wait for threads to be done.
 	int duration = 0;
-	for (int i = 0; i < _countof(threads); ++i)
+	for (int i = 0; i < thread_count; ++i)
 	{
 		duration += thread_destroy(threads[i]);
 	}
 	mutex_destroy(thread_data.mutex);
+	semaphore_destroy(thread_data.semaphore);
 	event_destroy(thread_data.start);
+	CloseHandle(thread_data.win32_mutex);
+	CloseHandle(thread_data.win32_semaphore);
 
-	debug_print(k_print_warning, "%s duration=%dms, counter=%d\n", name, duration, counter);
+	debug_print(k_print_warning, "%s threads=%d duration=%dms, counter=%d\n", name, thread_count, duration, counter);
 }
 
 void lecture7_thread_test()
 {
-	run_timed_test(no_synchronization_func, "no_synchronization");
-	run_timed_test(atomic_load_store_func, "atomic_load_store");
-	run_timed_test(atomic_increment_func, "atomic_increment");
-	run_timed_test(mutex_func, "mutex");
+	run_timed_test(no_synchronization_func, "no_synchronization", 8);
+	run_timed_test(atomic_load_store_func, "atomic_load_store", 8);
+	run_timed_test(atomic_increment_func, "atomic_increment", 8);
+
+	// Uncontended, then contended: the futex primitives against kernel objects.
+	int thread_counts[] = { 1, 8 };
+	for (int i = 0; i < _countof(thread_counts); ++i)
+	{
+		run_timed_test(mutex_func, "mutex", thread_counts[i]);
+		run_timed_test(win32_mutex_func, "win32_mutex", thread_counts[i]);
+		run_timed_test(semaphore_func, "semaphore", thread_counts[i]);
+		run_timed_test(win32_semaphore_func, "win32_semaphore", thread_counts[i]);
+	}
 }
@@ -1,12 +1,41 @@
+#include "benchmark.h"
 #include "debug.h"
 #include "fs.h"
 #include "heap.h"
+#include "job.h"
+#include "mutex.h"
 #include "render.h"
+#include "selftest.h"
 #include "simple_game.h"
 #include "final_game.h"
+#include "thread.h"
 #include "timer.h"
 #include "wm.h"
 
+#include <string.h>
+
+// Gives the latency-critical threads cores of their own: render on core 1
+// and network receive on core 2, with job workers kept off both. Core 0 is
+// left to the main thread and the OS.
+// Returns the number of job workers to start, or zero for the default when
+// there are too few cores to set any aside.
+static int configure_threads()
+{
+	int core_count = thread_get_core_count();
+	if (core_count < 4)
+	{
+		return 0;
+	}
+	uint64_t all_cores = core_count >= 64 ? ~0ull : (1ull << core_count) - 1;
+	uint64_t render_core = 1ull << 1;
+	uint64_t net_recv_core = 1ull << 2;
+
+	thread_configure("render", render_core, k_thread_priority_high);
+	thread_configure("net recv", net_recv_core, k_thread_priority_high);
+	thread_configure("job worker", all_cores & ~(1ull | render_core | net_recv_core), k_thread_priority_normal);
+	return core_count - 3;
+}
+
 int main(int argc, const char* argv[])
 {
 	debug_set_print_mask(k_print_info | k_print_warning | k_print_error);
@@ -14,12 +43,40 @@ int main(int argc, const char* argv[])
 
 	timer_startup();
 
+	if (argc > 1 && strcmp(argv[1], "--benchmark") == 0)
+	{
+		benchmark_heap();
+		benchmark_queue();
+		benchmark_locks();
+		return 0;
+	}
+
+	if (argc > 1 && strcmp(argv[1], "--selftest") == 0)
+	{
+		return selftest_heap() ? 0 : 1;
+	}
+
+	thread_set_name(NULL, "main");
+
+	// Lock profiling is cheap enough for staging builds but stays opt-in.
+	bool profile_locks = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--profile-locks") == 0)
+		{
+			profile_locks = true;
+		}
+	}
+	mutex_profile_set_enabled(profile_locks);
+	int worker_count = configure_threads();
+
 	heap_t* heap = heap_create(2 * 1024 * 1024);
-	fs_t* fs = fs_create(heap, 8);
+	job_system_t* jobs = job_system_create(heap, worker_count);
+	fs_t* fs = fs_create(heap, 8, jobs);
 	wm_window_t* window = wm_create(heap);
 	render_t* render = render_create(heap, window);
 
-	final_game_t* game = final_game_create(heap, fs, window, render, 16.0f/9.0f, 8.0f);
+	final_game_t* game = final_game_create(heap, fs, jobs, window, render, 16.0f/9.0f, 8.0f);
 
 	while (!wm_pump(window))
 	{
@@ -33,6 +90,19 @@ int main(int argc, const char* argv[])
 
 	wm_destroy(window);
 	fs_destroy(fs);
+	job_system_destroy(jobs);
+
+	if (profile_locks)
+	{
+		mutex_profile_report();
+	}
+
+	// Peak usage is the number to size the grow increment against.
+	heap_stats_t stats;
+	heap_get_stats(heap, &stats, true);
+	debug_print(k_print_info, "Heap: peak %zu bytes allocated, %zu bytes committed in %d arenas, fragmentation %.2f\n",
+		stats.peak_bytes_allocated, stats.bytes_committed, stats.arena_count, stats.fragmentation);
+
 	heap_destroy(heap);
 
 	return 0;
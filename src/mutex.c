@@ -1,24 +1,390 @@
 #include "mutex.h"
 
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
+#include "atomic.h"
+#include "debug.h"
+#include "futex.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum
+{
+	k_mutex_unlocked,
+	k_mutex_locked,
+	k_mutex_contended,
+};
+
+enum
+{
+	// Upper bound on spinning before a blocked lock parks.
+	k_mutex_max_spin = 1000,
+
+	// One bucket per power of two ticks.
+	k_mutex_histogram_buckets = 64,
+
+	// Hold times are taken from one outermost lock in this many, so an
+	// uncontended lock of a profiled mutex mostly costs no timer reads.
+	k_mutex_hold_sample = 8,
+};
+
+// Contention bookkeeping of a named mutex.
+// Written only by the thread holding the mutex.
+typedef struct mutex_profile_t
+{
+	const char* name;
+	int64_t lock_count;
+	int64_t contended_count;
+	uint32_t wait_histogram[k_mutex_histogram_buckets];
+	uint32_t hold_histogram[k_mutex_histogram_buckets];
+	uint64_t wait_max;
+	uint64_t hold_max;
+
+	// Start of the current hold, or zero if this lock is not sampled.
+	uint64_t hold_start;
+
+	// Wait of the current lock, reported once it is released so the
+	// contention function never runs with the mutex held.
+	bool wait_pending;
+	uint64_t wait_start;
+	uint64_t wait_end;
+
+	// Link on the list of live named mutexes.
+	struct mutex_profile_t* prev;
+	struct mutex_profile_t* next;
+} mutex_profile_t;
+
+// Three-state futex mutex: unlocked, locked, and locked with threads
+// parked. Only the contended state costs the unlocker a wake, so an
+// uncontended lock and unlock are one atomic each.
+typedef struct mutex_t
+{
+	int state;
+
+	// Thread holding the lock, for recursion. Only the owner writes it.
+	int owner;
+	int recursion;
+
+	// Running average of spins a blocked lock needed, adjusted under the lock.
+	int spin_estimate;
+
+	// Non-NULL for named mutexes; allocated along with the mutex.
+	mutex_profile_t* profile;
+} mutex_t;
+
+static bool s_mutex_profile_enabled;
+static mutex_contention_function_t s_mutex_contention_function;
+static void* s_mutex_contention_user;
+
+// Live named mutexes. A mutex cannot guard its own registry, so a spin
+// lock does; it is only taken on create, destroy and report.
+static int s_mutex_profile_lock;
+static mutex_profile_t* s_mutex_profiles;
+
+static void mutex_profile_list_lock()
+{
+	while (atomic_compare_and_exchange(&s_mutex_profile_lock, 0, 1) != 0)
+	{
+		atomic_pause();
+	}
+}
+
+static void mutex_profile_list_unlock()
+{
+	atomic_store(&s_mutex_profile_lock, 0);
+}
+
+static void mutex_init(mutex_t* mutex)
+{
+	mutex->state = k_mutex_unlocked;
+	mutex->owner = 0;
+	mutex->recursion = 0;
+	mutex->spin_estimate = 0;
+	mutex->profile = NULL;
+}
 
 mutex_t* mutex_create()
 {
-	return (mutex_t*)CreateMutex(NULL, FALSE, NULL);
+	mutex_t* mutex = malloc(sizeof(mutex_t));
+	mutex_init(mutex);
+	return mutex;
+}
+
+mutex_t* mutex_create_named(const char* name)
+{
+	mutex_t* mutex = malloc(sizeof(mutex_t) + sizeof(mutex_profile_t));
+	mutex_init(mutex);
+
+	mutex_profile_t* profile = (mutex_profile_t*)(mutex + 1);
+	memset(profile, 0, sizeof(*profile));
+	profile->name = name;
+
+	mutex_profile_list_lock();
+	profile->next = s_mutex_profiles;
+	if (s_mutex_profiles)
+	{
+		s_mutex_profiles->prev = profile;
+	}
+	s_mutex_profiles = profile;
+	mutex_profile_list_unlock();
+
+	mutex->profile = profile;
+	return mutex;
 }
 
 void mutex_destroy(mutex_t* mutex)
 {
-	CloseHandle(mutex);
+	mutex_profile_t* profile = mutex->profile;
+	if (profile)
+	{
+		mutex_profile_list_lock();
+		if (profile->prev)
+		{
+			profile->prev->next = profile->next;
+		}
+		else
+		{
+			s_mutex_profiles = profile->next;
+		}
+		if (profile->next)
+		{
+			profile->next->prev = profile->prev;
+		}
+		mutex_profile_list_unlock();
+	}
+	free(mutex);
+}
+
+static int mutex_histogram_bucket(uint64_t ticks)
+{
+	int bucket = 0;
+	while (ticks && bucket < k_mutex_histogram_buckets - 1)
+	{
+		ticks >>= 1;
+		++bucket;
+	}
+	return bucket;
+}
+
+static void mutex_profile_wait(mutex_profile_t* profile, uint64_t start, uint64_t end)
+{
+	uint64_t ticks = end - start;
+	profile->contended_count++;
+	profile->wait_histogram[mutex_histogram_bucket(ticks)]++;
+	if (ticks > profile->wait_max)
+	{
+		profile->wait_max = ticks;
+	}
+	profile->wait_pending = true;
+	profile->wait_start = start;
+	profile->wait_end = end;
+}
+
+static void mutex_profile_hold_begin(mutex_profile_t* profile)
+{
+	profile->hold_start = (profile->lock_count++ % k_mutex_hold_sample) == 0 ? timer_get_ticks() : 0;
+}
+
+static void mutex_profile_hold_end(mutex_profile_t* profile)
+{
+	uint64_t ticks = timer_get_ticks() - profile->hold_start;
+	profile->hold_start = 0;
+	profile->hold_histogram[mutex_histogram_bucket(ticks)]++;
+	if (ticks > profile->hold_max)
+	{
+		profile->hold_max = ticks;
+	}
+}
+
+static void mutex_lock_slow(mutex_t* mutex)
+{
+	// Spin a little longer than the lock has recently taken to come free,
+	// then park.
+	int spin_limit = mutex->spin_estimate * 2 + 10;
+	if (spin_limit > k_mutex_max_spin)
+	{
+		spin_limit = k_mutex_max_spin;
+	}
+	for (int spin = 0; spin < spin_limit; ++spin)
+	{
+		if (atomic_load(&mutex->state) == k_mutex_unlocked &&
+			atomic_compare_and_exchange(&mutex->state, k_mutex_unlocked, k_mutex_locked) == k_mutex_unlocked)
+		{
+			mutex->spin_estimate += (spin - mutex->spin_estimate) / 8;
+			return;
+		}
+		atomic_pause();
+	}
+
+	// A thread that has parked takes the lock as contended, since it
+	// cannot know whether others are still parked behind it.
+	while (atomic_exchange(&mutex->state, k_mutex_contended) != k_mutex_unlocked)
+	{
+		futex_wait(&mutex->state, k_mutex_contended);
+	}
+	mutex->spin_estimate += (spin_limit - mutex->spin_estimate) / 8;
 }
 
 void mutex_lock(mutex_t* mutex)
 {
-	WaitForSingleObject(mutex, INFINITE);
+	int self = (int)thread_get_id();
+	if (atomic_load(&mutex->owner) == self)
+	{
+		mutex->recursion++;
+		return;
+	}
+
+	mutex_profile_t* profile = s_mutex_profile_enabled ? mutex->profile : NULL;
+	if (atomic_compare_and_exchange(&mutex->state, k_mutex_unlocked, k_mutex_locked) != k_mutex_unlocked)
+	{
+		uint64_t wait_start = profile ? timer_get_ticks() : 0;
+		mutex_lock_slow(mutex);
+		if (profile)
+		{
+			mutex_profile_wait(profile, wait_start, timer_get_ticks());
+		}
+	}
+	atomic_store(&mutex->owner, self);
+	mutex->recursion = 1;
+	if (profile)
+	{
+		mutex_profile_hold_begin(profile);
+	}
 }
 
 void mutex_unlock(mutex_t* mutex)
 {
-	ReleaseMutex(mutex);
+	if (--mutex->recursion > 0)
+	{
+		return;
+	}
+
+	// The profile belongs to whoever holds the lock, so copy out what the
+	// contention function needs before releasing it.
+	mutex_profile_t* profile = mutex->profile;
+	const char* name = NULL;
+	bool wait_pending = false;
+	uint64_t wait_start = 0;
+	uint64_t wait_end = 0;
+	if (profile)
+	{
+		if (profile->hold_start)
+		{
+			mutex_profile_hold_end(profile);
+		}
+		name = profile->name;
+		wait_pending = profile->wait_pending;
+		wait_start = profile->wait_start;
+		wait_end = profile->wait_end;
+		profile->wait_pending = false;
+	}
+
+	atomic_store(&mutex->owner, 0);
+	if (atomic_exchange(&mutex->state, k_mutex_unlocked) == k_mutex_contended)
+	{
+		futex_wake(&mutex->state, 1);
+	}
+
+	mutex_contention_function_t function = s_mutex_contention_function;
+	if (wait_pending && function)
+	{
+		function(name, wait_start, wait_end, s_mutex_contention_user);
+	}
+}
+
+void mutex_profile_set_enabled(bool enabled)
+{
+	s_mutex_profile_enabled = enabled;
+}
+
+void mutex_profile_set_contention_function(mutex_contention_function_t function, void* user)
+{
+	// Unlocking threads read the function first, so the user data must be
+	// in place before a new function is.
+	if (function)
+	{
+		s_mutex_contention_user = user;
+	}
+	s_mutex_contention_function = function;
+}
+
+static uint64_t mutex_ticks_to_ns(uint64_t ticks)
+{
+	uint64_t frequency = timer_get_ticks_per_second();
+	return (ticks / frequency) * 1000000000ull + (ticks % frequency) * 1000000000ull / frequency;
+}
+
+// Upper bound of the bucket holding the given percentile, in nanoseconds.
+static uint64_t mutex_histogram_percentile(const uint32_t* histogram, uint64_t max, int percent)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < k_mutex_histogram_buckets; ++i)
+	{
+		total += histogram[i];
+	}
+	if (total == 0)
+	{
+		return 0;
+	}
+
+	uint64_t target = (total * percent + 99) / 100;
+	uint64_t seen = 0;
+	for (int i = 0; i < k_mutex_histogram_buckets; ++i)
+	{
+		seen += histogram[i];
+		if (seen >= target)
+		{
+			uint64_t upper = i == 0 ? 0 : (1ull << i) - 1;
+			return mutex_ticks_to_ns(upper < max ? upper : max);
+		}
+	}
+	return mutex_ticks_to_ns(max);
+}
+
+bool mutex_get_stats(mutex_t* mutex, mutex_stats_t* stats)
+{
+	mutex_profile_t* profile = mutex->profile;
+	if (!profile)
+	{
+		memset(stats, 0, sizeof(*stats));
+		return false;
+	}
+
+	stats->name = profile->name;
+	stats->lock_count = profile->lock_count;
+	stats->contended_count = profile->contended_count;
+	stats->wait_p50_ns = mutex_histogram_percentile(profile->wait_histogram, profile->wait_max, 50);
+	stats->wait_p90_ns = mutex_histogram_percentile(profile->wait_histogram, profile->wait_max, 90);
+	stats->wait_p99_ns = mutex_histogram_percentile(profile->wait_histogram, profile->wait_max, 99);
+	stats->wait_max_ns = mutex_ticks_to_ns(profile->wait_max);
+	stats->hold_p50_ns = mutex_histogram_percentile(profile->hold_histogram, profile->hold_max, 50);
+	stats->hold_p90_ns = mutex_histogram_percentile(profile->hold_histogram, profile->hold_max, 90);
+	stats->hold_p99_ns = mutex_histogram_percentile(profile->hold_histogram, profile->hold_max, 99);
+	stats->hold_max_ns = mutex_ticks_to_ns(profile->hold_max);
+	return true;
+}
+
+void mutex_profile_report()
+{
+	mutex_profile_list_lock();
+	for (mutex_profile_t* profile = s_mutex_profiles; profile; profile = profile->next)
+	{
+		if (profile->lock_count == 0)
+		{
+			continue;
+		}
+		mutex_stats_t stats;
+		mutex_get_stats((mutex_t*)profile - 1, &stats);
+		debug_print(k_print_info,
+			"Mutex %s: %lld locks, %lld contended; wait p50 %llu ns, p90 %llu ns, p99 %llu ns, max %llu ns; "
+			"hold p50 %llu ns, p90 %llu ns, p99 %llu ns, max %llu ns\n",
+			stats.name, (long long)stats.lock_count, (long long)stats.contended_count,
+			(unsigned long long)stats.wait_p50_ns, (unsigned long long)stats.wait_p90_ns,
+			(unsigned long long)stats.wait_p99_ns, (unsigned long long)stats.wait_max_ns,
+			(unsigned long long)stats.hold_p50_ns, (unsigned long long)stats.hold_p90_ns,
+			(unsigned long long)stats.hold_p99_ns, (unsigned long long)stats.hold_max_ns);
+	}
+	mutex_profile_list_unlock();
 }
@@ -1,13 +1,50 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
 // Recursive mutex thread synchronization
+//
+// Mutexes created with a name can be profiled. While profiling is enabled
+// each named mutex records how often it was contended, how long contended
+// locks waited and how long the lock was held. Unnamed mutexes, and named
+// ones while profiling is off, pay only a branch.
 
 // Handle to a mutex.
 typedef struct mutex_t mutex_t;
 
+// Contention profile of a named mutex. See mutex_get_stats().
+// Percentiles come from power-of-two histograms, so they are accurate to
+// within a factor of two; maximums are exact.
+typedef struct mutex_stats_t
+{
+	const char* name;
+	// Outermost locks taken while profiling, and how many had to wait.
+	int64_t lock_count;
+	int64_t contended_count;
+	// Time contended locks spent waiting, in nanoseconds.
+	uint64_t wait_p50_ns;
+	uint64_t wait_p90_ns;
+	uint64_t wait_p99_ns;
+	uint64_t wait_max_ns;
+	// Time the lock was held, in nanoseconds, from a sample of locks.
+	uint64_t hold_p50_ns;
+	uint64_t hold_p90_ns;
+	uint64_t hold_p99_ns;
+	uint64_t hold_max_ns;
+} mutex_stats_t;
+
+// Called after a contended lock has been released, with the ticks at
+// which the wait began and ended. See timer_get_ticks().
+typedef void (*mutex_contention_function_t)(const char* name, uint64_t start_ticks, uint64_t end_ticks, void* user);
+
 // Creates a new mutex.
 mutex_t* mutex_create();
 
+// Creates a new mutex that is profiled under name.
+// The name is not copied and must outlive the mutex.
+mutex_t* mutex_create_named(const char* name);
+
 // Destroys a previously created mutex.
 void mutex_destroy(mutex_t* mutex);
 
@@ -18,3 +55,21 @@ void mutex_lock(mutex_t* mutex);
 
 // Unlocks a mutex.
 void mutex_unlock(mutex_t* mutex);
+
+// Turns contention profiling of named mutexes on or off. Off by default.
+void mutex_profile_set_enabled(bool enabled);
+
+// Sets a function to be told about every contended lock of a named mutex
+// while profiling is enabled. Pass NULL to stop.
+// The function runs right after the mutex is released, so it may be called
+// from inside any code that uses a named mutex, including code that holds
+// other locks on the same thread. It should only record the event.
+void mutex_profile_set_contention_function(mutex_contention_function_t function, void* user);
+
+// Gets the contention profile of a mutex.
+// Returns false if the mutex was not created with a name.
+// Approximate while other threads are using the mutex.
+bool mutex_get_stats(mutex_t* mutex, mutex_stats_t* stats);
+
+// Logs the contention profile of every live named mutex that has been locked.
+void mutex_profile_report();
@@ -2,8 +2,11 @@
 
 #include "debug.h"
 #include "heap.h"
-#include "mutex.h"
-#include "queue.h"
+#include "job.h"
+#include "object_pool.h"
+#include "rwlock.h"
+#include "seqlock.h"
+#include "spsc_queue.h"
 #include "thread.h"
 #include "timer.h"
 
@@ -22,6 +25,7 @@ enum
 	k_max_entity_types = 32,
 	k_max_snapshots = 256,
 	k_max_entities = 32,
+	k_packet_pool_chunk = 64,
 };
 
 typedef struct entity_type_t
@@ -66,6 +70,14 @@ typedef struct entity_packet_header_t
 	int sequence;
 } entity_packet_header_t;
 
+// Receive bookkeeping, written only by the receive thread.
+typedef struct connection_recv_stats_t
+{
+	uint32_t last_recv_ms;
+	int packet_count;
+	int64_t byte_count;
+} connection_recv_stats_t;
+
 typedef struct connection_t
 {
 	net_t* net;
@@ -77,10 +89,11 @@ typedef struct connection_t
 
 	thread_t* send_thread;
 
-	queue_t* send_queue;
-	queue_t* recv_queue;
+	spsc_queue_t* send_queue;
+	spsc_queue_t* recv_queue;
 
-	uint32_t last_recv_ms;
+	seqlock_t* recv_stats_lock;
+	connection_recv_stats_t recv_stats;
 
 	entity_data_t entities[k_max_entities];
 } connection_t;
@@ -89,13 +102,20 @@ typedef struct net_t
 {
 	heap_t* heap;
 	ecs_t* ecs;
+	object_pool_t* packet_pool;
+
+	// Each connection's packet is encoded as a job.
+	job_system_t* jobs;
+	job_counter_t* send_counter;
 
 	int sequence;
 
 	SOCKET sock;
 	thread_t* recv_thread;
 
-	mutex_t* connections_mutex;
+	// The receive thread looks connections up for every packet; they are
+	// only added and removed now and then.
+	rwlock_t* connections_lock;
 	connection_t connections[3];
 
 	entity_type_t entity_types[k_max_entity_types];
@@ -104,25 +124,31 @@ typedef struct net_t
 } net_t;
 
 static int recv_thread_func(void* user);
+static connection_t* find_connection(net_t* net, const net_address_t* address);
 static connection_t* find_or_create_connection(net_t* net, const net_address_t* address);
+static void connection_destroy(connection_t* connection);
 
 static void timeout_old_connections(net_t* net);
 static void snapshot_entities(net_t* net);
 static void packet_send(connection_t* connection);
+static void packet_send_job_func(void* user);
 static void packet_recv(connection_t* connection);
 
-net_t* net_create(heap_t* heap, ecs_t* ecs)
+net_t* net_create(heap_t* heap, ecs_t* ecs, job_system_t* jobs)
 {
-	net_t* net = heap_alloc(heap, sizeof(net_t), 8);
+	net_t* net = heap_alloc_tagged(heap, sizeof(net_t), 8, k_heap_tag_net);
 	memset(net, 0, sizeof(net_t));
 	net->heap = heap;
 	net->ecs = ecs;
+	net->packet_pool = object_pool_create(heap, sizeof(packet_t), 8, k_packet_pool_chunk, k_heap_tag_net);
+	net->jobs = jobs;
+	net->send_counter = jobs ? job_counter_create(jobs) : NULL;
 
 	WSADATA data;
 	WSAStartup(MAKEWORD(2, 2), &data);
 
 	net->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	net->connections_mutex = mutex_create();
+	net->connections_lock = rwlock_create();
 
 	struct sockaddr_in address;
 	address.sin_family = AF_INET;
@@ -135,6 +161,7 @@ net_t* net_create(heap_t* heap, ecs_t* ecs)
 	debug_print(k_print_info, "Net bound port %d\n", ntohs(address.sin_port));
 
 	net->recv_thread = thread_create(recv_thread_func, net);
+	thread_set_name(net->recv_thread, "net recv");
 
 	return net;
 }
@@ -145,7 +172,12 @@ void net_destroy(net_t* net)
 	closesocket(net->sock);
 	thread_destroy(net->recv_thread);
 	WSACleanup();
-	mutex_destroy(net->connections_mutex);
+	rwlock_destroy(net->connections_lock);
+	if (net->send_counter)
+	{
+		job_counter_destroy(net->send_counter);
+	}
+	object_pool_destroy(net->packet_pool);
 	heap_free(net->heap, net);
 }
 
@@ -153,41 +185,66 @@ void net_update(net_t* net)
 {
 	timeout_old_connections(net);
 	snapshot_entities(net);
+
+	rwlock_lock_read(net->connections_lock);
+
+	// Encoding only reads the snapshots and the connection, so connections
+	// can be encoded in parallel. Each send queue still has a single
+	// producer at a time: the wait orders this frame's push before the next.
+	for (int i = 0; i < _countof(net->connections); ++i)
+	{
+		connection_t* c = &net->connections[i];
+		if (c->address.port)
+		{
+			if (net->jobs)
+			{
+				job_submit(net->jobs, packet_send_job_func, c, net->send_counter);
+			}
+			else
+			{
+				packet_send(c);
+			}
+		}
+	}
+	if (net->jobs)
+	{
+		job_wait(net->send_counter);
+	}
+
 	for (int i = 0; i < _countof(net->connections); ++i)
 	{
 		connection_t* c = &net->connections[i];
 		if (c->address.port)
 		{
-			packet_send(c);
 			packet_recv(c);
 		}
 	}
+
+	rwlock_unlock_read(net->connections_lock);
 	net->sequence++;
 }
 
 void net_connect(net_t* net, const net_address_t* address)
 {
+	rwlock_lock_write(net->connections_lock);
 	find_or_create_connection(net, address);
+	rwlock_unlock_write(net->connections_lock);
 }
 
 void net_disconnect_all(net_t* net)
 {
-	mutex_lock(net->connections_mutex);
+	rwlock_lock_write(net->connections_lock);
 
 	for (int i = 0; i < _countof(net->connections); ++i)
 	{
 		connection_t* c = &net->connections[i];
 		if (c->address.port)
 		{
-			queue_push(c->send_queue, NULL);
-			thread_destroy(c->send_thread);
-			queue_destroy(c->send_queue);
-			queue_destroy(c->recv_queue);
+			connection_destroy(c);
 		}
 	}
-	memset(net->connections, 0, sizeof(net->connections));
 
-	mutex_unlock(net->connections_mutex);
+	rwlock_unlock_write(net->connections_lock);
 }
 
 void net_state_register_entity_type(net_t* net, int type, uint64_t component_mask, uint64_t replicated_component_mask, net_configure_entity_callback_t configure_callback, void* configure_callback_data)
@@ -283,7 +340,7 @@ static int send_thread_func(void* user)
 
 	while (true)
 	{
-		packet_t* packet = queue_pop(connection->send_queue);
+		packet_t* packet = spsc_queue_pop(connection->send_queue);
 		if (!packet)
 		{
 			break;
@@ -293,7 +350,7 @@ static int send_thread_func(void* user)
 			packet->data, packet->size, 0,
 			(struct sockaddr*)&address, sizeof(address));
 
-		heap_free(connection->net->heap, packet);
+		object_pool_free(connection->net->packet_pool, packet);
 
 		if (bytes <= 0)
 		{
@@ -304,21 +361,24 @@ static int send_thread_func(void* user)
 	return 0;
 }
 
-static connection_t* find_or_create_connection(net_t* net, const net_address_t* address)
+// Requires connections_lock held for reading or writing.
+static connection_t* find_connection(net_t* net, const net_address_t* address)
 {
-	connection_t* result = NULL;
-
-	mutex_lock(net->connections_mutex);
-
 	for (int i = 0; i < _countof(net->connections); ++i)
 	{
 		connection_t* c = &net->connections[i];
 		if (memcmp(&c->address, address, sizeof(net_address_t)) == 0)
 		{
-			result = c;
-			break;
+			return c;
 		}
 	}
+	return NULL;
+}
+
+// Requires connections_lock held for writing.
+static connection_t* find_or_create_connection(net_t* net, const net_address_t* address)
+{
+	connection_t* result = find_connection(net, address);
 	if (!result)
 	{
 		for (int i = 0; i < _countof(net->connections); ++i)
@@ -330,20 +390,60 @@ static connection_t* find_or_create_connection(net_t* net, const net_address_t*
 				c->net = net;
 				c->incoming_sequence = -1;
 				c->ack_sequence = -1;
-				c->last_recv_ms = timer_ticks_to_ms(timer_get_ticks());
-				c->send_queue = queue_create(net->heap, 3);
-				c->recv_queue = queue_create(net->heap, 3);
+				c->recv_stats_lock = seqlock_create();
+				c->recv_stats = (connection_recv_stats_t) { .last_recv_ms = timer_ticks_to_ms(timer_get_ticks()) };
+				c->send_queue = spsc_queue_create(net->heap, 3);
+				c->recv_queue = spsc_queue_create(net->heap, 3);
 				c->send_thread = thread_create(send_thread_func, c);
+				thread_set_name(c->send_thread, "net send");
 
 				result = c;
 				break;
 			}
 		}
 	}
+	return result;
+}
 
-	mutex_unlock(net->connections_mutex);
+// Requires connections_lock held for writing.
+static void connection_destroy(connection_t* connection)
+{
+	spsc_queue_push(connection->send_queue, NULL);
+	thread_destroy(connection->send_thread);
+	spsc_queue_destroy(connection->send_queue);
+	spsc_queue_destroy(connection->recv_queue);
+	seqlock_destroy(connection->recv_stats_lock);
+	memset(connection, 0, sizeof(*connection));
+}
 
-	return result;
+// Hands a received packet to its connection.
+// Requires connections_lock held for reading or writing.
+static void connection_receive(connection_t* connection, packet_t* packet)
+{
+	net_t* net = connection->net;
+
+	seqlock_write_begin(connection->recv_stats_lock);
+	connection->recv_stats.last_recv_ms = timer_ticks_to_ms(timer_get_ticks());
+	connection->recv_stats.packet_count++;
+	connection->recv_stats.byte_count += packet->size;
+	seqlock_write_end(connection->recv_stats_lock);
+
+	if (!spsc_queue_try_push(connection->recv_queue, packet))
+	{
+		object_pool_free(net->packet_pool, packet);
+	}
+}
+
+static connection_recv_stats_t connection_get_recv_stats(connection_t* connection)
+{
+	connection_recv_stats_t stats;
+	int sequence;
+	do
+	{
+		sequence = seqlock_read_begin(connection->recv_stats_lock);
+		stats = connection->recv_stats;
+	} while (seqlock_read_retry(connection->recv_stats_lock, sequence));
+	return stats;
 }
 
 static int recv_thread_func(void* user)
@@ -352,7 +452,7 @@ static int recv_thread_func(void* user)
 
 	while (true)
 	{
-		packet_t* packet = heap_alloc(net->heap, sizeof(packet_t), 8);
+		packet_t* packet = object_pool_alloc(net->packet_pool);
 
 		struct sockaddr_in address;
 		int address_len = sizeof(address);
@@ -361,7 +461,7 @@ static int recv_thread_func(void* user)
 			(struct sockaddr*)&address, &address_len);
 		if (bytes <= 0)
 		{
-			heap_free(net->heap, packet);
+			object_pool_free(net->packet_pool, packet);
 			break;
 		}
 
@@ -374,42 +474,73 @@ static int recv_thread_func(void* user)
 		net_addr.ip[2] = address.sin_addr.S_un.S_un_b.s_b3;
 		net_addr.ip[3] = address.sin_addr.S_un.S_un_b.s_b4;
 
-		connection_t* connection = find_or_create_connection(net, &net_addr);
+		// Almost every packet is for a known connection, so look under the
+		// read lock and only take the write lock to add one.
+		rwlock_lock_read(net->connections_lock);
+		connection_t* connection = find_connection(net, &net_addr);
+		if (connection)
+		{
+			connection_receive(connection, packet);
+		}
+		rwlock_unlock_read(net->connections_lock);
+
 		if (!connection)
 		{
-			debug_print(k_print_info, "Too many connections!\n");
-			heap_free(net->heap, packet);
-			continue;
+			rwlock_lock_write(net->connections_lock);
+			connection = find_or_create_connection(net, &net_addr);
+			if (connection)
+			{
+				connection_receive(connection, packet);
+			}
+			rwlock_unlock_write(net->connections_lock);
 		}
-		connection->last_recv_ms = timer_ticks_to_ms(timer_get_ticks());
 
-		queue_try_push(connection->recv_queue, packet);
+		if (!connection)
+		{
+			debug_print(k_print_info, "Too many connections!\n");
+			object_pool_free(net->packet_pool, packet);
+		}
 	}
 
 	return 0;
 }
 
-static void timeout_old_connections(net_t* net)
+static bool connection_timed_out(connection_t* connection, uint32_t now)
 {
-	mutex_lock(net->connections_mutex);
+	return connection->address.port && connection_get_recv_stats(connection).last_recv_ms + k_timeout_ms < now;
+}
 
+static void timeout_old_connections(net_t* net)
+{
+	// Check under the read lock so the receive thread keeps going; only
+	// take the write lock when there is something to remove.
 	uint32_t now = timer_ticks_to_ms(timer_get_ticks());
+	bool any_timed_out = false;
+	rwlock_lock_read(net->connections_lock);
+	for (int i = 0; i < _countof(net->connections); ++i)
+	{
+		any_timed_out |= connection_timed_out(&net->connections[i], now);
+	}
+	rwlock_unlock_read(net->connections_lock);
+
+	if (!any_timed_out)
+	{
+		return;
+	}
+
+	rwlock_lock_write(net->connections_lock);
 	for (int i = 0; i < _countof(net->connections); ++i)
 	{
 		connection_t* c = &net->connections[i];
-		if (c->address.port && c->last_recv_ms + k_timeout_ms < now)
+		if (connection_timed_out(c, now))
 		{
-			debug_print(k_print_info, "Disconnecting old connection.\n");
-
-			queue_push(c->send_queue, NULL);
-			thread_destroy(c->send_thread);
-			queue_destroy(c->send_queue);
-			queue_destroy(c->recv_queue);
-			memset(c, 0, sizeof(*c));
+			connection_recv_stats_t stats = connection_get_recv_stats(c);
+			debug_print(k_print_info, "Disconnecting old connection after %d packets, %lld bytes.\n",
+				stats.packet_count, (long long)stats.byte_count);
+			connection_destroy(c);
 		}
 	}
-
-	mutex_unlock(net->connections_mutex);
+	rwlock_unlock_write(net->connections_lock);
 }
 
 static void snapshot_entities(net_t* net)
@@ -507,7 +638,7 @@ static void packet_send(connection_t* connection)
 {
 	net_t* net = connection->net;
 
-	packet_t* packet = heap_alloc(net->heap, sizeof(packet_t), 8);
+	packet_t* packet = object_pool_alloc(net->packet_pool);
 
 	packet_header_t header =
 	{
@@ -519,7 +650,12 @@ static void packet_send(connection_t* connection)
 	packet->size = sizeof(header);
 	packet->size += (int)packet_add_entities(connection, &packet->data[packet->size], sizeof(packet->data) - packet->size);
 
-	queue_push(connection->send_queue, packet);
+	spsc_queue_push(connection->send_queue, packet);
+}
+
+static void packet_send_job_func(void* user)
+{
+	packet_send(user);
 }
 
 static void packet_read_entities(connection_t* connection, char* packet, size_t packet_size)
@@ -600,7 +736,7 @@ static void packet_recv(connection_t* connection)
 
 	while (true)
 	{
-		packet_t* packet = queue_try_pop(connection->recv_queue);
+		packet_t* packet = spsc_queue_try_pop(connection->recv_queue);
 		if (!packet || !packet->size)
 		{
 			break;
@@ -610,6 +746,7 @@ static void packet_recv(connection_t* connection)
 		memcpy(&header, packet->data, sizeof(header));
 		if (header.sequence <= connection->incoming_sequence)
 		{
+			object_pool_free(net->packet_pool, packet);
 			continue;
 		}
 
@@ -618,6 +755,6 @@ static void packet_recv(connection_t* connection)
 
 		packet_read_entities(connection, &packet->data[sizeof(header)], packet->size - sizeof(header));
 
-		heap_free(net->heap, packet);
+		object_pool_free(net->packet_pool, packet);
 	}
 }
@@ -0,0 +1,210 @@
+#include "object_pool.h"
+
+#include "atomic.h"
+#include "debug.h"
+#include "heap.h"
+#include "mutex.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The free list head packs the top object's address with a counter that
+// changes on every push, so a pop racing with pop/push of the same object
+// fails its compare and exchange instead of corrupting the list.
+#if INTPTR_MAX == INT64_MAX
+#define POOL_TAG_SHIFT 48
+#else
+#define POOL_TAG_SHIFT 32
+#endif
+
+typedef struct pool_chunk_t
+{
+	struct pool_chunk_t* next;
+} pool_chunk_t;
+
+typedef struct pool_object_t
+{
+	struct pool_object_t* next;
+} pool_object_t;
+
+typedef struct object_pool_t
+{
+	heap_t* heap;
+	heap_tag_t tag;
+	mutex_t* mutex;
+	size_t object_size;
+	size_t alignment;
+	size_t chunk_header_size;
+	int chunk_capacity;
+	int64_t free_head;
+	pool_chunk_t* chunks;
+	int chunk_count;
+	int live;
+	int peak;
+	int alloc_count;
+} object_pool_t;
+
+static pool_object_t* free_head_object(int64_t head)
+{
+	return (pool_object_t*)(uintptr_t)((uint64_t)head & ((1ULL << POOL_TAG_SHIFT) - 1));
+}
+
+static int64_t free_head_make(pool_object_t* object, int64_t prev_head)
+{
+	uint64_t tag = ((uint64_t)prev_head >> POOL_TAG_SHIFT) + 1;
+	return (int64_t)((tag << POOL_TAG_SHIFT) | (uint64_t)(uintptr_t)object);
+}
+
+// Push a linked run of objects from first to last onto the free list.
+static void free_list_push(object_pool_t* pool, pool_object_t* first, pool_object_t* last)
+{
+	while (true)
+	{
+		int64_t head = atomic_load64(&pool->free_head);
+		last->next = free_head_object(head);
+		if (atomic_compare_and_exchange64(&pool->free_head, head, free_head_make(first, head)) == head)
+		{
+			return;
+		}
+	}
+}
+
+static pool_object_t* free_list_pop(object_pool_t* pool)
+{
+	while (true)
+	{
+		int64_t head = atomic_load64(&pool->free_head);
+		pool_object_t* object = free_head_object(head);
+		if (!object)
+		{
+			return NULL;
+		}
+		// Chunks are never freed while the pool lives, so reading next is
+		// safe even if another thread pops this object first.
+		pool_object_t* next = object->next;
+		if (atomic_compare_and_exchange64(&pool->free_head, head, free_head_make(next, head)) == head)
+		{
+			return object;
+		}
+	}
+}
+
+object_pool_t* object_pool_create(heap_t* heap, size_t object_size, size_t alignment, int capacity_hint, heap_tag_t tag)
+{
+	alignment = __max(alignment, _Alignof(pool_object_t));
+
+	object_pool_t* pool = heap_alloc_tagged(heap, sizeof(object_pool_t), 8, tag);
+	pool->heap = heap;
+	pool->tag = tag;
+	pool->mutex = mutex_create_named("object pool");
+	pool->object_size = (__max(object_size, sizeof(pool_object_t)) + (alignment - 1)) & ~(alignment - 1);
+	pool->alignment = alignment;
+	pool->chunk_header_size = (sizeof(pool_chunk_t) + (alignment - 1)) & ~(alignment - 1);
+	pool->chunk_capacity = __max(capacity_hint, 1);
+	pool->free_head = 0;
+	pool->chunks = NULL;
+	pool->chunk_count = 0;
+	pool->live = 0;
+	pool->peak = 0;
+	pool->alloc_count = 0;
+	return pool;
+}
+
+void object_pool_destroy(object_pool_t* pool)
+{
+	debug_print(k_print_info, "Object pool (%zu bytes): peak %d of %d objects in %d chunks, %d allocations.\n",
+		pool->object_size, pool->peak, pool->chunk_count * pool->chunk_capacity, pool->chunk_count, pool->alloc_count);
+	if (pool->live)
+	{
+		debug_print(k_print_warning, "Object pool destroyed with %d live objects.\n", pool->live);
+	}
+
+	pool_chunk_t* chunk = pool->chunks;
+	while (chunk)
+	{
+		pool_chunk_t* next = chunk->next;
+		heap_free(pool->heap, chunk);
+		chunk = next;
+	}
+	mutex_destroy(pool->mutex);
+	heap_free(pool->heap, pool);
+}
+
+// Allocate a new chunk and put all of its objects on the free list.
+// Returns false if the heap is out of memory.
+static bool object_pool_grow(object_pool_t* pool)
+{
+	bool result = true;
+	mutex_lock(pool->mutex);
+	if (!free_head_object(atomic_load64(&pool->free_head)))
+	{
+		pool_chunk_t* chunk = heap_alloc_tagged(pool->heap, pool->chunk_header_size + pool->object_size * pool->chunk_capacity, pool->alignment, pool->tag);
+		if (chunk)
+		{
+			chunk->next = pool->chunks;
+			pool->chunks = chunk;
+			pool->chunk_count++;
+
+			char* objects = (char*)chunk + pool->chunk_header_size;
+			for (int i = 0; i < pool->chunk_capacity - 1; ++i)
+			{
+				((pool_object_t*)(objects + i * pool->object_size))->next = (pool_object_t*)(objects + (i + 1) * pool->object_size);
+			}
+			free_list_push(pool, (pool_object_t*)objects, (pool_object_t*)(objects + (pool->chunk_capacity - 1) * pool->object_size));
+		}
+		else
+		{
+			result = false;
+		}
+	}
+	mutex_unlock(pool->mutex);
+	return result;
+}
+
+void* object_pool_alloc(object_pool_t* pool)
+{
+	pool_object_t* object = free_list_pop(pool);
+	while (!object)
+	{
+		if (!object_pool_grow(pool))
+		{
+			return NULL;
+		}
+		object = free_list_pop(pool);
+	}
+
+	atomic_increment(&pool->alloc_count);
+	int live = atomic_increment(&pool->live) + 1;
+	int peak = atomic_load(&pool->peak);
+	while (live > peak)
+	{
+		int old_peak = atomic_compare_and_exchange(&pool->peak, peak, live);
+		if (old_peak == peak)
+		{
+			break;
+		}
+		peak = old_peak;
+	}
+	return object;
+}
+
+void object_pool_free(object_pool_t* pool, void* object)
+{
+	if (object)
+	{
+		atomic_decrement(&pool->live);
+		free_list_push(pool, object, object);
+	}
+}
+
+void object_pool_get_stats(object_pool_t* pool, object_pool_stats_t* stats)
+{
+	mutex_lock(pool->mutex);
+	stats->object_size = pool->object_size;
+	stats->capacity = pool->chunk_count * pool->chunk_capacity;
+	stats->chunk_count = pool->chunk_count;
+	mutex_unlock(pool->mutex);
+	stats->live = atomic_load(&pool->live);
+	stats->peak = atomic_load(&pool->peak);
+	stats->alloc_count = atomic_load(&pool->alloc_count);
+}
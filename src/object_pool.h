@@ -0,0 +1,45 @@
+#pragma once
+
+#include "heap.h"
+
+#include <stddef.h>
+
+// Fixed-size object pool.
+//
+// Hands out objects of a single size from chunks allocated out of a
+// parent heap_t. Freed objects go on a lock-free free list and are reused
+// by later allocations. The pool grows one chunk at a time and only
+// returns memory to the heap when destroyed.
+
+// Handle to an object pool.
+typedef struct object_pool_t object_pool_t;
+
+// Occupancy of an object pool, for sizing pools.
+typedef struct object_pool_stats_t
+{
+	size_t object_size;
+	int capacity;
+	int live;
+	int peak;
+	int chunk_count;
+	int alloc_count;
+} object_pool_stats_t;
+
+// Create a pool of objects of object_size bytes with the given alignment.
+// Each chunk allocated from heap holds capacity_hint objects and is
+// charged to tag.
+object_pool_t* object_pool_create(heap_t* heap, size_t object_size, size_t alignment, int capacity_hint, heap_tag_t tag);
+
+// Destroy a pool and return all of its chunks to the heap.
+// Logs the pool's peak occupancy.
+void object_pool_destroy(object_pool_t* pool);
+
+// Allocate one object from the pool.
+// Safe for multiple threads to allocate and free at the same time.
+void* object_pool_alloc(object_pool_t* pool);
+
+// Return an object to the pool it was allocated from.
+void object_pool_free(object_pool_t* pool, void* object);
+
+// Get current occupancy statistics for the pool.
+void object_pool_get_stats(object_pool_t* pool, object_pool_stats_t* stats);
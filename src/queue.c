@@ -1,76 +1,266 @@
+#include "queue.h"
+
 #include "atomic.h"
 #include "heap.h"
 #include "semaphore.h"
 
+#include <limits.h>
+
+enum
+{
+	k_queue_cache_line_size = 64,
+
+	// Attempts made before a blocked push or pop goes to sleep.
+	k_queue_spin_count = 128,
+};
+
+// Each slot carries a sequence number saying whose turn it is: a producer
+// may fill it when sequence == position, a consumer may empty it when
+// sequence == position + 1.
+typedef struct queue_slot_t
+{
+	int sequence;
+	void* item;
+} queue_slot_t;
+
+// Bounded multi-producer multi-consumer ring (Vyukov).
+// Producers and consumers each claim runs of positions with one CAS, kept
+// on separate cache lines. Semaphores are only touched when a thread has to
+// sleep because the queue is full or empty.
 typedef struct queue_t
 {
 	heap_t* heap;
-	semaphore_t* used_items;
-	semaphore_t* free_items;
-	void** items;
-	int capacity;
-	int head_index;
+	queue_slot_t* slots;
+	int mask;
+	semaphore_t* not_empty;
+	semaphore_t* not_full;
+
+	char tail_padding[k_queue_cache_line_size];
 	int tail_index;
+	int push_waiters;
+	char head_padding[k_queue_cache_line_size];
+	int head_index;
+	int pop_waiters;
+	char end_padding[k_queue_cache_line_size];
 } queue_t;
 
+// Positions wrap around; differences are taken modulo 2^32.
+static int queue_distance(int a, int b)
+{
+	return (int)((unsigned int)a - (unsigned int)b);
+}
+
+static int queue_advance(int position, int count)
+{
+	return (int)((unsigned int)position + (unsigned int)count);
+}
+
 queue_t* queue_create(heap_t* heap, int capacity)
 {
+	int slot_count = 2;
+	while (slot_count < capacity)
+	{
+		slot_count *= 2;
+	}
+
 	queue_t* queue = heap_alloc(heap, sizeof(queue_t), 8);
-	queue->items = heap_alloc(heap, sizeof(void*) * capacity, 8);
-	queue->used_items = semaphore_create(0, capacity);
-	queue->free_items = semaphore_create(capacity, capacity);
+	queue->slots = heap_alloc(heap, sizeof(queue_slot_t) * slot_count, k_queue_cache_line_size);
+	for (int i = 0; i < slot_count; ++i)
+	{
+		queue->slots[i].sequence = i;
+		queue->slots[i].item = NULL;
+	}
+	queue->not_empty = semaphore_create(0, INT_MAX);
+	queue->not_full = semaphore_create(0, INT_MAX);
 	queue->heap = heap;
-	queue->capacity = capacity;
-	queue->head_index = 0;
+	queue->mask = slot_count - 1;
 	queue->tail_index = 0;
+	queue->push_waiters = 0;
+	queue->head_index = 0;
+	queue->pop_waiters = 0;
 	return queue;
 }
 
 void queue_destroy(queue_t* queue)
 {
-	semaphore_destroy(queue->used_items);
-	semaphore_destroy(queue->free_items);
-	heap_free(queue->heap, queue->items);
+	semaphore_destroy(queue->not_empty);
+	semaphore_destroy(queue->not_full);
+	heap_free(queue->heap, queue->slots);
 	heap_free(queue->heap, queue);
 }
 
+// Wakes up to count sleeping threads if any are registered.
+// The interlocked read orders the check after the slots were published, so
+// a thread that registered before the publish is always seen.
+static void queue_wake(int* waiters, semaphore_t* semaphore, int count)
+{
+	int waiting = atomic_compare_and_exchange(waiters, 0, 0);
+	for (int i = 0; i < waiting && i < count; ++i)
+	{
+		semaphore_release(semaphore);
+	}
+}
+
+// Claims as many consecutive free slots as are available, up to count,
+// with one CAS. Returns the number of items pushed.
+static int queue_push_some(queue_t* queue, void* const* items, int count)
+{
+	int position = atomic_load(&queue->tail_index);
+	for (;;)
+	{
+		int ready = 0;
+		while (ready < count &&
+			atomic_load(&queue->slots[queue_advance(position, ready) & queue->mask].sequence) == queue_advance(position, ready))
+		{
+			++ready;
+		}
+		if (ready == 0)
+		{
+			int difference = queue_distance(atomic_load(&queue->slots[position & queue->mask].sequence), position);
+			if (difference < 0)
+			{
+				return 0;
+			}
+			position = atomic_load(&queue->tail_index);
+			continue;
+		}
+
+		int old_position = atomic_compare_and_exchange(&queue->tail_index, position, queue_advance(position, ready));
+		if (old_position == position)
+		{
+			for (int i = 0; i < ready; ++i)
+			{
+				queue_slot_t* slot = &queue->slots[queue_advance(position, i) & queue->mask];
+				slot->item = items[i];
+				atomic_store(&slot->sequence, queue_advance(position, i + 1));
+			}
+			queue_wake(&queue->pop_waiters, queue->not_empty, ready);
+			return ready;
+		}
+		position = old_position;
+	}
+}
+
+// Claims as many consecutive full slots as are available, up to max,
+// with one CAS. Returns the number of items popped.
+static int queue_pop_some(queue_t* queue, void** items, int max)
+{
+	int position = atomic_load(&queue->head_index);
+	for (;;)
+	{
+		int ready = 0;
+		while (ready < max &&
+			atomic_load(&queue->slots[queue_advance(position, ready) & queue->mask].sequence) == queue_advance(position, ready + 1))
+		{
+			++ready;
+		}
+		if (ready == 0)
+		{
+			int difference = queue_distance(atomic_load(&queue->slots[position & queue->mask].sequence), queue_advance(position, 1));
+			if (difference < 0)
+			{
+				return 0;
+			}
+			position = atomic_load(&queue->head_index);
+			continue;
+		}
+
+		int old_position = atomic_compare_and_exchange(&queue->head_index, position, queue_advance(position, ready));
+		if (old_position == position)
+		{
+			for (int i = 0; i < ready; ++i)
+			{
+				queue_slot_t* slot = &queue->slots[queue_advance(position, i) & queue->mask];
+				items[i] = slot->item;
+				atomic_store(&slot->sequence, queue_advance(position, i + queue->mask + 1));
+			}
+			queue_wake(&queue->push_waiters, queue->not_full, ready);
+			return ready;
+		}
+		position = old_position;
+	}
+}
+
+void queue_push_n(queue_t* queue, void* const* items, int count)
+{
+	int pushed = 0;
+	int spin = 0;
+	while (pushed < count)
+	{
+		int some = queue_push_some(queue, items + pushed, count - pushed);
+		if (some)
+		{
+			pushed += some;
+			spin = 0;
+			continue;
+		}
+		if (spin++ < k_queue_spin_count)
+		{
+			atomic_pause();
+			continue;
+		}
+
+		// Register before the last attempt so a pop after it wakes us.
+		atomic_increment(&queue->push_waiters);
+		some = queue_push_some(queue, items + pushed, count - pushed);
+		if (!some)
+		{
+			semaphore_acquire(queue->not_full);
+		}
+		atomic_decrement(&queue->push_waiters);
+		pushed += some;
+	}
+}
+
+int queue_pop_n(queue_t* queue, void** items, int max)
+{
+	for (int spin = 0;; ++spin)
+	{
+		int some = queue_pop_some(queue, items, max);
+		if (some)
+		{
+			return some;
+		}
+		if (spin < k_queue_spin_count)
+		{
+			atomic_pause();
+			continue;
+		}
+
+		// Register before the last attempt so a push after it wakes us.
+		atomic_increment(&queue->pop_waiters);
+		some = queue_pop_some(queue, items, max);
+		if (!some)
+		{
+			semaphore_acquire(queue->not_empty);
+		}
+		atomic_decrement(&queue->pop_waiters);
+		if (some)
+		{
+			return some;
+		}
+	}
+}
+
 void queue_push(queue_t* queue, void* item)
 {
-	semaphore_acquire(queue->free_items);
-	int index = atomic_increment(&queue->tail_index) % queue->capacity;
-	queue->items[index] = item;
-	semaphore_release(queue->used_items);
+	queue_push_n(queue, &item, 1);
 }
 
 void* queue_pop(queue_t* queue)
 {
-	semaphore_acquire(queue->used_items);
-	int index = atomic_increment(&queue->head_index) % queue->capacity;
-	void* item = queue->items[index];
-	semaphore_release(queue->free_items);
+	void* item;
+	queue_pop_n(queue, &item, 1);
 	return item;
 }
 
 bool queue_try_push(queue_t* queue, void* item)
 {
-	if (semaphore_try_acquire(queue->free_items))
-	{
-		int index = atomic_increment(&queue->tail_index) % queue->capacity;
-		queue->items[index] = item;
-		semaphore_release(queue->used_items);
-		return true;
-	}
-	return false;
+	return queue_push_some(queue, &item, 1) == 1;
 }
 
 void* queue_try_pop(queue_t* queue)
 {
-	if (semaphore_try_acquire(queue->used_items))
-	{
-		int index = atomic_increment(&queue->head_index) % queue->capacity;
-		void* item = queue->items[index];
-		semaphore_release(queue->free_items);
-		return item;
-	}
-	return NULL;
+	void* item;
+	return queue_pop_some(queue, &item, 1) ? item : NULL;
 }
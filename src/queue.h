@@ -3,6 +3,9 @@
 #include <stdbool.h>
 
 // Thread-safe Queue container
+//
+// Bounded and lock-free. Blocking calls spin briefly, then sleep until
+// another thread makes room or adds an item.
 
 // Handle to a thread-safe queue.
 typedef struct queue_t queue_t;
@@ -10,6 +13,7 @@ typedef struct queue_t queue_t;
 typedef struct heap_t heap_t;
 
 // Create a queue with the defined capacity.
+// Capacity is rounded up to a power of two.
 queue_t* queue_create(heap_t* heap, int capacity);
 
 // Destroy a previously created queue.
@@ -34,3 +38,17 @@ bool queue_try_push(queue_t* queue, void* item);
 // If the queue is empty, returns NULL.
 // Safe for multiple threads to pop at the same time.
 void* queue_try_pop(queue_t* queue);
+
+// Push count items onto a queue in order.
+// Runs of consecutive free slots are claimed with a single synchronization,
+// so pushing many items costs little more than pushing one.
+// If the queue fills up, blocks until space is available for the rest.
+// Safe for multiple threads to push at the same time; items from different
+// threads may interleave.
+void queue_push_n(queue_t* queue, void* const* items, int count);
+
+// Pop up to max items off a queue (FIFO order) with a single
+// synchronization. If the queue is empty, blocks until an item is
+// available. Returns the number of items popped.
+// Safe for multiple threads to pop at the same time.
+int queue_pop_n(queue_t* queue, void** items, int max);
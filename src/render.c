@@ -1,9 +1,10 @@
 #include "render.h"
 
 #include "ecs.h"
+#include "frame_arena.h"
 #include "gpu.h"
 #include "heap.h"
-#include "queue.h"
+#include "spsc_queue.h"
 #include "thread.h"
 #include "wm.h"
 
@@ -13,6 +14,12 @@
 enum
 {
 	k_render_max_drawables = 512,
+	// Room for a full frame of commands, so a frame is handed to the
+	// render thread in one publish and drained in a few batched pops.
+	k_render_queue_capacity = k_render_max_drawables + 1,
+	k_render_command_batch = 64,
+	k_render_frame_arena_block_size = 64 * 1024,
+	k_render_frame_arena_frames = 3,
 };
 
 typedef enum command_type_t
@@ -64,7 +71,8 @@ typedef struct render_t
 	wm_window_t* window;
 	thread_t* thread;
 	gpu_t* gpu;
-	queue_t* queue;
+	spsc_queue_t* queue;
+	frame_arena_t* frame_arena;
 
 	int frame_counter;
 	int gpu_frame_count;
@@ -85,44 +93,51 @@ static void destroy_stale_data(render_t* render);
 
 render_t* render_create(heap_t* heap, wm_window_t* window)
 {
-	render_t* render = heap_alloc(heap, sizeof(render_t), 8);
+	render_t* render = heap_alloc_tagged(heap, sizeof(render_t), 8, k_heap_tag_render);
 	render->heap = heap;
 	render->window = window;
-	render->queue = queue_create(heap, 3);
+	render->queue = spsc_queue_create(heap, k_render_queue_capacity);
+	render->frame_arena = frame_arena_create(heap, k_render_frame_arena_block_size, k_render_frame_arena_frames, k_heap_tag_render);
 	render->frame_counter = 0;
 	render->instance_count = 0;
 	render->mesh_count = 0;
 	render->shader_count = 0;
 	render->thread = thread_create(render_thread_func, render);
+	thread_set_name(render->thread, "render");
 	return render;
 }
 
 void render_destroy(render_t* render)
 {
-	queue_push(render->queue, NULL);
+	spsc_queue_push(render->queue, NULL);
 	thread_destroy(render->thread);
-	queue_destroy(render->queue);
+	spsc_queue_destroy(render->queue);
+	frame_arena_destroy(render->frame_arena);
 	heap_free(render->heap, render);
 }
 
 void render_push_model(render_t* render, ecs_entity_ref_t* entity, gpu_mesh_info_t* mesh, gpu_shader_info_t* shader, gpu_uniform_buffer_info_t* uniform)
 {
-	model_command_t* command = heap_alloc(render->heap, sizeof(model_command_t), 8);
+	model_command_t* command = frame_arena_alloc(render->frame_arena, sizeof(model_command_t), 8);
 	command->type = k_command_model;
 	command->entity = *entity;
 	command->mesh = mesh;
 	command->shader = shader;
 	command->uniform_buffer.size = uniform->size;
-	command->uniform_buffer.data = heap_alloc(render->heap, uniform->size, 8);
+	command->uniform_buffer.data = frame_arena_alloc(render->frame_arena, uniform->size, 8);
 	memcpy(command->uniform_buffer.data, uniform->data, uniform->size);
-	queue_push(render->queue, command);
+	spsc_queue_write(render->queue, command);
 }
 
 void render_push_done(render_t* render)
 {
-	frame_done_command_t* command = heap_alloc(render->heap, sizeof(frame_done_command_t), 8);
+	frame_done_command_t* command = frame_arena_alloc(render->frame_arena, sizeof(frame_done_command_t), 8);
 	command->type = k_command_frame_done;
-	queue_push(render->queue, command);
+	spsc_queue_push(render->queue, command);
+
+	// Commands for this frame live in the arena until the render thread
+	// releases the frame after drawing it.
+	frame_arena_advance(render->frame_arena);
 }
 
 static int render_thread_func(void* user)
@@ -137,9 +152,18 @@ static int render_thread_func(void* user)
 	gpu_mesh_t* last_mesh = NULL;
 	int frame_index = 0;
 
+	command_type_t* commands[k_render_command_batch];
+	int command_count = 0;
+	int command_index = 0;
+
 	while (true)
 	{
-		command_type_t* type = queue_pop(render->queue);
+		if (command_index == command_count)
+		{
+			command_count = spsc_queue_pop_n(render->queue, commands, _countof(commands));
+			command_index = 0;
+		}
+		command_type_t* type = commands[command_index++];
 		if (!type)
 		{
 			break;
@@ -160,6 +184,8 @@ static int render_thread_func(void* user)
 			destroy_stale_data(render);
 			++render->frame_counter;
 			frame_index = render->frame_counter % render->gpu_frame_count;
+
+			frame_arena_release(render->frame_arena);
 		}
 		else if (*type == k_command_model)
 		{
@@ -168,8 +194,6 @@ static int render_thread_func(void* user)
 			draw_mesh_t* mesh = create_or_get_mesh_for_model_command(render, command);
 			draw_instance_t* instance = create_or_get_instance_for_model_command(render, command, shader->shader);
 
-			heap_free(render->heap, command->uniform_buffer.data);
-
 			if (last_pipeline != shader->pipeline)
 			{
 				gpu_cmd_pipeline_bind(render->gpu, cmdbuf, shader->pipeline);
@@ -183,8 +207,6 @@ static int render_thread_func(void* user)
 			gpu_cmd_descriptor_bind(render->gpu, cmdbuf, instance->descriptors[frame_index]);
 			gpu_cmd_draw(render->gpu, cmdbuf);
 		}
-
-		heap_free(render->heap, type);
 	}
 
 	gpu_wait_until_idle(render->gpu);
@@ -273,8 +295,8 @@ static draw_instance_t* create_or_get_instance_for_model_command(render_t* rende
 		instance = &render->instances[render->instance_count++];
 
 		instance->entity = command->entity;
-		instance->uniform_buffers = heap_alloc(render->heap, sizeof(gpu_uniform_buffer_t*) * render->gpu_frame_count, 8);
-		instance->descriptors = heap_alloc(render->heap, sizeof(gpu_descriptor_t*) * render->gpu_frame_count, 8);
+		instance->uniform_buffers = heap_alloc_tagged(render->heap, sizeof(gpu_uniform_buffer_t*) * render->gpu_frame_count, 8, k_heap_tag_render);
+		instance->descriptors = heap_alloc_tagged(render->heap, sizeof(gpu_descriptor_t*) * render->gpu_frame_count, 8, k_heap_tag_render);
 		for (int i = 0; i < render->gpu_frame_count; ++i)
 		{
 			instance->uniform_buffers[i] = gpu_uniform_buffer_create(render->gpu, &command->uniform_buffer);
@@ -18,7 +18,11 @@ render_t* render_create(heap_t* heap, wm_window_t* window);
 void render_destroy(render_t* render);
 
 // Push a model onto a queue of items to be rendered.
+// The command and a copy of the uniform data are allocated from a
+// per-frame arena; no heap allocation is made per model.
 void render_push_model(render_t* render, ecs_entity_ref_t* entity, gpu_mesh_info_t* mesh, gpu_shader_info_t* shader, gpu_uniform_buffer_info_t* uniform);
 
 // Push an end-of-frame marker on a queue of items to be rendered.
+// Advances the per-frame arena. May block if the render thread is
+// still drawing all previous frames.
 void render_push_done(render_t* render);
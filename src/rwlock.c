@@ -0,0 +1,125 @@
+#include "rwlock.h"
+
+#include "atomic.h"
+#include "futex.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+enum
+{
+	// Attempts made before a blocked lock parks.
+	k_rwlock_spin_count = 128,
+
+	// Value of state while a writer holds the lock.
+	k_rwlock_write_locked = -1,
+};
+
+// state counts readers holding the lock, or is k_rwlock_write_locked.
+// Blocked threads park on wake_sequence, which every unlock that could let
+// someone in bumps; the wake is skipped when nobody is parked.
+typedef struct rwlock_t
+{
+	int state;
+	int writers_waiting;
+	int parked;
+	int wake_sequence;
+} rwlock_t;
+
+rwlock_t* rwlock_create()
+{
+	rwlock_t* lock = malloc(sizeof(rwlock_t));
+	lock->state = 0;
+	lock->writers_waiting = 0;
+	lock->parked = 0;
+	lock->wake_sequence = 0;
+	return lock;
+}
+
+void rwlock_destroy(rwlock_t* lock)
+{
+	free(lock);
+}
+
+static bool rwlock_try_lock_read(rwlock_t* lock)
+{
+	if (atomic_load(&lock->writers_waiting) != 0)
+	{
+		return false;
+	}
+	int state = atomic_load(&lock->state);
+	return state != k_rwlock_write_locked &&
+		atomic_compare_and_exchange(&lock->state, state, state + 1) == state;
+}
+
+static bool rwlock_try_lock_write(rwlock_t* lock)
+{
+	return atomic_load(&lock->state) == 0 &&
+		atomic_compare_and_exchange(&lock->state, 0, k_rwlock_write_locked) == 0;
+}
+
+// Spins on try_lock, then parks until an unlock and tries again.
+static void rwlock_lock(rwlock_t* lock, bool (*try_lock)(rwlock_t* lock))
+{
+	for (int spin = 0;; ++spin)
+	{
+		if (try_lock(lock))
+		{
+			return;
+		}
+		if (spin < k_rwlock_spin_count)
+		{
+			atomic_pause();
+			continue;
+		}
+
+		// Register before the last attempt so an unlock after it wakes us.
+		int sequence = atomic_load(&lock->wake_sequence);
+		atomic_increment(&lock->parked);
+		if (try_lock(lock))
+		{
+			atomic_decrement(&lock->parked);
+			return;
+		}
+		futex_wait(&lock->wake_sequence, sequence);
+		atomic_decrement(&lock->parked);
+	}
+}
+
+static void rwlock_wake(rwlock_t* lock)
+{
+	atomic_increment(&lock->wake_sequence);
+	if (atomic_load(&lock->parked) > 0)
+	{
+		futex_wake(&lock->wake_sequence, INT_MAX);
+	}
+}
+
+void rwlock_lock_read(rwlock_t* lock)
+{
+	rwlock_lock(lock, rwlock_try_lock_read);
+}
+
+void rwlock_unlock_read(rwlock_t* lock)
+{
+	// Only the last reader out can let a writer in.
+	if (atomic_decrement(&lock->state) == 1)
+	{
+		rwlock_wake(lock);
+	}
+}
+
+void rwlock_lock_write(rwlock_t* lock)
+{
+	// Announce the writer first so new readers hold off.
+	atomic_increment(&lock->writers_waiting);
+	rwlock_lock(lock, rwlock_try_lock_write);
+	atomic_decrement(&lock->writers_waiting);
+}
+
+void rwlock_unlock_write(rwlock_t* lock)
+{
+	atomic_store(&lock->state, 0);
+	rwlock_wake(lock);
+}
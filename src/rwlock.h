@@ -0,0 +1,30 @@
+#pragma once
+
+// Reader-writer lock thread synchronization
+//
+// Any number of readers may hold the lock at once; a writer holds it alone.
+// Writers are preferred: once a writer is waiting, new readers block until
+// it has had its turn, so a steady stream of readers cannot starve it.
+// Not recursive. A thread holding the lock for reading must not take it
+// again while a writer may be waiting.
+
+// Handle to a reader-writer lock.
+typedef struct rwlock_t rwlock_t;
+
+// Creates a new reader-writer lock.
+rwlock_t* rwlock_create();
+
+// Destroys a previously created reader-writer lock.
+void rwlock_destroy(rwlock_t* lock);
+
+// Locks for reading. Blocks while a writer holds or is waiting for the lock.
+void rwlock_lock_read(rwlock_t* lock);
+
+// Unlocks after rwlock_lock_read.
+void rwlock_unlock_read(rwlock_t* lock);
+
+// Locks for writing. Blocks until all readers and writers have unlocked.
+void rwlock_lock_write(rwlock_t* lock);
+
+// Unlocks after rwlock_lock_write.
+void rwlock_unlock_write(rwlock_t* lock);
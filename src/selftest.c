@@ -0,0 +1,198 @@
+#include "selftest.h"
+
+#include "atomic.h"
+#include "debug.h"
+#include "event.h"
+#include "heap.h"
+#include "thread.h"
+#include "vm.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+enum
+{
+	k_selftest_thread_count = 4,
+
+	k_heap_dump_slots = 64,
+	k_heap_dump_iterations = 20000,
+	k_heap_dump_max_size = 300 * 1024,
+};
+
+static const char* k_heap_dump_path = "selftest_heap_dump.json";
+
+typedef struct heap_dump_test_t
+{
+	heap_t* heap;
+	event_t* start;
+	int threads_done;
+
+	// Left live by each thread when it finishes.
+	void* blocks[k_selftest_thread_count][k_heap_dump_slots];
+	int64_t live_bytes;
+	int64_t live_count;
+} heap_dump_test_t;
+
+typedef struct heap_dump_thread_t
+{
+	heap_dump_test_t* test;
+	int index;
+} heap_dump_thread_t;
+
+static int heap_dump_thread_func(void* user)
+{
+	heap_dump_thread_t* thread = user;
+	heap_dump_test_t* test = thread->test;
+	void** blocks = test->blocks[thread->index];
+	event_wait(test->start);
+
+	// Cached, arena and large sizes, so every allocation path is hit.
+	static const size_t k_sizes[] = { 24, 200, 1500, 4000, 40000, k_heap_dump_max_size };
+	size_t sizes[k_heap_dump_slots] = { 0 };
+
+	uint32_t random = 0x9E3779B9u * (thread->index + 1);
+	for (int i = 0; i < k_heap_dump_iterations; ++i)
+	{
+		random ^= random << 13;
+		random ^= random >> 17;
+		random ^= random << 5;
+		int slot = random % k_heap_dump_slots;
+		heap_free(test->heap, blocks[slot]);
+		sizes[slot] = k_sizes[(random >> 8) % _countof(k_sizes)];
+		blocks[slot] = heap_alloc(test->heap, sizes[slot], 8);
+	}
+
+	for (int i = 0; i < k_heap_dump_slots; ++i)
+	{
+		atomic_add64(&test->live_bytes, (int64_t)sizes[i]);
+		atomic_add64(&test->live_count, sizes[i] ? 1 : 0);
+	}
+	atomic_increment(&test->threads_done);
+	return 0;
+}
+
+// Dumps the heap and reads back the totals at the top of the file.
+static bool heap_dump_read_totals(heap_t* heap, long long* live_bytes, long long* live_count)
+{
+	if (!heap_dump_live(heap, k_heap_dump_path))
+	{
+		return false;
+	}
+	FILE* file = NULL;
+	if (fopen_s(&file, k_heap_dump_path, "r") != 0 || !file)
+	{
+		return false;
+	}
+	int read = fscanf_s(file, "{ \"live_bytes\": %lld, \"live_count\": %lld", live_bytes, live_count);
+	fclose(file);
+	return read == 2;
+}
+
+static bool selftest_heap_dump()
+{
+	heap_dump_test_t test =
+	{
+		.heap = heap_create(2 * 1024 * 1024),
+		.start = event_create(),
+	};
+
+	heap_dump_thread_t thread_data[k_selftest_thread_count];
+	thread_t* threads[k_selftest_thread_count];
+	for (int i = 0; i < k_selftest_thread_count; ++i)
+	{
+		thread_data[i] = (heap_dump_thread_t) { .test = &test, .index = i };
+		threads[i] = thread_create(heap_dump_thread_func, &thread_data[i]);
+	}
+	event_signal(test.start);
+
+	// Nothing can be live beyond every slot holding the largest size.
+	const long long max_live_bytes = (long long)k_selftest_thread_count * k_heap_dump_slots * k_heap_dump_max_size;
+	bool passed = true;
+	int dump_count = 0;
+	while (atomic_load(&test.threads_done) < k_selftest_thread_count)
+	{
+		long long live_bytes;
+		long long live_count;
+		if (!heap_dump_read_totals(test.heap, &live_bytes, &live_count) ||
+			live_bytes < 0 || live_bytes > max_live_bytes ||
+			live_count < 0 || live_count > k_selftest_thread_count * k_heap_dump_slots)
+		{
+			debug_print(k_print_error, "selftest_heap: dump %d during allocation is inconsistent\n", dump_count);
+			passed = false;
+			break;
+		}
+		dump_count++;
+	}
+
+	for (int i = 0; i < k_selftest_thread_count; ++i)
+	{
+		thread_destroy(threads[i]);
+	}
+
+	// With every thread finished, the dump must match exactly.
+	long long live_bytes = -1;
+	long long live_count = -1;
+	if (!heap_dump_read_totals(test.heap, &live_bytes, &live_count) ||
+		live_bytes != test.live_bytes || live_count != test.live_count)
+	{
+		debug_print(k_print_error, "selftest_heap: final dump has %lld bytes in %lld allocations, expected %lld bytes in %lld\n",
+			live_bytes, live_count, (long long)test.live_bytes, (long long)test.live_count);
+		passed = false;
+	}
+	debug_print(k_print_info, "selftest_heap: %d dumps during allocation\n", dump_count);
+
+	for (int i = 0; i < k_selftest_thread_count; ++i)
+	{
+		for (int j = 0; j < k_heap_dump_slots; ++j)
+		{
+			heap_free(test.heap, test.blocks[i][j]);
+		}
+	}
+	remove(k_heap_dump_path);
+	event_destroy(test.start);
+	heap_destroy(test.heap);
+	return passed;
+}
+
+// Grows a huge-page block within the slack of its last huge page.
+// It must keep its address and mapping instead of being copied.
+static bool selftest_heap_huge_realloc()
+{
+	size_t huge_page_size = vm_huge_page_size();
+	if (!huge_page_size)
+	{
+		debug_print(k_print_info, "selftest_heap: no huge pages, skipping huge realloc\n");
+		return true;
+	}
+
+	heap_t* heap = heap_create(2 * 1024 * 1024);
+	heap_set_large_huge_pages(heap, true);
+
+	bool passed = true;
+	char* block = heap_alloc(heap, huge_page_size + 4096, 8);
+	memset(block, 0x5a, huge_page_size + 4096);
+	heap_stats_t before;
+	heap_get_stats(heap, &before, false);
+
+	char* grown = heap_realloc(heap, block, huge_page_size + 64 * 1024, 8);
+	heap_stats_t after;
+	heap_get_stats(heap, &after, false);
+	if (grown != block || after.bytes_large != before.bytes_large || grown[huge_page_size + 4095] != 0x5a)
+	{
+		debug_print(k_print_error, "selftest_heap: huge realloc moved or remapped (%zu to %zu mapped bytes)\n",
+			before.bytes_large, after.bytes_large);
+		passed = false;
+	}
+
+	heap_free(heap, grown);
+	heap_destroy(heap);
+	return passed;
+}
+
+bool selftest_heap()
+{
+	bool passed = selftest_heap_dump();
+	passed = selftest_heap_huge_realloc() && passed;
+	return passed;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Engine self-tests for behavior that only shows up under concurrency.
+// Failures are logged with debug_print() as errors.
+
+// Dump live heap allocations while other threads allocate and free, and
+// check every dump reads back consistent totals. Then grow a huge-page
+// block within its last huge page and check it is not moved or remapped.
+// Returns false if any check failed.
+bool selftest_heap();
@@ -1,31 +1,92 @@
 #include "semaphore.h"
 
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
+#include "atomic.h"
+#include "futex.h"
+
+#include <stdlib.h>
+
+enum
+{
+	// Attempts made before a blocked acquire parks.
+	k_semaphore_spin_count = 128,
+};
+
+// A release is one atomic on count, plus a wake only if a thread has
+// registered in waiters to park.
+typedef struct semaphore_t
+{
+	int count;
+	int max_count;
+	int waiters;
+} semaphore_t;
 
 semaphore_t* semaphore_create(int initial_count, int max_count)
 {
-	HANDLE semaphore = CreateSemaphore(NULL, initial_count, max_count, NULL);
-	return (semaphore_t*)semaphore;
+	semaphore_t* semaphore = malloc(sizeof(semaphore_t));
+	semaphore->count = initial_count;
+	semaphore->max_count = max_count;
+	semaphore->waiters = 0;
+	return semaphore;
 }
 
 void semaphore_destroy(semaphore_t* semaphore)
 {
-	CloseHandle(semaphore);
+	free(semaphore);
 }
 
 void semaphore_acquire(semaphore_t* semaphore)
 {
-	WaitForSingleObject(semaphore, INFINITE);
+	for (int spin = 0; spin < k_semaphore_spin_count; ++spin)
+	{
+		if (semaphore_try_acquire(semaphore))
+		{
+			return;
+		}
+		atomic_pause();
+	}
+
+	// Register before the last attempt so a release after it wakes us.
+	atomic_increment(&semaphore->waiters);
+	while (!semaphore_try_acquire(semaphore))
+	{
+		futex_wait(&semaphore->count, 0);
+	}
+	atomic_decrement(&semaphore->waiters);
 }
 
 bool semaphore_try_acquire(semaphore_t* semaphore)
 {
-	DWORD result = WaitForSingleObject(semaphore, 0);
-	return result == WAIT_OBJECT_0;
+	int count = atomic_load(&semaphore->count);
+	while (count > 0)
+	{
+		int old_count = atomic_compare_and_exchange(&semaphore->count, count, count - 1);
+		if (old_count == count)
+		{
+			return true;
+		}
+		count = old_count;
+	}
+	return false;
 }
 
 void semaphore_release(semaphore_t* semaphore)
 {
-	ReleaseSemaphore(semaphore, 1, NULL);
+	int count = atomic_load(&semaphore->count);
+	for (;;)
+	{
+		if (count >= semaphore->max_count)
+		{
+			return;
+		}
+		int old_count = atomic_compare_and_exchange(&semaphore->count, count, count + 1);
+		if (old_count == count)
+		{
+			break;
+		}
+		count = old_count;
+	}
+	if (atomic_load(&semaphore->waiters) > 0)
+	{
+		futex_wake(&semaphore->count, 1);
+	}
 }
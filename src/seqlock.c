@@ -0,0 +1,52 @@
+#include "seqlock.h"
+
+#include "atomic.h"
+
+#include <stdlib.h>
+
+// The sequence is odd while a write is in progress.
+typedef struct seqlock_t
+{
+	int sequence;
+} seqlock_t;
+
+seqlock_t* seqlock_create()
+{
+	seqlock_t* lock = malloc(sizeof(seqlock_t));
+	lock->sequence = 0;
+	return lock;
+}
+
+void seqlock_destroy(seqlock_t* lock)
+{
+	free(lock);
+}
+
+void seqlock_write_begin(seqlock_t* lock)
+{
+	// Full barrier: the odd sequence is visible before any guarded store.
+	atomic_increment(&lock->sequence);
+}
+
+void seqlock_write_end(seqlock_t* lock)
+{
+	// Full barrier: every guarded store is visible before the even sequence.
+	atomic_increment(&lock->sequence);
+}
+
+int seqlock_read_begin(seqlock_t* lock)
+{
+	int sequence;
+	while ((sequence = atomic_load(&lock->sequence)) & 1)
+	{
+		atomic_pause();
+	}
+	return sequence;
+}
+
+bool seqlock_read_retry(seqlock_t* lock, int sequence)
+{
+	// Guarded loads must complete before the sequence is checked again.
+	atomic_fence();
+	return atomic_load(&lock->sequence) != sequence;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Sequence lock thread synchronization
+//
+// For small, plain-data state written by one thread and read often by
+// others, such as the latest copy of a transform or a set of counters.
+// Writers never wait on readers. Readers copy the state out and retry if
+// a write overlapped the copy, so they never block the writer and never
+// see a torn value. Writers must be serialized by the caller.
+//
+// Reading:
+//   int sequence;
+//   do
+//   {
+//     sequence = seqlock_read_begin(lock);
+//     copy = shared;
+//   } while (seqlock_read_retry(lock, sequence));
+
+// Handle to a sequence lock.
+typedef struct seqlock_t seqlock_t;
+
+// Creates a new sequence lock.
+seqlock_t* seqlock_create();
+
+// Destroys a previously created sequence lock.
+void seqlock_destroy(seqlock_t* lock);
+
+// Marks the start of a write to the guarded state.
+void seqlock_write_begin(seqlock_t* lock);
+
+// Marks the end of a write to the guarded state.
+void seqlock_write_end(seqlock_t* lock);
+
+// Starts a read of the guarded state.
+// Returns a sequence number to pass to seqlock_read_retry.
+int seqlock_read_begin(seqlock_t* lock);
+
+// Determines if a write overlapped the read started at sequence.
+// If true, the copied state may be torn and the read must be repeated.
+bool seqlock_read_retry(seqlock_t* lock, int sequence);
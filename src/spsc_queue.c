@@ -0,0 +1,246 @@
+#include "spsc_queue.h"
+
+#include "atomic.h"
+#include "heap.h"
+#include "semaphore.h"
+
+enum
+{
+	k_spsc_cache_line_size = 64,
+
+	// Attempts made before a blocked push or pop goes to sleep.
+	k_spsc_spin_count = 128,
+};
+
+// Indices count items ever pushed or popped and wrap modulo 2^32.
+// Each side keeps a stale copy of the other's index and only rereads the
+// shared one when the copy says the queue is full or empty.
+typedef struct spsc_queue_t
+{
+	heap_t* heap;
+	void** items;
+	int mask;
+	semaphore_t* items_ready;
+	semaphore_t* space_ready;
+
+	// Written by the producer.
+	char producer_padding[k_spsc_cache_line_size];
+	int tail;
+	int write_tail;
+	int head_cache;
+	int producer_sleeping;
+
+	// Written by the consumer.
+	char consumer_padding[k_spsc_cache_line_size];
+	int head;
+	int tail_cache;
+	int consumer_sleeping;
+	char end_padding[k_spsc_cache_line_size];
+} spsc_queue_t;
+
+static int spsc_distance(int a, int b)
+{
+	return (int)((unsigned int)a - (unsigned int)b);
+}
+
+static int spsc_advance(int index, int count)
+{
+	return (int)((unsigned int)index + (unsigned int)count);
+}
+
+spsc_queue_t* spsc_queue_create(heap_t* heap, int capacity)
+{
+	int slot_count = 1;
+	while (slot_count < capacity)
+	{
+		slot_count *= 2;
+	}
+
+	spsc_queue_t* queue = heap_alloc(heap, sizeof(spsc_queue_t), k_spsc_cache_line_size);
+	queue->heap = heap;
+	queue->items = heap_alloc(heap, sizeof(void*) * slot_count, k_spsc_cache_line_size);
+	queue->mask = slot_count - 1;
+	queue->items_ready = semaphore_create(0, 1);
+	queue->space_ready = semaphore_create(0, 1);
+	queue->tail = 0;
+	queue->write_tail = 0;
+	queue->head_cache = 0;
+	queue->producer_sleeping = 0;
+	queue->head = 0;
+	queue->tail_cache = 0;
+	queue->consumer_sleeping = 0;
+	return queue;
+}
+
+void spsc_queue_destroy(spsc_queue_t* queue)
+{
+	semaphore_destroy(queue->items_ready);
+	semaphore_destroy(queue->space_ready);
+	heap_free(queue->heap, queue->items);
+	heap_free(queue->heap, queue);
+}
+
+// Wakes the other side if it went to sleep.
+// Runs on every publish and pop, so it only reads the flag; the sleeper pays
+// for the ordering with a process-wide fence instead. Exactly one thread
+// clears the flag, so the semaphore is released once per sleep.
+static void spsc_wake(int* sleeping, semaphore_t* semaphore)
+{
+	if (atomic_load(sleeping) && atomic_compare_and_exchange(sleeping, 1, 0) == 1)
+	{
+		semaphore_release(semaphore);
+	}
+}
+
+typedef int (*spsc_attempt_t)(spsc_queue_t* queue, void** items, int count);
+
+// Sleeps until woken, unless a final attempt made after announcing the
+// sleep succeeds. Returns what that attempt returned.
+// The process-wide fence makes the other side's index store visible before
+// the final attempt, or this side's flag visible to its spsc_wake read.
+static int spsc_sleep(int* sleeping, semaphore_t* semaphore, spsc_attempt_t attempt, spsc_queue_t* queue, void** items, int count)
+{
+	atomic_compare_and_exchange(sleeping, 0, 1);
+	atomic_fence_process();
+	int result = attempt(queue, items, count);
+	if (result)
+	{
+		// If the other side already cleared the flag, take its wake-up.
+		if (atomic_compare_and_exchange(sleeping, 1, 0) != 1)
+		{
+			semaphore_acquire(semaphore);
+		}
+		return result;
+	}
+	semaphore_acquire(semaphore);
+	return 0;
+}
+
+// Stages as many items as fit, up to count. Returns the number written.
+static int spsc_write_some(spsc_queue_t* queue, void** items, int count)
+{
+	int space = queue->mask + 1 - spsc_distance(queue->write_tail, queue->head_cache);
+	if (space < count)
+	{
+		queue->head_cache = atomic_load(&queue->head);
+		space = queue->mask + 1 - spsc_distance(queue->write_tail, queue->head_cache);
+	}
+	int written = space < count ? space : count;
+	for (int i = 0; i < written; ++i)
+	{
+		queue->items[spsc_advance(queue->write_tail, i) & queue->mask] = items[i];
+	}
+	queue->write_tail = spsc_advance(queue->write_tail, written);
+	return written;
+}
+
+// Takes as many published items as are available, up to max, releasing
+// their slots with a single store. Returns the number popped.
+static int spsc_pop_some(spsc_queue_t* queue, void** items, int max)
+{
+	int available = spsc_distance(queue->tail_cache, queue->head);
+	if (available < max)
+	{
+		queue->tail_cache = atomic_load(&queue->tail);
+		available = spsc_distance(queue->tail_cache, queue->head);
+	}
+	int popped = available < max ? available : max;
+	if (popped)
+	{
+		for (int i = 0; i < popped; ++i)
+		{
+			items[i] = queue->items[spsc_advance(queue->head, i) & queue->mask];
+		}
+		atomic_store(&queue->head, spsc_advance(queue->head, popped));
+		spsc_wake(&queue->producer_sleeping, queue->space_ready);
+	}
+	return popped;
+}
+
+void spsc_queue_write_n(spsc_queue_t* queue, void* const* items, int count)
+{
+	int written = 0;
+	int spin = 0;
+	while (written < count)
+	{
+		int some = spsc_write_some(queue, (void**)items + written, count - written);
+		if (!some && spin++ == 0)
+		{
+			// The consumer can only make room once it sees what is staged.
+			spsc_queue_publish(queue);
+		}
+		else if (!some && spin > k_spsc_spin_count)
+		{
+			some = spsc_sleep(&queue->producer_sleeping, queue->space_ready, spsc_write_some, queue, (void**)items + written, count - written);
+		}
+		else if (!some)
+		{
+			atomic_pause();
+		}
+		if (some)
+		{
+			written += some;
+			spin = 0;
+		}
+	}
+}
+
+void spsc_queue_write(spsc_queue_t* queue, void* item)
+{
+	spsc_queue_write_n(queue, &item, 1);
+}
+
+void spsc_queue_publish(spsc_queue_t* queue)
+{
+	if (queue->tail != queue->write_tail)
+	{
+		atomic_store(&queue->tail, queue->write_tail);
+		spsc_wake(&queue->consumer_sleeping, queue->items_ready);
+	}
+}
+
+void spsc_queue_push(spsc_queue_t* queue, void* item)
+{
+	spsc_queue_write_n(queue, &item, 1);
+	spsc_queue_publish(queue);
+}
+
+bool spsc_queue_try_push(spsc_queue_t* queue, void* item)
+{
+	if (!spsc_write_some(queue, &item, 1))
+	{
+		return false;
+	}
+	spsc_queue_publish(queue);
+	return true;
+}
+
+int spsc_queue_pop_n(spsc_queue_t* queue, void** items, int max)
+{
+	for (int spin = 0;; ++spin)
+	{
+		int some = spsc_pop_some(queue, items, max);
+		if (!some && spin >= k_spsc_spin_count)
+		{
+			some = spsc_sleep(&queue->consumer_sleeping, queue->items_ready, spsc_pop_some, queue, items, max);
+		}
+		if (some)
+		{
+			return some;
+		}
+		atomic_pause();
+	}
+}
+
+void* spsc_queue_pop(spsc_queue_t* queue)
+{
+	void* item;
+	spsc_queue_pop_n(queue, &item, 1);
+	return item;
+}
+
+void* spsc_queue_try_pop(spsc_queue_t* queue)
+{
+	void* item;
+	return spsc_pop_some(queue, &item, 1) ? item : NULL;
+}
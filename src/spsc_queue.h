@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Single-producer single-consumer queue container
+//
+// A bounded ring for pipelines with exactly one pushing thread and one
+// popping thread. The producer and consumer each own an index on their own
+// cache line, so the fast path needs no read-modify-write atomics.
+// Blocking calls spin briefly, then sleep until the other side catches up.
+
+// Handle to a single-producer single-consumer queue.
+typedef struct spsc_queue_t spsc_queue_t;
+
+typedef struct heap_t heap_t;
+
+// Create a queue with the defined capacity.
+// Capacity is rounded up to a power of two.
+spsc_queue_t* spsc_queue_create(heap_t* heap, int capacity);
+
+// Destroy a previously created queue.
+void spsc_queue_destroy(spsc_queue_t* queue);
+
+// Add an item without making it visible to the consumer yet.
+// Items written since the last publish become visible together with a
+// single store. If the queue is full, publishes and blocks until
+// space is available. Producer thread only.
+void spsc_queue_write(spsc_queue_t* queue, void* item);
+
+// Add count items in order without making them visible to the consumer yet.
+// If the queue fills up, publishes and blocks until space is available.
+// Producer thread only.
+void spsc_queue_write_n(spsc_queue_t* queue, void* const* items, int count);
+
+// Make all written items visible to the consumer.
+// Producer thread only.
+void spsc_queue_publish(spsc_queue_t* queue);
+
+// Push an item onto a queue and publish it.
+// If the queue is full, blocks until space is available.
+// Producer thread only.
+void spsc_queue_push(spsc_queue_t* queue, void* item);
+
+// Push an item onto a queue and publish it if space is available.
+// If the queue is full, returns false.
+// Producer thread only.
+bool spsc_queue_try_push(spsc_queue_t* queue, void* item);
+
+// Pop an item off a queue (FIFO order).
+// If the queue is empty, blocks until an item is published.
+// Consumer thread only.
+void* spsc_queue_pop(spsc_queue_t* queue);
+
+// Pop an item off a queue (FIFO order).
+// If the queue is empty, returns NULL.
+// Consumer thread only.
+void* spsc_queue_try_pop(spsc_queue_t* queue);
+
+// Pop up to max items off a queue (FIFO order), releasing their slots with
+// a single store. If the queue is empty, blocks until an item is published.
+// Returns the number of items popped.
+// Consumer thread only.
+int spsc_queue_pop_n(spsc_queue_t* queue, void** items, int max);
@@ -1,7 +1,28 @@
+#if !defined(_WIN32)
+#define _GNU_SOURCE
+#endif
+
 #include "thread.h"
 
+#include "atomic.h"
 #include "debug.h"
 
+#include <stdio.h>
+#include <string.h>
+
+enum
+{
+	k_thread_name_length = 32,
+	k_thread_max_names = 128,
+	k_thread_max_configs = 16,
+};
+
+// Name support differs per platform; the registry below is shared.
+static uint32_t thread_get_os_id(thread_t* thread);
+static void thread_set_os_name(thread_t* thread, const char* name);
+
+#if defined(_WIN32)
+
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
@@ -30,3 +51,300 @@ void thread_sleep(uint32_t ms)
 {
 	Sleep(ms);
 }
+
+uint32_t thread_get_id()
+{
+	return GetCurrentThreadId();
+}
+
+int thread_get_core_count()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+}
+
+bool thread_set_affinity(thread_t* thread, uint64_t core_mask)
+{
+	HANDLE h = thread ? (HANDLE)thread : GetCurrentThread();
+	return SetThreadAffinityMask(h, (DWORD_PTR)core_mask) != 0;
+}
+
+bool thread_set_priority(thread_t* thread, thread_priority_t priority)
+{
+	static const int k_priorities[] =
+	{
+		THREAD_PRIORITY_BELOW_NORMAL,
+		THREAD_PRIORITY_NORMAL,
+		THREAD_PRIORITY_ABOVE_NORMAL,
+		THREAD_PRIORITY_TIME_CRITICAL,
+	};
+	HANDLE h = thread ? (HANDLE)thread : GetCurrentThread();
+	return SetThreadPriority(h, k_priorities[priority]) != 0;
+}
+
+static uint32_t thread_get_os_id(thread_t* thread)
+{
+	return thread ? GetThreadId((HANDLE)thread) : GetCurrentThreadId();
+}
+
+static void thread_set_os_name(thread_t* thread, const char* name)
+{
+	char short_name[k_thread_name_length];
+	snprintf(short_name, sizeof(short_name), "%s", name);
+	wchar_t wide[k_thread_name_length];
+	if (MultiByteToWideChar(CP_UTF8, 0, short_name, -1, wide, k_thread_name_length) == 0)
+	{
+		wide[0] = L'\0';
+	}
+	HANDLE h = thread ? (HANDLE)thread : GetCurrentThread();
+	SetThreadDescription(h, wide);
+}
+
+#else
+
+#include "futex.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// pthreads return a pointer, so the exit code is kept alongside the handle.
+// The kernel thread id is needed for naming and priority, and only the
+// thread itself can ask for it.
+typedef struct thread_t
+{
+	pthread_t handle;
+	int (*function)(void*);
+	void* data;
+	int exit_code;
+	int id;
+} thread_t;
+
+static void* thread_start(void* user)
+{
+	thread_t* thread = user;
+	atomic_store(&thread->id, (int)thread_get_id());
+	futex_wake(&thread->id, INT_MAX);
+	thread->exit_code = thread->function(thread->data);
+	return NULL;
+}
+
+thread_t* thread_create(int (*function)(void*), void* data)
+{
+	thread_t* thread = malloc(sizeof(thread_t));
+	thread->function = function;
+	thread->data = data;
+	thread->exit_code = 0;
+	thread->id = 0;
+	if (pthread_create(&thread->handle, NULL, thread_start, thread) != 0)
+	{
+		debug_print(k_print_warning, "Thread failed to create!\n");
+		free(thread);
+		return NULL;
+	}
+	while (atomic_load(&thread->id) == 0)
+	{
+		futex_wait(&thread->id, 0);
+	}
+	return thread;
+}
+
+int thread_destroy(thread_t* thread)
+{
+	pthread_join(thread->handle, NULL);
+	int code = thread->exit_code;
+	free(thread);
+	return code;
+}
+
+void thread_sleep(uint32_t ms)
+{
+	struct timespec duration = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+	nanosleep(&duration, NULL);
+}
+
+uint32_t thread_get_id()
+{
+	// gettid is a system call; mutex_lock asks on every lock.
+	static __thread uint32_t s_thread_id;
+	if (!s_thread_id)
+	{
+		s_thread_id = (uint32_t)syscall(SYS_gettid);
+	}
+	return s_thread_id;
+}
+
+int thread_get_core_count()
+{
+	return (int)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+bool thread_set_affinity(thread_t* thread, uint64_t core_mask)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int i = 0; i < 64 && i < CPU_SETSIZE; ++i)
+	{
+		if (core_mask & (1ull << i))
+		{
+			CPU_SET(i, &set);
+		}
+	}
+	pthread_t handle = thread ? thread->handle : pthread_self();
+	return pthread_setaffinity_np(handle, sizeof(set), &set) == 0;
+}
+
+bool thread_set_priority(thread_t* thread, thread_priority_t priority)
+{
+	// Linux keeps a nice value per thread; lowering it below zero needs
+	// CAP_SYS_NICE or a raised RLIMIT_NICE.
+	static const int k_nice[] = { 10, 0, -5, -10 };
+	return setpriority(PRIO_PROCESS, thread_get_os_id(thread), k_nice[priority]) == 0;
+}
+
+static uint32_t thread_get_os_id(thread_t* thread)
+{
+	return thread ? (uint32_t)thread->id : thread_get_id();
+}
+
+static void thread_set_os_name(thread_t* thread, const char* name)
+{
+	// The kernel keeps 15 characters and a terminator.
+	char short_name[16];
+	snprintf(short_name, sizeof(short_name), "%s", name);
+	pthread_setname_np(thread ? thread->handle : pthread_self(), short_name);
+}
+
+#endif
+
+typedef struct thread_name_t
+{
+	uint32_t id;
+	char name[k_thread_name_length];
+} thread_name_t;
+
+typedef struct thread_config_t
+{
+	char prefix[k_thread_name_length];
+	uint64_t core_mask;
+	thread_priority_t priority;
+} thread_config_t;
+
+// Names and configs change a handful of times per run, so a spin lock
+// keeps this free of any dependency on mutex_t.
+static int s_thread_lock;
+static thread_name_t s_thread_names[k_thread_max_names];
+static int s_thread_name_count;
+static thread_config_t s_thread_configs[k_thread_max_configs];
+static int s_thread_config_count;
+
+static void thread_registry_lock()
+{
+	while (atomic_compare_and_exchange(&s_thread_lock, 0, 1) != 0)
+	{
+		atomic_pause();
+	}
+}
+
+static void thread_registry_unlock()
+{
+	atomic_store(&s_thread_lock, 0);
+}
+
+void thread_set_name(thread_t* thread, const char* name)
+{
+	thread_set_os_name(thread, name);
+	uint32_t id = thread_get_os_id(thread);
+
+	thread_config_t config;
+	bool configured = false;
+
+	thread_registry_lock();
+	// Identifiers are recycled once a thread exits, so an existing entry
+	// for the id is overwritten.
+	thread_name_t* entry = NULL;
+	for (int i = 0; i < s_thread_name_count; ++i)
+	{
+		if (s_thread_names[i].id == id)
+		{
+			entry = &s_thread_names[i];
+			break;
+		}
+	}
+	if (!entry && s_thread_name_count < k_thread_max_names)
+	{
+		entry = &s_thread_names[s_thread_name_count++];
+	}
+	if (entry)
+	{
+		entry->id = id;
+		snprintf(entry->name, sizeof(entry->name), "%s", name);
+	}
+	for (int i = 0; i < s_thread_config_count; ++i)
+	{
+		if (strncmp(name, s_thread_configs[i].prefix, strlen(s_thread_configs[i].prefix)) == 0)
+		{
+			config = s_thread_configs[i];
+			configured = true;
+			break;
+		}
+	}
+	thread_registry_unlock();
+
+	if (configured)
+	{
+		if (config.core_mask && !thread_set_affinity(thread, config.core_mask))
+		{
+			debug_print(k_print_warning, "Thread '%s' could not be pinned to cores 0x%llx.\n", name, (unsigned long long)config.core_mask);
+		}
+		if (!thread_set_priority(thread, config.priority))
+		{
+			debug_print(k_print_warning, "Thread '%s' could not be given priority %d.\n", name, (int)config.priority);
+		}
+	}
+}
+
+const char* thread_get_name(uint32_t id)
+{
+	const char* name = NULL;
+	thread_registry_lock();
+	for (int i = 0; i < s_thread_name_count; ++i)
+	{
+		if (s_thread_names[i].id == id)
+		{
+			name = s_thread_names[i].name;
+			break;
+		}
+	}
+	thread_registry_unlock();
+	return name;
+}
+
+void thread_for_each_name(void (*function)(uint32_t id, const char* name, void* user), void* user)
+{
+	thread_registry_lock();
+	for (int i = 0; i < s_thread_name_count; ++i)
+	{
+		function(s_thread_names[i].id, s_thread_names[i].name, user);
+	}
+	thread_registry_unlock();
+}
+
+void thread_configure(const char* name_prefix, uint64_t core_mask, thread_priority_t priority)
+{
+	thread_registry_lock();
+	if (s_thread_config_count < k_thread_max_configs)
+	{
+		thread_config_t* config = &s_thread_configs[s_thread_config_count++];
+		snprintf(config->prefix, sizeof(config->prefix), "%s", name_prefix);
+		config->core_mask = core_mask;
+		config->priority = priority;
+	}
+	thread_registry_unlock();
+}
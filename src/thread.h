@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 // Threading support.
@@ -13,8 +14,52 @@ thread_t* thread_create(int (*function)(void*), void* data);
 
 // Waits for a thread to complete and destroys it.
 // Returns the thread's exit code.
-int thread_destroy(thread);
+int thread_destroy(thread_t* thread);
 
 // Puts the calling thread to sleep for the specified number of milliseconds.
 // Thread will sleep for *approximately* the specified time.
 void thread_sleep(uint32_t ms);
+
+// Gets the operating system's identifier for the calling thread.
+// Never zero.
+uint32_t thread_get_id();
+
+// Gets the number of logical processors in the system.
+int thread_get_core_count();
+
+// Scheduling priority of a thread, relative to other threads in the process.
+typedef enum thread_priority_t
+{
+	k_thread_priority_low,
+	k_thread_priority_normal,
+	k_thread_priority_high,
+	k_thread_priority_critical,
+} thread_priority_t;
+
+// Restricts a thread to the cores set in core_mask, bit n being core n.
+// Pass NULL for the calling thread.
+// Returns false if the operating system refused the mask.
+bool thread_set_affinity(thread_t* thread, uint64_t core_mask);
+
+// Sets a thread's scheduling priority.
+// Pass NULL for the calling thread.
+// Returns false if the operating system refused; raising priority above
+// normal can need elevated privileges outside Windows.
+bool thread_set_priority(thread_t* thread, thread_priority_t priority);
+
+// Names a thread for debuggers, profilers and trace output.
+// Pass NULL for the calling thread.
+// Any scheduling registered with thread_configure for the name is applied.
+void thread_set_name(thread_t* thread, const char* name);
+
+// Gets the name given to the thread with operating system identifier id.
+// Returns NULL if the thread was never named.
+const char* thread_get_name(uint32_t id);
+
+// Calls function once for each named thread, with its identifier and name.
+void thread_for_each_name(void (*function)(uint32_t id, const char* name, void* user), void* user);
+
+// Registers scheduling for threads whose names begin with name_prefix.
+// Meant to be called at startup, before the threads are created.
+// A core_mask of zero leaves the thread free to run on any core.
+void thread_configure(const char* name_prefix, uint64_t core_mask, thread_priority_t priority);
@@ -1041,6 +1041,36 @@ void tlsf_remove_pool(tlsf_t tlsf, pool_t pool)
 	remove_free_block(control, block, fl, sl);
 }
 
+void tlsf_extend_pool(tlsf_t tlsf, pool_t pool, size_t bytes, size_t extra_bytes)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	const size_t pool_bytes = align_down(bytes - tlsf_pool_overhead(), ALIGN_SIZE);
+	const size_t block_bytes = align_down(extra_bytes, ALIGN_SIZE) - block_header_overhead;
+
+	block_header_t* block;
+	block_header_t* next;
+
+	tlsf_assert(block_bytes >= block_size_min && "extension too small");
+
+	/*
+	** Turn the sentinel at the old end of the pool into a free block
+	** covering the new memory, with a new sentinel after it.
+	*/
+	block = offset_to_block(pool, pool_bytes);
+	tlsf_assert(block_size(block) == 0 && "pool must end with its sentinel block");
+	block_set_size(block, block_bytes);
+	block_set_free(block);
+
+	next = block_link_next(block);
+	block_set_size(next, 0);
+	block_set_used(next);
+	block_set_prev_free(next);
+
+	/* Merge with the last block of the old pool if it was free. */
+	block = block_merge_prev(control, block);
+	block_insert(control, block);
+}
+
 /*
 ** TLSF main interface.
 */
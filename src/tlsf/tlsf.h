@@ -58,6 +58,8 @@ pool_t tlsf_get_pool(tlsf_t tlsf);
 /* Add/remove memory pools. */
 pool_t tlsf_add_pool(tlsf_t tlsf, void* mem, size_t bytes);
 void tlsf_remove_pool(tlsf_t tlsf, pool_t pool);
+/* Grow a pool of 'bytes' into 'extra_bytes' of memory directly after it. */
+void tlsf_extend_pool(tlsf_t tlsf, pool_t pool, size_t bytes, size_t extra_bytes);
 
 /* malloc/memalign/realloc/free replacements. */
 void* tlsf_malloc(tlsf_t tlsf, size_t bytes);
@@ -4,6 +4,7 @@
 #include "atomic.h"
 #include "mutex.h"
 #include "fs.h"
+#include "thread.h"
  
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
@@ -13,6 +14,25 @@
 #include <string.h>
 #include <stdio.h> 
 
+// Contended mutex waits are reported from inside mutex_unlock, which can run
+// while this thread is in the middle of appending to the trace. They are
+// queued here without locking and appended at the next event boundary.
+enum
+{
+	k_trace_contention_capacity = 256,
+};
+
+typedef struct trace_contention_t
+{
+	const char* name;
+	uint64_t start_ticks;
+	uint64_t end_ticks;
+	uint32_t thread_id;
+
+	// One past the write index that filled this slot, once it is complete.
+	int sequence;
+} trace_contention_t;
+
 typedef struct trace_t
 {
 	heap_t* heap;
@@ -22,8 +42,14 @@ typedef struct trace_t
 	bool on;
 	const char* path;
 	char* buffer;
+	size_t buffer_size;
+	size_t buffer_capacity;
 	stack_t* name_stack;
 	mutex_t* mutex;
+
+	trace_contention_t contentions[k_trace_contention_capacity];
+	int contention_write;
+	int contention_read;
 } trace_t;
 
 typedef struct stack_t
@@ -47,15 +73,99 @@ trace_t* trace_create(heap_t* heap, int event_capacity)
 	trace->event_count = 0;
 	trace->start_timestamp = timer_ticks_to_us(timer_get_ticks());
 	trace->on = false;
-	trace->buffer = heap_alloc(heap, 4096, 8);
+	trace->buffer_capacity = 4096;
+	trace->buffer = heap_alloc(heap, trace->buffer_capacity, 8);
 	const char* start_string = "{\n\"displayTimeUnit\": \"ns\", \"traceEvents\" : [\n";
-	strcpy_s(trace->buffer, 4096, start_string);
+	strcpy_s(trace->buffer, trace->buffer_capacity, start_string);
+	trace->buffer_size = strlen(start_string);
 	trace->name_stack = heap_alloc(heap, sizeof(stack_t), 8);
 	trace->name_stack->tail = NULL;
-	trace->mutex = mutex_create();
+	trace->mutex = mutex_create_named("trace");
+	memset(trace->contentions, 0, sizeof(trace->contentions));
+	trace->contention_write = 0;
+	trace->contention_read = 0;
 	return trace;
 }
 
+// Append a string to the event buffer, doubling its capacity as needed.
+// Trace mutex must be held.
+static void trace_append(trace_t* trace, const char* string)
+{
+	size_t length = strlen(string);
+	if (trace->buffer_size + length + 1 > trace->buffer_capacity)
+	{
+		size_t capacity = trace->buffer_capacity * 2;
+		while (trace->buffer_size + length + 1 > capacity)
+		{
+			capacity *= 2;
+		}
+		char* buffer = heap_realloc(trace->heap, trace->buffer, capacity, 8);
+		if (!buffer)
+		{
+			return;
+		}
+		trace->buffer = buffer;
+		trace->buffer_capacity = capacity;
+	}
+	memcpy(trace->buffer + trace->buffer_size, string, length + 1);
+	trace->buffer_size += length;
+}
+
+// Queue a contended wait on a named mutex.
+// Dropped when the queue is full.
+static void trace_mutex_contention(const char* name, uint64_t start_ticks, uint64_t end_ticks, void* user)
+{
+	trace_t* trace = user;
+	if (!trace->on) return;
+	int write = atomic_load(&trace->contention_write);
+	while (true)
+	{
+		if ((unsigned)(write - atomic_load(&trace->contention_read)) >= k_trace_contention_capacity)
+		{
+			return;
+		}
+		int previous = atomic_compare_and_exchange(&trace->contention_write, write, write + 1);
+		if (previous == write)
+		{
+			break;
+		}
+		write = previous;
+	}
+	trace_contention_t* contention = &trace->contentions[(unsigned)write % k_trace_contention_capacity];
+	contention->name = name;
+	contention->start_ticks = start_ticks;
+	contention->end_ticks = end_ticks;
+	contention->thread_id = GetCurrentThreadId();
+	atomic_store(&contention->sequence, write + 1);
+}
+
+// Append queued contended waits as complete events.
+// Trace mutex must be held.
+static void trace_flush_contentions(trace_t* trace)
+{
+	int read = trace->contention_read;
+	while (read != atomic_load(&trace->contention_write))
+	{
+		trace_contention_t* contention = &trace->contentions[(unsigned)read % k_trace_contention_capacity];
+		if (atomic_load(&contention->sequence) != read + 1)
+		{
+			// Claimed but not yet filled in; picked up by a later flush.
+			break;
+		}
+		int start_us = (int)(timer_ticks_to_us(contention->start_ticks) - trace->start_timestamp);
+		int duration_us = (int)(timer_ticks_to_us(contention->end_ticks) - timer_ticks_to_us(contention->start_ticks));
+		char event[192];
+		snprintf(event, sizeof(event), "\",\"ph\":\"X\",\"pid\":%d,\"tid\":\"%u\",\"ts\":\"%d\",\"dur\":\"%d\"},\n",
+			(int)GetCurrentProcessId(), contention->thread_id, start_us, duration_us);
+		const char* name = contention->name;
+		// Release the slot before appending; the append may queue more waits.
+		atomic_store(&trace->contention_read, ++read);
+		trace_append(trace, "{\"name\":\"mutex wait: ");
+		trace_append(trace, name);
+		trace_append(trace, event);
+	}
+}
+
 void trace_destroy(trace_t* trace)
 {
 	stack_element_t* current = trace->name_stack->tail;
@@ -90,15 +200,16 @@ void trace_duration_push(trace_t* trace, const char* name)
 	snprintf(ts, ts_len, "%d", cur_ts);
 	//Append a formatted event to the buffer
 	mutex_lock(trace->mutex);
-	strcat_s(trace->buffer, 4096, "{\"name\":\"");
-	strcat_s(trace->buffer, 4096, name);
-	strcat_s(trace->buffer, 4096, "\",\"ph\":\"B\",\"pid\":");
-	strcat_s(trace->buffer, 4096, pid);
-	strcat_s(trace->buffer, 4096, ",\"tid\":\"");
-	strcat_s(trace->buffer, 4096, tid);
-	strcat_s(trace->buffer, 4096, "\",\"ts\":\"");
-	strcat_s(trace->buffer, 4096, ts);
-	strcat_s(trace->buffer, 4096, "\"},\n");
+	trace_flush_contentions(trace);
+	trace_append(trace, "{\"name\":\"");
+	trace_append(trace, name);
+	trace_append(trace, "\",\"ph\":\"B\",\"pid\":");
+	trace_append(trace, pid);
+	trace_append(trace, ",\"tid\":\"");
+	trace_append(trace, tid);
+	trace_append(trace, "\",\"ts\":\"");
+	trace_append(trace, ts);
+	trace_append(trace, "\"},\n");
 	heap_free(trace->heap, pid);
 	heap_free(trace->heap, tid);
 	heap_free(trace->heap, ts);
@@ -136,16 +247,17 @@ void trace_duration_pop(trace_t* trace)
 	snprintf(ts, ts_len, "%d", cur_ts);
 	//Append a formatted event to the buffer
 	mutex_lock(trace->mutex);
+	trace_flush_contentions(trace);
 	const char* name = trace->name_stack->tail->name;
-	strcat_s(trace->buffer, 4096, "{\"name\":\"");
-	strcat_s(trace->buffer, 4096, name);
-	strcat_s(trace->buffer, 4096, "\",\"ph\":\"E\",\"pid\":");
-	strcat_s(trace->buffer, 4096, pid);
-	strcat_s(trace->buffer, 4096, ",\"tid\":\"");
-	strcat_s(trace->buffer, 4096, tid);
-	strcat_s(trace->buffer, 4096, "\",\"ts\":\"");
-	strcat_s(trace->buffer, 4096, ts);
-	strcat_s(trace->buffer, 4096, "\"},\n");
+	trace_append(trace, "{\"name\":\"");
+	trace_append(trace, name);
+	trace_append(trace, "\",\"ph\":\"E\",\"pid\":");
+	trace_append(trace, pid);
+	trace_append(trace, ",\"tid\":\"");
+	trace_append(trace, tid);
+	trace_append(trace, "\",\"ts\":\"");
+	trace_append(trace, ts);
+	trace_append(trace, "\"},\n");
 
 	heap_free(trace->heap, pid);
 	heap_free(trace->heap, tid);
@@ -161,16 +273,35 @@ void trace_capture_start(trace_t* trace, const char* path)
 {
 	trace->on = true;
 	trace->path = path;
+	mutex_profile_set_contention_function(trace_mutex_contention, trace);
+}
+
+// Append a metadata event so viewers label a thread's track with its name.
+// Trace mutex must be held.
+static void trace_append_thread_name(uint32_t id, const char* name, void* user)
+{
+	trace_t* trace = user;
+	char event[128];
+	snprintf(event, sizeof(event), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":\"%u\",\"args\":{\"name\":\"",
+		(int)GetCurrentProcessId(), id);
+	trace_append(trace, event);
+	trace_append(trace, name);
+	trace_append(trace, "\"}},\n");
 }
 
 void trace_capture_stop(trace_t* trace)
 {
 	trace->on = false;
+	mutex_profile_set_contention_function(NULL, NULL);
+	mutex_lock(trace->mutex);
+	trace_flush_contentions(trace);
+	thread_for_each_name(trace_append_thread_name, trace);
+	mutex_unlock(trace->mutex);
 	//Remove an extra comma
-	trace->buffer[strlen(trace->buffer) - 2] = ' ';
-	strcat_s(trace->buffer, 4096, "]\n}");
-	fs_t* fs = fs_create(trace->heap, 16);
-	fs_work_t* write_work = fs_write(fs, trace->path, trace->buffer, strlen(trace->buffer), false);
+	trace->buffer[trace->buffer_size - 2] = ' ';
+	trace_append(trace, "]\n}");
+	fs_t* fs = fs_create(trace->heap, 16, NULL);
+	fs_work_t* write_work = fs_write(fs, trace->path, trace->buffer, trace->buffer_size, false);
 	fs_work_destroy(write_work);
 	fs_destroy(fs);
 }
@@ -2,6 +2,8 @@
 #include "rigidbody.h"
 #include "box_collider.h"
 
+#include <xmmintrin.h>
+
 void transform_identity(transform_t* transform)
 {
 	transform->translation = vec3f_zero();
@@ -52,6 +54,93 @@ void transform_to_matrix(const transform_t* transform, mat4f_t* output)
 	output->data[3][3] = 1.0f;
 }
 
+void transform_to_matrices(const transform_t* transforms, mat4f_t* outputs, int count)
+{
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 two = _mm_set1_ps(2.0f);
+	const __m128 zero = _mm_setzero_ps();
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		const transform_t* t = &transforms[i];
+
+		// Transpose four transforms so each register holds one field of all
+		// four. The unaligned loads of scale and translation read one float
+		// past the field, which is still inside the transform.
+		__m128 qx = _mm_loadu_ps(&t[0].rotation.x);
+		__m128 qy = _mm_loadu_ps(&t[1].rotation.x);
+		__m128 qz = _mm_loadu_ps(&t[2].rotation.x);
+		__m128 qw = _mm_loadu_ps(&t[3].rotation.x);
+		_MM_TRANSPOSE4_PS(qx, qy, qz, qw);
+
+		__m128 sx = _mm_loadu_ps(&t[0].scale.x);
+		__m128 sy = _mm_loadu_ps(&t[1].scale.x);
+		__m128 sz = _mm_loadu_ps(&t[2].scale.x);
+		__m128 sw = _mm_loadu_ps(&t[3].scale.x);
+		_MM_TRANSPOSE4_PS(sx, sy, sz, sw);
+
+		__m128 tx = _mm_loadu_ps(&t[0].translation.x);
+		__m128 ty = _mm_loadu_ps(&t[1].translation.x);
+		__m128 tz = _mm_loadu_ps(&t[2].translation.x);
+		__m128 tw = _mm_loadu_ps(&t[3].translation.x);
+		_MM_TRANSPOSE4_PS(tx, ty, tz, tw);
+
+		__m128 xx = _mm_mul_ps(qx, qx);
+		__m128 yy = _mm_mul_ps(qy, qy);
+		__m128 zz = _mm_mul_ps(qz, qz);
+		__m128 xy = _mm_mul_ps(qx, qy);
+		__m128 xz = _mm_mul_ps(qx, qz);
+		__m128 yz = _mm_mul_ps(qy, qz);
+		__m128 xw = _mm_mul_ps(qx, qw);
+		__m128 yw = _mm_mul_ps(qy, qw);
+		__m128 zw = _mm_mul_ps(qz, qw);
+
+		__m128 m00 = _mm_mul_ps(sx, _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))));
+		__m128 m10 = _mm_mul_ps(sy, _mm_mul_ps(two, _mm_sub_ps(xy, zw)));
+		__m128 m20 = _mm_mul_ps(sz, _mm_mul_ps(two, _mm_add_ps(xz, yw)));
+		__m128 m01 = _mm_mul_ps(sx, _mm_mul_ps(two, _mm_add_ps(xy, zw)));
+		__m128 m11 = _mm_mul_ps(sy, _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))));
+		__m128 m21 = _mm_mul_ps(sz, _mm_mul_ps(two, _mm_sub_ps(yz, xw)));
+		__m128 m02 = _mm_mul_ps(sx, _mm_mul_ps(two, _mm_sub_ps(xz, yw)));
+		__m128 m12 = _mm_mul_ps(sy, _mm_mul_ps(two, _mm_add_ps(yz, xw)));
+		__m128 m22 = _mm_mul_ps(sz, _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))));
+
+		// Transpose back: each register becomes one row of one matrix.
+		__m128 row0_w = zero;
+		__m128 row1_w = zero;
+		__m128 row2_w = zero;
+		__m128 row3_w = one;
+		_MM_TRANSPOSE4_PS(m00, m01, m02, row0_w);
+		_MM_TRANSPOSE4_PS(m10, m11, m12, row1_w);
+		_MM_TRANSPOSE4_PS(m20, m21, m22, row2_w);
+		_MM_TRANSPOSE4_PS(tx, ty, tz, row3_w);
+
+		mat4f_t* out = &outputs[i];
+		_mm_storeu_ps(out[0].data[0], m00);
+		_mm_storeu_ps(out[1].data[0], m01);
+		_mm_storeu_ps(out[2].data[0], m02);
+		_mm_storeu_ps(out[3].data[0], row0_w);
+		_mm_storeu_ps(out[0].data[1], m10);
+		_mm_storeu_ps(out[1].data[1], m11);
+		_mm_storeu_ps(out[2].data[1], m12);
+		_mm_storeu_ps(out[3].data[1], row1_w);
+		_mm_storeu_ps(out[0].data[2], m20);
+		_mm_storeu_ps(out[1].data[2], m21);
+		_mm_storeu_ps(out[2].data[2], m22);
+		_mm_storeu_ps(out[3].data[2], row2_w);
+		_mm_storeu_ps(out[0].data[3], tx);
+		_mm_storeu_ps(out[1].data[3], ty);
+		_mm_storeu_ps(out[2].data[3], tz);
+		_mm_storeu_ps(out[3].data[3], row3_w);
+	}
+
+	for (; i < count; ++i)
+	{
+		transform_to_matrix(&transforms[i], &outputs[i]);
+	}
+}
+
 void transform_multiply(transform_t* result, const transform_t* t)
 {
 	const vec3f_t scaled_translation = vec3f_mul(result->translation, t->scale);
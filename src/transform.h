@@ -30,6 +30,10 @@ void transform_identity(transform_t* transform);
 // Convert a transform to a matrix representation.
 void transform_to_matrix(const transform_t* transform, mat4f_t* output);
 
+// Convert an array of count transforms to matrices, four at a time with SSE.
+// Gives the same results as transform_to_matrix on each.
+void transform_to_matrices(const transform_t* transforms, mat4f_t* outputs, int count);
+
 // Combine to transforms -- result and t -- and store the output in result.
 void transform_multiply(transform_t* result, const transform_t* t);
 
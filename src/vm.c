@@ -0,0 +1,249 @@
+#if !defined(_WIN32)
+#define _GNU_SOURCE
+#endif
+
+#include "vm.h"
+
+#include <stdint.h>
+
+#if defined(_WIN32)
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+size_t vm_page_size()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+}
+
+// Reservations start on, and take address space in, multiples of this.
+static size_t vm_allocation_granularity()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwAllocationGranularity;
+}
+
+static size_t vm_round_to_granularity(size_t size)
+{
+	size_t granularity = vm_allocation_granularity();
+	return (size + (granularity - 1)) & ~(granularity - 1);
+}
+
+void* vm_alloc(size_t size)
+{
+	// The rest of the granule cannot be used by any other reservation, so
+	// reserve it and leave it for vm_remap() to grow into.
+	void* address = VirtualAlloc(NULL, vm_round_to_granularity(size), MEM_RESERVE, PAGE_READWRITE);
+	if (address && !VirtualAlloc(address, size, MEM_COMMIT, PAGE_READWRITE))
+	{
+		VirtualFree(address, 0, MEM_RELEASE);
+		return NULL;
+	}
+	return address;
+}
+
+void* vm_reserve(size_t size)
+{
+	return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+bool vm_commit(void* address, size_t size)
+{
+	return VirtualAlloc(address, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+}
+
+size_t vm_huge_page_size()
+{
+	return GetLargePageMinimum();
+}
+
+void* vm_alloc_huge(size_t size)
+{
+	// Large pages need the lock pages privilege; most processes lack it.
+	size_t huge_page_size = vm_huge_page_size();
+	if (huge_page_size && size % huge_page_size == 0)
+	{
+		void* address = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+		if (address)
+		{
+			return address;
+		}
+	}
+	return vm_alloc(size);
+}
+
+void vm_free(void* address, size_t size)
+{
+	// Pages grown by vm_remap() may span several reservations.
+	char* cursor = address;
+	char* end = cursor + size;
+	while (cursor < end)
+	{
+		MEMORY_BASIC_INFORMATION info;
+		if (!VirtualQuery(cursor, &info, sizeof(info)))
+		{
+			break;
+		}
+		char* next = (char*)info.BaseAddress + info.RegionSize;
+		if (info.State != MEM_FREE && info.AllocationBase == cursor)
+		{
+			VirtualFree(cursor, 0, MEM_RELEASE);
+		}
+		cursor = next;
+	}
+}
+
+void* vm_remap(void* address, size_t old_size, size_t new_size)
+{
+	char* end = (char*)address + old_size;
+	if (new_size <= old_size)
+	{
+		// Shrunk pages stay reserved so a later grow can commit them again.
+		// Large pages cannot be decommitted.
+		if (new_size < old_size &&
+			!VirtualFree((char*)address + new_size, old_size - new_size, MEM_DECOMMIT))
+		{
+			return NULL;
+		}
+		return address;
+	}
+
+	// Windows cannot move committed pages to a new address, so only grow in
+	// place: first into the rest of the pages' own reservation, then into
+	// free address space right after it. Reservations end on a granularity
+	// boundary, so a new one can start exactly there.
+	MEMORY_BASIC_INFORMATION last;
+	MEMORY_BASIC_INFORMATION next;
+	if (!VirtualQuery(end - 1, &last, sizeof(last)) ||
+		!VirtualQuery(end, &next, sizeof(next)))
+	{
+		return NULL;
+	}
+	size_t grow_size = new_size - old_size;
+	size_t reserved_size = 0;
+	if (next.State == MEM_RESERVE && next.AllocationBase == last.AllocationBase)
+	{
+		reserved_size = next.RegionSize < grow_size ? next.RegionSize : grow_size;
+		if (reserved_size == grow_size)
+		{
+			return VirtualAlloc(end, grow_size, MEM_COMMIT, PAGE_READWRITE) ? address : NULL;
+		}
+	}
+
+	char* extension = end + reserved_size;
+	size_t extension_size = grow_size - reserved_size;
+	MEMORY_BASIC_INFORMATION free_space;
+	if (((uintptr_t)extension & (vm_allocation_granularity() - 1)) != 0 ||
+		!VirtualQuery(extension, &free_space, sizeof(free_space)) ||
+		free_space.State != MEM_FREE ||
+		free_space.RegionSize < vm_round_to_granularity(extension_size))
+	{
+		return NULL;
+	}
+	if (!VirtualAlloc(extension, vm_round_to_granularity(extension_size), MEM_RESERVE, PAGE_READWRITE))
+	{
+		return NULL;
+	}
+	if (!VirtualAlloc(extension, extension_size, MEM_COMMIT, PAGE_READWRITE) ||
+		(reserved_size && !VirtualAlloc(end, reserved_size, MEM_COMMIT, PAGE_READWRITE)))
+	{
+		VirtualFree(extension, 0, MEM_RELEASE);
+		return NULL;
+	}
+	return address;
+}
+
+void vm_discard(void* address, size_t size)
+{
+	size_t page_size = vm_page_size();
+	uintptr_t begin = ((uintptr_t)address + page_size - 1) & ~(uintptr_t)(page_size - 1);
+	uintptr_t end = ((uintptr_t)address + size) & ~(uintptr_t)(page_size - 1);
+	if (begin < end)
+	{
+		VirtualAlloc((void*)begin, end - begin, MEM_RESET, PAGE_READWRITE);
+	}
+}
+
+#else
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+size_t vm_page_size()
+{
+	return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+void* vm_alloc(size_t size)
+{
+	void* address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return address != MAP_FAILED ? address : NULL;
+}
+
+void* vm_reserve(size_t size)
+{
+	void* address = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return address != MAP_FAILED ? address : NULL;
+}
+
+bool vm_commit(void* address, size_t size)
+{
+	return mprotect(address, size, PROT_READ | PROT_WRITE) == 0;
+}
+
+size_t vm_huge_page_size()
+{
+#if defined(MADV_HUGEPAGE)
+	// Transparent huge pages are PMD sized: 2 MB on x86-64.
+	return 2 * 1024 * 1024;
+#else
+	return 0;
+#endif
+}
+
+void* vm_alloc_huge(size_t size)
+{
+	void* address = vm_alloc(size);
+#if defined(MADV_HUGEPAGE)
+	if (address)
+	{
+		madvise(address, size, MADV_HUGEPAGE);
+	}
+#endif
+	return address;
+}
+
+void vm_free(void* address, size_t size)
+{
+	munmap(address, size);
+}
+
+void* vm_remap(void* address, size_t old_size, size_t new_size)
+{
+#if defined(MREMAP_MAYMOVE)
+	void* new_address = mremap(address, old_size, new_size, MREMAP_MAYMOVE);
+	return new_address != MAP_FAILED ? new_address : NULL;
+#else
+	if (new_size < old_size)
+	{
+		munmap((char*)address + new_size, old_size - new_size);
+	}
+	return new_size <= old_size ? address : NULL;
+#endif
+}
+
+void vm_discard(void* address, size_t size)
+{
+	size_t page_size = vm_page_size();
+	uintptr_t begin = ((uintptr_t)address + page_size - 1) & ~(uintptr_t)(page_size - 1);
+	uintptr_t end = ((uintptr_t)address + size) & ~(uintptr_t)(page_size - 1);
+	if (begin < end)
+	{
+		madvise((void*)begin, end - begin, MADV_DONTNEED);
+	}
+}
+
+#endif
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Virtual memory pages from the OS.
+// Addresses and sizes are rounded out to whole pages.
+// Implemented with VirtualAlloc on Windows and mmap elsewhere.
+
+// Get the OS page size in bytes.
+size_t vm_page_size();
+
+// Reserve and commit zeroed read/write pages.
+// Returns NULL if out of memory.
+void* vm_alloc(size_t size);
+
+// Reserve a range of address space without backing it with memory.
+// Pages must be committed with vm_commit() before use.
+// Returns NULL if the address space is not available.
+void* vm_reserve(size_t size);
+
+// Commit zeroed read/write pages inside a range from vm_reserve().
+// Returns false if out of memory.
+bool vm_commit(void* address, size_t size);
+
+// Get the size of the OS huge pages in bytes, or zero if unsupported.
+size_t vm_huge_page_size();
+
+// Reserve and commit zeroed read/write pages, backed by huge pages where
+// the OS allows. Falls back to ordinary pages otherwise.
+// Size should be a multiple of vm_huge_page_size().
+// Returns NULL if out of memory.
+void* vm_alloc_huge(size_t size);
+
+// Release pages previously returned by vm_alloc(), vm_alloc_huge() or
+// vm_reserve(). Size must match the size passed when allocating.
+void vm_free(void* address, size_t size);
+
+// Resize pages previously returned by vm_alloc() or vm_alloc_huge()
+// without copying their contents.
+// Returns the address of the resized pages, which may differ from the
+// original address if the OS can move pages, or NULL if they cannot be
+// resized. The original pages are untouched on failure.
+// Windows cannot move pages, so growth only succeeds in place: into the
+// rest of the allocation granule vm_alloc() reserved, then into free
+// address space right after it. Callers must be ready to copy.
+void* vm_remap(void* address, size_t old_size, size_t new_size);
+
+// Tell the OS the contents of a range of pages are no longer needed.
+// The pages stay accessible; their physical memory may be reclaimed and
+// their contents are undefined on next access.
+// Only whole pages inside the range are affected.
+void vm_discard(void* address, size_t size);